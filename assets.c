@@ -0,0 +1,681 @@
+/*********************************************************************
+ * SNACK DISPENSER - COMPILED ASSETS
+ * * Loader/writer for the .snkf frame and .snka delta animation
+ * formats (see assets.h), plus the animation playback cursor.
+ *********************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assets.h"
+
+/* ===== Pixel formats ===== */
+int pixfmt_bpp(int fmt)
+{
+    switch (fmt) {
+        case PIXFMT_RGB565: return 2;
+        case PIXFMT_BGRA32: return 4;
+        default: return 0;
+    }
+}
+
+const char *pixfmt_name(int fmt)
+{
+    switch (fmt) {
+        case PIXFMT_RGB565: return "rgb565";
+        case PIXFMT_BGRA32: return "bgra32";
+        default: return "?";
+    }
+}
+
+int pixfmt_parse(const char *s)
+{
+    if (!s) return -1;
+    if (strcmp(s, "rgb565") == 0) return PIXFMT_RGB565;
+    if (strcmp(s, "bgra32") == 0) return PIXFMT_BGRA32;
+    return -1;
+}
+
+void pixel_pack(unsigned char *dst, int fmt, unsigned char r, unsigned char g, unsigned char b)
+{
+    if (fmt == PIXFMT_RGB565) {
+        unsigned v = ((unsigned)(r >> 3) << 11) | ((unsigned)(g >> 2) << 5) | (unsigned)(b >> 3);
+        dst[0] = (unsigned char)(v & 0xFF);
+        dst[1] = (unsigned char)(v >> 8);
+    } else {
+        dst[0] = b;
+        dst[1] = g;
+        dst[2] = r;
+        dst[3] = 0xFF;
+    }
+}
+
+void pixel_unpack(const unsigned char *p, int fmt, int rgb[3])
+{
+    if (fmt == PIXFMT_RGB565) {
+        unsigned v = (unsigned)p[0] | ((unsigned)p[1] << 8);
+        rgb[0] = (int)((v >> 11) & 0x1F) << 3;
+        rgb[1] = (int)((v >> 5) & 0x3F) << 2;
+        rgb[2] = (int)(v & 0x1F) << 3;
+    } else {
+        rgb[0] = p[2];
+        rgb[1] = p[1];
+        rgb[2] = p[0];
+    }
+}
+
+/* ===== Frames ===== */
+Frame *frame_alloc(int width, int height, int fmt)
+{
+    int bpp = pixfmt_bpp(fmt);
+    if (width <= 0 || height <= 0 || bpp == 0) return NULL;
+
+    Frame *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    f->width = width;
+    f->height = height;
+    f->format = fmt;
+    f->bpp = bpp;
+    f->size = (size_t)width * (size_t)height * (size_t)bpp;
+    f->pixels = calloc(1, f->size);
+    if (!f->pixels) { free(f); return NULL; }
+    return f;
+}
+
+void frame_free(Frame *f)
+{
+    if (!f) return;
+    free(f->pixels);
+    free(f);
+}
+
+/* ===== RLE (per-pixel PackBits) ===== */
+size_t rle_bound(size_t npix, int bpp)
+{
+    /* worst case: all literals, one header byte per 128 pixels */
+    return npix * (size_t)bpp + (npix + 127) / 128;
+}
+
+size_t rle_encode(const unsigned char *src, size_t npix, int bpp, unsigned char *dst, size_t cap)
+{
+    size_t i = 0, o = 0;
+
+    while (i < npix) {
+        /* measure run at i */
+        size_t run = 1;
+        while (i + run < npix && run < 128 &&
+               memcmp(src + (i + run) * bpp, src + i * bpp, (size_t)bpp) == 0) run++;
+
+        if (run >= 2) {
+            if (o + 1 + (size_t)bpp > cap) return 0;
+            dst[o++] = (unsigned char)(0x80 | (run - 1));
+            memcpy(dst + o, src + i * bpp, (size_t)bpp);
+            o += (size_t)bpp;
+            i += run;
+            continue;
+        }
+
+        /* literal until the next run of 2+ */
+        size_t lit = 1;
+        while (i + lit < npix && lit < 128) {
+            if (i + lit + 1 < npix &&
+                memcmp(src + (i + lit) * bpp, src + (i + lit + 1) * bpp, (size_t)bpp) == 0) break;
+            lit++;
+        }
+        if (o + 1 + lit * (size_t)bpp > cap) return 0;
+        dst[o++] = (unsigned char)(lit - 1);
+        memcpy(dst + o, src + i * bpp, lit * (size_t)bpp);
+        o += lit * (size_t)bpp;
+        i += lit;
+    }
+    return o;
+}
+
+int rle_decode(const unsigned char *src, size_t srclen, int bpp, unsigned char *dst, size_t npix)
+{
+    size_t i = 0, p = 0;
+
+    while (i < srclen && p < npix) {
+        unsigned char h = src[i++];
+        size_t n = (size_t)(h & 0x7F) + 1;
+        if (p + n > npix) return -1;
+
+        if (h & 0x80) {
+            if (i + (size_t)bpp > srclen) return -1;
+            for (size_t k = 0; k < n; k++) memcpy(dst + (p + k) * bpp, src + i, (size_t)bpp);
+            i += (size_t)bpp;
+        } else {
+            if (i + n * (size_t)bpp > srclen) return -1;
+            memcpy(dst + p * bpp, src + i, n * (size_t)bpp);
+            i += n * (size_t)bpp;
+        }
+        p += n;
+    }
+    return (p == npix) ? 0 : -1;
+}
+
+/* ===== File I/O ===== */
+static void put_u16(unsigned char *p, unsigned v) { p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; }
+static void put_u32(unsigned char *p, unsigned long v)
+{
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = (v >> 16) & 0xFF; p[3] = (v >> 24) & 0xFF;
+}
+static unsigned get_u16(const unsigned char *p) { return (unsigned)p[0] | ((unsigned)p[1] << 8); }
+static unsigned long get_u32(const unsigned char *p)
+{
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+           ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+long frame_save(const Frame *f, const char *path, int compression)
+{
+    const unsigned char *payload = f->pixels;
+    size_t plen = f->size;
+    unsigned char *packed = NULL;
+
+    if (compression == SNKF_RLE) {
+        size_t npix = (size_t)f->width * (size_t)f->height;
+        size_t cap = rle_bound(npix, f->bpp);
+        packed = malloc(cap);
+        if (!packed) return -1;
+        plen = rle_encode(f->pixels, npix, f->bpp, packed, cap);
+        if (plen == 0) { free(packed); return -1; }
+        payload = packed;
+    } else {
+        compression = SNKF_RAW;
+    }
+
+    unsigned char hdr[SNKF_HEADER_SIZE] = {0};
+    memcpy(hdr, SNKF_MAGIC, 4);
+    put_u16(hdr + 4, SNKF_VERSION);
+    put_u16(hdr + 6, (unsigned)f->format);
+    put_u16(hdr + 8, (unsigned)f->width);
+    put_u16(hdr + 10, (unsigned)f->height);
+    put_u16(hdr + 12, (unsigned)compression);
+    put_u32(hdr + 16, (unsigned long)plen);
+    put_u32(hdr + 20, (unsigned long)f->size);
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) { free(packed); return -1; }
+    int ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+             fwrite(payload, 1, plen, fp) == plen;
+    if (fclose(fp) != 0) ok = 0;
+    free(packed);
+
+    return ok ? (long)(sizeof(hdr) + plen) : -1;
+}
+
+Frame *frame_load(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    unsigned char hdr[SNKF_HEADER_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || memcmp(hdr, SNKF_MAGIC, 4) != 0 ||
+        get_u16(hdr + 4) != SNKF_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+
+    int fmt = (int)get_u16(hdr + 6);
+    int w = (int)get_u16(hdr + 8);
+    int h = (int)get_u16(hdr + 10);
+    int comp = (int)get_u16(hdr + 12);
+    size_t plen = (size_t)get_u32(hdr + 16);
+
+    Frame *f = frame_alloc(w, h, fmt);
+    if (!f || (size_t)get_u32(hdr + 20) != f->size) { frame_free(f); fclose(fp); return NULL; }
+
+    int ok = 0;
+    if (comp == SNKF_RAW) {
+        ok = (plen == f->size) && fread(f->pixels, 1, f->size, fp) == f->size;
+    } else if (comp == SNKF_RLE) {
+        unsigned char *buf = malloc(plen ? plen : 1);
+        if (buf && fread(buf, 1, plen, fp) == plen)
+            ok = rle_decode(buf, plen, f->bpp, f->pixels, (size_t)w * (size_t)h) == 0;
+        free(buf);
+    }
+    fclose(fp);
+
+    if (!ok) { frame_free(f); return NULL; }
+    return f;
+}
+
+void asset_path_for(const char *img, const char *ext, char *out, size_t n)
+{
+    const char *slash = strrchr(img, '/');
+    const char *dot = strrchr(img, '.');
+    size_t stem = (dot && (!slash || dot > slash)) ? (size_t)(dot - img) : strlen(img);
+    snprintf(out, n, "%.*s%s", (int)stem, img, ext);
+}
+
+/* ===== Delta animations ===== */
+static unsigned char *rle_pack_rect(const Frame *f, const Rect *r, unsigned char *tmp, size_t *len)
+{
+    size_t row = (size_t)r->w * f->bpp;
+    for (int y = 0; y < r->h; y++)
+        memcpy(tmp + (size_t)y * row, f->pixels + ((size_t)(r->y + y) * f->width + r->x) * f->bpp, row);
+
+    size_t npix = (size_t)r->w * r->h;
+    size_t cap = rle_bound(npix, f->bpp);
+    unsigned char *out = malloc(cap);
+    if (!out) return NULL;
+    *len = rle_encode(tmp, npix, f->bpp, out, cap);
+    if (*len == 0) { free(out); return NULL; }
+    return out;
+}
+
+static int span_differs(const unsigned char *pa, const unsigned char *pb, int npix, int fmt, int bpp, int tol)
+{
+    if (memcmp(pa, pb, (size_t)npix * bpp) == 0) return 0;
+    if (tol <= 0) return 1;
+    for (int i = 0; i < npix; i++) {
+        int ca[3], cb[3];
+        pixel_unpack(pa + (size_t)i * bpp, fmt, ca);
+        pixel_unpack(pb + (size_t)i * bpp, fmt, cb);
+        for (int k = 0; k < 3; k++) if (abs(ca[k] - cb[k]) > tol) return 1;
+    }
+    return 0;
+}
+
+/* Mark differing tiles, then merge them into rectangles: horizontal
+ * runs per tile row, extended downwards while the span stays equal. */
+static int diff_rects(const Frame *a, const Frame *b, int tile, int tol, Rect **out)
+{
+    int tw = (a->width + tile - 1) / tile;
+    int th = (a->height + tile - 1) / tile;
+    unsigned char *mark = calloc((size_t)tw * th, 1);
+    Rect *rects = malloc(sizeof(Rect) * (size_t)tw * th);
+    int *open = malloc(sizeof(int) * (size_t)tw * th);
+    if (!mark || !rects || !open) { free(mark); free(rects); free(open); return -1; }
+
+    size_t row = (size_t)a->width * a->bpp;
+    for (int y = 0; y < a->height; y++) {
+        const unsigned char *pa = a->pixels + (size_t)y * row;
+        const unsigned char *pb = b->pixels + (size_t)y * row;
+        for (int tx = 0; tx < tw; tx++) {
+            unsigned char *m = &mark[(size_t)(y / tile) * tw + tx];
+            if (*m) continue;
+            int x0 = tx * tile;
+            int w = (x0 + tile > a->width) ? a->width - x0 : tile;
+            if (span_differs(pa + (size_t)x0 * a->bpp, pb + (size_t)x0 * a->bpp, w, a->format, a->bpp, tol)) *m = 1;
+        }
+    }
+
+    int n = 0, nopen = 0;
+    for (int ty = 0; ty < th; ty++) {
+        int nnext = 0;
+        for (int tx = 0; tx < tw; ) {
+            if (!mark[(size_t)ty * tw + tx]) { tx++; continue; }
+            int x0 = tx;
+            while (tx < tw && mark[(size_t)ty * tw + tx]) tx++;
+
+            int hit = -1;
+            for (int k = 0; k < nopen; k++) {
+                Rect *r = &rects[open[k]];
+                if (r->x == x0 && r->w == tx - x0) { hit = open[k]; break; }
+            }
+            if (hit >= 0) rects[hit].h++;
+            else { rects[n] = (Rect){ x0, ty, tx - x0, 1 }; hit = n++; }
+            open[nopen + nnext++] = hit;
+        }
+        memmove(open, open + nopen, sizeof(int) * (size_t)nnext);
+        nopen = nnext;
+    }
+
+    /* tile units -> pixels, clipped */
+    for (int i = 0; i < n; i++) {
+        Rect *r = &rects[i];
+        r->x *= tile; r->y *= tile; r->w *= tile; r->h *= tile;
+        if (r->x + r->w > a->width) r->w = a->width - r->x;
+        if (r->y + r->h > a->height) r->h = a->height - r->y;
+    }
+
+    free(mark);
+    free(open);
+    *out = rects;
+    return n;
+}
+
+int frame_diff_rects(const Frame *a, const Frame *b, int tile, int tol, Rect **out)
+{
+    if (a->width != b->width || a->height != b->height || a->format != b->format) return -1;
+    return diff_rects(a, b, tile > 0 ? tile : SNKA_TILE, tol, out);
+}
+
+/* dst = a + (b - a) * alpha / 256 inside r. Plain per-byte / per-lane
+ * loops over restrict rows so the compiler can vectorise them. */
+void frame_blend_rect(Frame *dst, const Frame *a, const Frame *b, const Rect *r, int alpha)
+{
+    if (alpha < 0) alpha = 0;
+    if (alpha > 256) alpha = 256;
+    const unsigned ia = 256u - (unsigned)alpha, ib = (unsigned)alpha;
+
+    for (int y = r->y; y < r->y + r->h; y++) {
+        size_t off = ((size_t)y * dst->width + r->x) * dst->bpp;
+
+        if (dst->format == PIXFMT_BGRA32) {
+            const unsigned char *restrict pa = a->pixels + off;
+            const unsigned char *restrict pb = b->pixels + off;
+            unsigned char *restrict pd = dst->pixels + off;
+            size_t n = (size_t)r->w * 4;
+            for (size_t i = 0; i < n; i++)
+                pd[i] = (unsigned char)((pa[i] * ia + pb[i] * ib) >> 8);
+        } else {
+            const uint16_t *restrict pa = (const uint16_t *)(a->pixels + off);
+            const uint16_t *restrict pb = (const uint16_t *)(b->pixels + off);
+            uint16_t *restrict pd = (uint16_t *)(dst->pixels + off);
+            for (int i = 0; i < r->w; i++) {
+                unsigned xa = pa[i], xb = pb[i];
+                unsigned rr = (((xa >> 11) & 0x1F) * ia + ((xb >> 11) & 0x1F) * ib) >> 8;
+                unsigned gg = (((xa >> 5) & 0x3F) * ia + ((xb >> 5) & 0x3F) * ib) >> 8;
+                unsigned bb = ((xa & 0x1F) * ia + (xb & 0x1F) * ib) >> 8;
+                pd[i] = (uint16_t)((rr << 11) | (gg << 5) | bb);
+            }
+        }
+    }
+}
+
+static void copy_rect(Frame *dst, const Frame *src, const Rect *r)
+{
+    frame_blit_rect(src, r, dst->pixels, (size_t)dst->width * dst->bpp);
+}
+
+/* Deltas are built against the reconstruction the player will actually
+ * hold, so tolerance-skipped tiles never drift: recon[t+1] is recon[t]
+ * with the dirty rects of frame t+1 pasted in. The wrap transition is
+ * diffed exactly against frame 0 so loops close bit-for-bit. */
+AnimAsset *animasset_build(Frame *const *frames, int nframes, int tile, int tol)
+{
+    if (nframes < 1) return NULL;
+    if (tile <= 0) tile = SNKA_TILE;
+    const Frame *f0 = frames[0];
+    for (int i = 1; i < nframes; i++)
+        if (frames[i]->width != f0->width || frames[i]->height != f0->height ||
+            frames[i]->format != f0->format) return NULL;
+
+    AnimAsset *a = calloc(1, sizeof(*a));
+    unsigned char *tmp = malloc(f0->size);
+    Frame *recon = frame_alloc(f0->width, f0->height, f0->format);
+    Frame *next = frame_alloc(f0->width, f0->height, f0->format);
+    if (!a || !tmp || !recon || !next) goto fail;
+    a->width = f0->width;
+    a->height = f0->height;
+    a->format = f0->format;
+    a->bpp = f0->bpp;
+    a->nframes = nframes;
+    a->tile = tile;
+    a->deltas = calloc((size_t)nframes, sizeof(Delta));
+
+    Rect whole = { 0, 0, f0->width, f0->height };
+    a->key = rle_pack_rect(f0, &whole, tmp, &a->key_len);
+    if (!a->deltas || !a->key) goto fail;
+    memcpy(recon->pixels, f0->pixels, f0->size);
+
+    for (int t = 0; t < nframes && nframes > 1; t++) {
+        int wrap = (t == nframes - 1);
+        const Frame *target = frames[(t + 1) % nframes];
+        Rect *rects = NULL;
+        int n = diff_rects(recon, target, tile, wrap ? 0 : tol, &rects);
+        if (n < 0) goto fail;
+
+        memcpy(next->pixels, recon->pixels, recon->size);
+        for (int i = 0; i < n; i++) copy_rect(next, target, &rects[i]);
+
+        Delta *d = &a->deltas[t];
+        d->rects = calloc((size_t)(n ? n : 1), sizeof(DeltaRect));
+        if (!d->rects) { free(rects); goto fail; }
+        d->nrects = n;
+        for (int i = 0; i < n; i++) {
+            DeltaRect *dr = &d->rects[i];
+            dr->rect = rects[i];
+            dr->fwd = rle_pack_rect(next, &rects[i], tmp, &dr->fwd_len);
+            dr->bwd = rle_pack_rect(recon, &rects[i], tmp, &dr->bwd_len);
+            if (!dr->fwd || !dr->bwd) { free(rects); goto fail; }
+        }
+        free(rects);
+
+        Frame *swap = recon; recon = next; next = swap;
+    }
+    free(tmp);
+    frame_free(recon);
+    frame_free(next);
+    return a;
+
+fail:
+    free(tmp);
+    frame_free(recon);
+    frame_free(next);
+    animasset_free(a);
+    return NULL;
+}
+
+void animasset_free(AnimAsset *a)
+{
+    if (!a) return;
+    if (a->deltas) {
+        for (int t = 0; t < a->nframes; t++) {
+            for (int i = 0; i < a->deltas[t].nrects; i++) {
+                free(a->deltas[t].rects[i].fwd);
+                free(a->deltas[t].rects[i].bwd);
+            }
+            free(a->deltas[t].rects);
+        }
+    }
+    free(a->deltas);
+    free(a->key);
+    free(a);
+}
+
+size_t animasset_bytes(const AnimAsset *a)
+{
+    size_t n = a->key_len;
+    for (int t = 0; t < a->nframes; t++)
+        for (int i = 0; i < a->deltas[t].nrects; i++)
+            n += a->deltas[t].rects[i].fwd_len + a->deltas[t].rects[i].bwd_len;
+    return n;
+}
+
+double animasset_dirty_ratio(const AnimAsset *a, int t)
+{
+    long area = 0;
+    for (int i = 0; i < a->deltas[t].nrects; i++)
+        area += (long)a->deltas[t].rects[i].rect.w * a->deltas[t].rects[i].rect.h;
+    return (double)area / ((double)a->width * a->height);
+}
+
+long animasset_save(const AnimAsset *a, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+
+    unsigned char hdr[20] = {0};
+    memcpy(hdr, SNKA_MAGIC, 4);
+    put_u16(hdr + 4, SNKA_VERSION);
+    put_u16(hdr + 6, (unsigned)a->format);
+    put_u16(hdr + 8, (unsigned)a->width);
+    put_u16(hdr + 10, (unsigned)a->height);
+    put_u16(hdr + 12, (unsigned)a->nframes);
+    put_u16(hdr + 14, (unsigned)a->tile);
+    put_u32(hdr + 16, (unsigned long)a->key_len);
+
+    long total = 0;
+    int ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+             fwrite(a->key, 1, a->key_len, fp) == a->key_len;
+    total += (long)(sizeof(hdr) + a->key_len);
+
+    for (int t = 0; ok && t < a->nframes; t++) {
+        const Delta *d = &a->deltas[t];
+        unsigned char dh[4] = {0};
+        put_u16(dh, (unsigned)d->nrects);
+        ok = fwrite(dh, 1, sizeof(dh), fp) == sizeof(dh);
+        total += (long)sizeof(dh);
+
+        for (int i = 0; ok && i < d->nrects; i++) {
+            const DeltaRect *dr = &d->rects[i];
+            unsigned char rh[16];
+            put_u16(rh + 0, (unsigned)dr->rect.x);
+            put_u16(rh + 2, (unsigned)dr->rect.y);
+            put_u16(rh + 4, (unsigned)dr->rect.w);
+            put_u16(rh + 6, (unsigned)dr->rect.h);
+            put_u32(rh + 8, (unsigned long)dr->fwd_len);
+            put_u32(rh + 12, (unsigned long)dr->bwd_len);
+            ok = fwrite(rh, 1, sizeof(rh), fp) == sizeof(rh) &&
+                 fwrite(dr->fwd, 1, dr->fwd_len, fp) == dr->fwd_len &&
+                 fwrite(dr->bwd, 1, dr->bwd_len, fp) == dr->bwd_len;
+            total += (long)(sizeof(rh) + dr->fwd_len + dr->bwd_len);
+        }
+    }
+
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? total : -1;
+}
+
+static unsigned char *read_blob(FILE *fp, size_t len)
+{
+    unsigned char *p = malloc(len ? len : 1);
+    if (p && fread(p, 1, len, fp) != len) { free(p); p = NULL; }
+    return p;
+}
+
+AnimAsset *animasset_load(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    unsigned char hdr[20];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || memcmp(hdr, SNKA_MAGIC, 4) != 0 ||
+        get_u16(hdr + 4) != SNKA_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+
+    AnimAsset *a = calloc(1, sizeof(*a));
+    if (!a) { fclose(fp); return NULL; }
+    a->format = (int)get_u16(hdr + 6);
+    a->bpp = pixfmt_bpp(a->format);
+    a->width = (int)get_u16(hdr + 8);
+    a->height = (int)get_u16(hdr + 10);
+    a->nframes = (int)get_u16(hdr + 12);
+    a->tile = (int)get_u16(hdr + 14);
+    a->key_len = (size_t)get_u32(hdr + 16);
+    if (a->bpp == 0 || a->nframes < 1) goto fail;
+
+    a->key = read_blob(fp, a->key_len);
+    a->deltas = calloc((size_t)a->nframes, sizeof(Delta));
+    if (!a->key || !a->deltas) goto fail;
+
+    for (int t = 0; t < a->nframes; t++) {
+        unsigned char dh[4];
+        if (fread(dh, 1, sizeof(dh), fp) != sizeof(dh)) goto fail;
+        Delta *d = &a->deltas[t];
+        int n = (int)get_u16(dh);
+        d->rects = calloc((size_t)(n ? n : 1), sizeof(DeltaRect));
+        if (!d->rects) goto fail;
+
+        for (int i = 0; i < n; i++) {
+            unsigned char rh[16];
+            if (fread(rh, 1, sizeof(rh), fp) != sizeof(rh)) goto fail;
+            DeltaRect *dr = &d->rects[i];
+            d->nrects = i + 1;
+            dr->rect = (Rect){ (int)get_u16(rh), (int)get_u16(rh + 2), (int)get_u16(rh + 4), (int)get_u16(rh + 6) };
+            dr->fwd_len = (size_t)get_u32(rh + 8);
+            dr->bwd_len = (size_t)get_u32(rh + 12);
+            if (dr->rect.x + dr->rect.w > a->width || dr->rect.y + dr->rect.h > a->height) goto fail;
+            dr->fwd = read_blob(fp, dr->fwd_len);
+            dr->bwd = read_blob(fp, dr->bwd_len);
+            if (!dr->fwd || !dr->bwd) goto fail;
+        }
+    }
+    fclose(fp);
+    return a;
+
+fail:
+    fclose(fp);
+    animasset_free(a);
+    return NULL;
+}
+
+/* ===== Playback cursor ===== */
+AnimCursor *animcursor_new(const AnimAsset *a)
+{
+    int maxr = 1;
+    for (int t = 0; t < a->nframes; t++) if (a->deltas[t].nrects > maxr) maxr = a->deltas[t].nrects;
+
+    AnimCursor *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->asset = a;
+    c->canvas = frame_alloc(a->width, a->height, a->format);
+    c->dirty = malloc(sizeof(Rect) * (size_t)maxr);
+    c->scratch = malloc(c->canvas ? c->canvas->size : 1);
+    if (!c->canvas || !c->dirty || !c->scratch ||
+        animcursor_seek(c, 0) < 0) { animcursor_free(c); return NULL; }
+    return c;
+}
+
+void animcursor_free(AnimCursor *c)
+{
+    if (!c) return;
+    frame_free(c->canvas);
+    free(c->dirty);
+    free(c->scratch);
+    free(c);
+}
+
+static int apply_rect(AnimCursor *c, const Rect *r, const unsigned char *rle, size_t len)
+{
+    Frame *f = c->canvas;
+    size_t npix = (size_t)r->w * r->h;
+    if (rle_decode(rle, len, f->bpp, c->scratch, npix) != 0) return -1;
+
+    size_t row = (size_t)r->w * f->bpp;
+    for (int y = 0; y < r->h; y++)
+        memcpy(f->pixels + ((size_t)(r->y + y) * f->width + r->x) * f->bpp, c->scratch + (size_t)y * row, row);
+    return 0;
+}
+
+int animcursor_step(AnimCursor *c, int dir)
+{
+    const AnimAsset *a = c->asset;
+    if (a->nframes < 2) { c->ndirty = 0; return 0; }
+
+    /* forward uses transition cur, backward undoes transition cur-1 */
+    int t = (dir >= 0) ? c->cur : (c->cur + a->nframes - 1) % a->nframes;
+    const Delta *d = &a->deltas[t];
+
+    for (int i = 0; i < d->nrects; i++) {
+        const DeltaRect *dr = &d->rects[i];
+        int rc = (dir >= 0) ? apply_rect(c, &dr->rect, dr->fwd, dr->fwd_len)
+                            : apply_rect(c, &dr->rect, dr->bwd, dr->bwd_len);
+        if (rc != 0) return -1;
+        c->dirty[i] = dr->rect;
+    }
+    c->ndirty = d->nrects;
+    c->cur = (dir >= 0) ? (c->cur + 1) % a->nframes : t;
+    return c->ndirty;
+}
+
+int animcursor_seek(AnimCursor *c, int idx)
+{
+    const AnimAsset *a = c->asset;
+    if (idx < 0 || idx >= a->nframes) return -1;
+
+    if (rle_decode(a->key, a->key_len, a->bpp, c->canvas->pixels,
+                   (size_t)a->width * a->height) != 0) return -1;
+    c->cur = 0;
+    for (int i = 0; i < idx; i++) if (animcursor_step(c, +1) < 0) return -1;
+
+    c->dirty[0] = (Rect){ 0, 0, a->width, a->height };
+    c->ndirty = 1;
+    return 0;
+}
+
+void frame_blit_rect(const Frame *src, const Rect *r, unsigned char *dst, size_t dst_stride)
+{
+    size_t row = (size_t)r->w * src->bpp;
+    for (int y = r->y; y < r->y + r->h; y++)
+        memcpy(dst + (size_t)y * dst_stride + (size_t)r->x * src->bpp,
+               src->pixels + ((size_t)y * src->width + r->x) * src->bpp, row);
+}
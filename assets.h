@@ -0,0 +1,152 @@
+/*********************************************************************
+ * SNACK DISPENSER - COMPILED ASSETS
+ * * DESCRIPTION:
+ * Display-native frame format shared by the offline asset compiler
+ * (tools/asset_compiler.c) and the dispenser UI. A compiled frame is
+ * already scaled to the panel resolution and stored in the panel's
+ * pixel format, so it can be blitted without any JPEG decoding.
+ * * FILE LAYOUT (.snkf, little-endian):
+ * - 0  magic "SNKF"
+ * - 4  u16 version, u16 pixel format
+ * - 8  u16 width,   u16 height
+ * - 12 u16 compression, u16 reserved
+ * - 16 u32 payload bytes
+ * - 20 u32 raw bytes (width * height * bpp)
+ * - 24 payload (raw pixels or per-pixel RLE packets)
+ * * ANIMATION LAYOUT (.snka, little-endian):
+ * - 0  magic "SNKA"
+ * - 4  u16 version, u16 pixel format
+ * - 8  u16 width,   u16 height
+ * - 12 u16 frames,  u16 tile size
+ * - 16 u32 keyframe RLE bytes, keyframe RLE payload (frame 0)
+ * - per transition t -> (t+1) % frames:
+ *   u16 rects, u16 reserved, then per rect
+ *   u16 x, y, w, h, u32 fwd bytes, u32 bwd bytes, fwd RLE, bwd RLE
+ * Each transition carries the new pixels (fwd) and the old pixels
+ * (bwd) of its dirty rectangles, so a cursor can step either way and
+ * wrap around without ever re-decoding a full frame.
+ *********************************************************************/
+
+#ifndef SNACK_ASSETS_H
+#define SNACK_ASSETS_H
+
+#include <stddef.h>
+
+#define SNKF_MAGIC       "SNKF"
+#define SNKF_VERSION     1
+#define SNKF_HEADER_SIZE 24
+#define SNKF_EXT         ".snkf"
+
+#define SNKA_MAGIC       "SNKA"
+#define SNKA_VERSION     1
+#define SNKA_EXT         ".snka"
+#define SNKA_TILE        16
+#define SNKA_TOLERANCE   24   /* per-channel, absorbs JPEG noise */
+
+/* ===== Pixel formats ===== */
+enum {
+    PIXFMT_RGB565 = 1,
+    PIXFMT_BGRA32 = 2
+};
+
+/* ===== Payload compression ===== */
+enum {
+    SNKF_RAW = 0,
+    SNKF_RLE = 1
+};
+
+typedef struct {
+    int width;
+    int height;
+    int format;            /* PIXFMT_* */
+    int bpp;               /* bytes per pixel */
+    size_t size;           /* width * height * bpp */
+    unsigned char *pixels; /* tightly packed rows */
+} Frame;
+
+int pixfmt_bpp(int fmt);
+const char *pixfmt_name(int fmt);
+int pixfmt_parse(const char *s);   /* -1 when unknown */
+
+/* Pack one 8-bit RGB pixel into dst using the given pixel format. */
+void pixel_pack(unsigned char *dst, int fmt, unsigned char r, unsigned char g, unsigned char b);
+void pixel_unpack(const unsigned char *p, int fmt, int rgb[3]);
+
+Frame *frame_alloc(int width, int height, int fmt);
+void frame_free(Frame *f);
+
+/* Per-pixel PackBits: 0x80|(n-1) + 1 pixel = run, (n-1) + n pixels = literal. */
+size_t rle_encode(const unsigned char *src, size_t npix, int bpp, unsigned char *dst, size_t cap);
+int rle_decode(const unsigned char *src, size_t srclen, int bpp, unsigned char *dst, size_t npix);
+size_t rle_bound(size_t npix, int bpp);
+
+/* Returns bytes written, or -1 on error. */
+long frame_save(const Frame *f, const char *path, int compression);
+Frame *frame_load(const char *path);
+
+/* ===== Delta animations ===== */
+typedef struct {
+    int x, y, w, h;
+} Rect;
+
+typedef struct {
+    Rect rect;
+    unsigned char *fwd;    /* RLE pixels of frame t+1 inside rect */
+    size_t fwd_len;
+    unsigned char *bwd;    /* RLE pixels of frame t inside rect */
+    size_t bwd_len;
+} DeltaRect;
+
+typedef struct {
+    int nrects;
+    DeltaRect *rects;
+} Delta;
+
+typedef struct {
+    int width;
+    int height;
+    int format;
+    int bpp;
+    int nframes;
+    int tile;
+    unsigned char *key;    /* RLE frame 0 */
+    size_t key_len;
+    Delta *deltas;         /* nframes transitions, t -> (t+1) % nframes */
+} AnimAsset;
+
+typedef struct {
+    const AnimAsset *asset;
+    Frame *canvas;         /* current frame, fully decoded */
+    int cur;
+    Rect *dirty;           /* rects touched by the last step/seek */
+    int ndirty;
+    unsigned char *scratch;
+} AnimCursor;
+
+/* Frames must share size and format. tile <= 0 uses SNKA_TILE; tiles whose
+ * channels all stay within tol are treated as unchanged (0 = exact). */
+AnimAsset *animasset_build(Frame *const *frames, int nframes, int tile, int tol);
+long animasset_save(const AnimAsset *a, const char *path);
+AnimAsset *animasset_load(const char *path);
+void animasset_free(AnimAsset *a);
+size_t animasset_bytes(const AnimAsset *a);         /* in-memory payload size */
+double animasset_dirty_ratio(const AnimAsset *a, int t);
+
+AnimCursor *animcursor_new(const AnimAsset *a);    /* positioned on frame 0 */
+void animcursor_free(AnimCursor *c);
+int animcursor_step(AnimCursor *c, int dir);       /* +1/-1 with wrap, returns ndirty or -1 */
+int animcursor_seek(AnimCursor *c, int idx);
+
+/* Tile-granular rectangles where a and b differ (caller frees *out). */
+int frame_diff_rects(const Frame *a, const Frame *b, int tile, int tol, Rect **out);
+
+/* dst = a..b cross-fade inside r, alpha 0 (a) .. 256 (b). Same size/format. */
+void frame_blend_rect(Frame *dst, const Frame *a, const Frame *b, const Rect *r, int alpha);
+
+/* Copy rect r of src into a destination surface with the same pixel format. */
+void frame_blit_rect(const Frame *src, const Rect *r, unsigned char *dst, size_t dst_stride);
+
+/* "/tmp/menu.jpg" -> "/tmp/menu.snkf" */
+void asset_path_for(const char *img, const char *ext, char *out, size_t n);
+
+#endif
@@ -0,0 +1,646 @@
+/*********************************************************************
+ * SNACK DISPENSER - HOST SIMULATOR
+ * * DESCRIPTION:
+ * In-process implementation of the vendor CM3 API (sim/library.h) with
+ * models of the peripherals the dispenser drives, so the application
+ * builds, runs and can be measured on any Linux host:
+ *   gcc ... -Isim snack_dispenser.c assets.c sim/cm3sim.c
+ * Both the NORMAL and the ADMIN (DIP) port sets decode to the same
+ * devices. All entry points are thread-safe (SNACK_THREADS, SNACK_RT).
+ * * ENVIRONMENT:
+ * - CM3SIM_KEYS=<keys>      scripted presses ('0'-'9', 'A', 'B', '_' = pause)
+ * - CM3SIM_KEY_DELAY_MS     first press after CM3DeviceInit (1000)
+ * - CM3SIM_KEY_HOLD_MS      press length (150)
+ * - CM3SIM_KEY_GAP_MS       press to press (700)
+ * - CM3SIM_RUN_MS=<ms>      write the report and SIGTERM the app after ms
+ * - CM3SIM_REPORT=<path>    report file (stderr)
+ * - CM3SIM_DAC=<path>       DAC recording, .wav (stereo ch3/ch5) or CSV
+ * - CM3SIM_DAC_RATE         .wav sample rate (22050)
+ * - CM3SIM_STEP_MIN_US      shortest legal stepper phase (1000)
+ * - CM3SIM_VERBOSE=1        log screens, digits and violations to stderr
+ *********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "library.h"
+#include "cm3sim.h"
+
+/* ===== Port map (snack_dispenser.c) ===== */
+#define LED_NORMAL 0x3A
+#define LCD_NORMAL 0x3B
+#define SM_NORMAL  0x39
+#define KBD_NORMAL 0x3C
+#define LED_ADMIN  0x1A
+#define LCD_ADMIN  0x1B
+#define SM_ADMIN   0x19
+#define KBD_ADMIN  0x1C
+
+enum { DEV_NONE, DEV_LED, DEV_LCD, DEV_SM, DEV_KBD };
+
+/* ===== HD44780 timing (datasheet, 270 kHz oscillator) ===== */
+#define LCD_E_BIT        0x04
+#define LCD_RS_BIT       0x01
+#define LCD_PWEH_NS      450LL        /* minimum E high */
+#define LCD_POWERUP_NS   15000000LL   /* VCC 4.5 V */
+#define LCD_EXEC_NS      37000LL
+#define LCD_EXEC_DATA_NS 41000LL
+#define LCD_EXEC_HOME_NS 1520000LL
+
+#define KEY_MAX          256
+#define DAC_MAX          (4u << 20)
+
+static const unsigned char key_scan[12] = {   /* 0..9, A, B */
+    0xB7, 0x7E, 0xBE, 0xDE,
+    0x7D, 0xBD, 0xDD, 0x7B,
+    0xBB, 0xDB, 0x77, 0xD7
+};
+
+static const unsigned char seg_code[10] = {
+    0x40, 0x79, 0x24, 0x30, 0x19, 0x12, 0x02, 0x78, 0x00, 0x18
+};
+
+/* wave and half-step coil patterns, in rotation order */
+static const unsigned char sm_pattern[8] = { 0x08, 0x0C, 0x04, 0x06, 0x02, 0x03, 0x01, 0x09 };
+
+typedef struct {
+    long long t_ns;
+    unsigned char ch;
+    unsigned char v;
+} DacSample;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long (*clock_ns)(void) = mono_ns;
+
+static struct {
+    int inited;
+    long long t0;
+    int verbose;
+    long long run_ns;          /* 0 = run until the app exits */
+    pthread_t main_th;         /* the thread that called CM3DeviceInit() */
+    int reported;
+    Cm3SimStats st;
+} sim;
+
+static struct {
+    int bus8;                  /* power-on: 8-bit interface */
+    int have_hi;               /* 4-bit: first nibble latched */
+    unsigned char hi;
+    unsigned char last;        /* last bus value */
+    long long e_rise;
+    long long busy_until;
+    int any;                   /* an access has happened */
+    int cg;                    /* data goes to CGRAM */
+    int inc;
+    int on;
+    unsigned char ac;
+    char ddram[128];
+} lcd;
+
+static struct {
+    unsigned char v;
+    char digit;
+} seg;
+
+static struct {
+    unsigned char drive;
+    int n;
+    struct { unsigned char code; long long from, to; } press[KEY_MAX];
+} kbd;
+
+static struct {
+    int pos;                   /* half-step index 0..7 of the energised pattern, -1 = none yet */
+    unsigned char v;
+    long long since;
+    long long on_since;        /* energised since, 0 = off */
+    long long min_ns;
+} sm;
+
+static struct {
+    DacSample *s;
+    unsigned n, cap;
+    const char *path;
+    int rate;
+} dac;
+
+/* ===== Helpers ===== */
+static long long now_rel(void)
+{
+    return clock_ns() - sim.t0;
+}
+
+static void vlog(const char *fmt, const char *a, long long t)
+{
+    if (!sim.verbose) return;
+    fprintf(stderr, "cm3sim %8.3f ms: ", t / 1e6);
+    fprintf(stderr, fmt, a);
+    fputc('\n', stderr);
+}
+
+static int env_int(const char *name, int def)
+{
+    const char *v = getenv(name);
+    return (v && *v) ? atoi(v) : def;
+}
+
+static int port_dev(unsigned char port)
+{
+    switch (port) {
+    case LED_NORMAL: case LED_ADMIN: return DEV_LED;
+    case LCD_NORMAL: case LCD_ADMIN: return DEV_LCD;
+    case SM_NORMAL:  case SM_ADMIN:  return DEV_SM;
+    case KBD_NORMAL: case KBD_ADMIN: return DEV_KBD;
+    }
+    return DEV_NONE;
+}
+
+/* ===== HD44780 ===== */
+static void lcd_line(int row, char out[17])
+{
+    for (int i = 0; i < 16; i++) {
+        char c = lcd.on ? lcd.ddram[(row ? 0x40 : 0x00) + i] : ' ';
+        out[i] = (c >= 0x20 && c < 0x7F) ? c : ' ';
+    }
+    out[16] = '\0';
+}
+
+static void lcd_log_screen(long long t)
+{
+    static char shown[40];
+    char l1[17], l2[17], buf[40];
+    if (!sim.verbose) return;
+    lcd_line(0, l1);
+    lcd_line(1, l2);
+    snprintf(buf, sizeof(buf), "%s|%s", l1, l2);
+    if (strcmp(buf, shown) == 0 || strspn(buf, " |") == strlen(buf)) return;
+    strcpy(shown, buf);
+    vlog("lcd |%s|", buf, t);
+}
+
+static long long lcd_instr(unsigned char v, long long t)
+{
+    sim.st.lcd_instrs++;
+    if (v & 0x80) {
+        lcd.ac = v & 0x7F;
+        lcd.cg = 0;
+    } else if (v & 0x40) {
+        lcd.cg = 1;
+    } else if (v & 0x20) {
+        lcd.bus8 = (v & 0x10) != 0;
+        lcd.have_hi = 0;
+    } else if (v & 0x10) {
+        /* cursor/display shift: not modelled */
+    } else if (v & 0x08) {
+        lcd.on = (v & 0x04) != 0;
+    } else if (v & 0x04) {
+        lcd.inc = (v & 0x02) != 0;
+    } else if (v & 0x02) {
+        lcd.ac = 0;
+        return LCD_EXEC_HOME_NS;
+    } else if (v & 0x01) {
+        lcd_log_screen(t);     /* the app clears before every rewrite */
+        memset(lcd.ddram, ' ', sizeof(lcd.ddram));
+        lcd.ac = 0;
+        lcd.inc = 1;
+        return LCD_EXEC_HOME_NS;
+    }
+    return LCD_EXEC_NS;
+}
+
+static long long lcd_data(unsigned char v)
+{
+    sim.st.lcd_bytes++;
+    if (!lcd.cg) {
+        lcd.ddram[lcd.ac & 0x7F] = (char)v;
+        lcd.ac = (unsigned char)((lcd.ac + (lcd.inc ? 1 : -1)) & 0x7F);
+    }
+    return LCD_EXEC_DATA_NS;
+}
+
+/* One latched transfer (falling edge of E). */
+static void lcd_latch(unsigned char bus, long long t)
+{
+    if (t < lcd.busy_until) {
+        sim.st.lcd_busy_violations++;
+        vlog("lcd: %s", "write while busy", t);
+    }
+
+    unsigned char nib = bus & 0xF0;
+    int rs = (bus & LCD_RS_BIT) != 0;
+    unsigned char v;
+
+    if (lcd.bus8) {
+        v = nib;               /* D3..D0 are not wired: read as 0 */
+    } else if (!lcd.have_hi) {
+        lcd.hi = nib;
+        lcd.have_hi = 1;
+        return;
+    } else {
+        v = (unsigned char)(lcd.hi | (nib >> 4));
+        lcd.have_hi = 0;
+    }
+    lcd.busy_until = t + (rs ? lcd_data(v) : lcd_instr(v, t));
+}
+
+static void lcd_write(unsigned char bus, long long t)
+{
+    int e_was = (lcd.last & LCD_E_BIT) != 0;
+    int e_now = (bus & LCD_E_BIT) != 0;
+
+    if (!lcd.any) {
+        lcd.any = 1;
+        if (t < LCD_POWERUP_NS) {
+            sim.st.lcd_powerup_violations++;
+            vlog("lcd: %s", "accessed before power-up delay", t);
+        }
+    }
+    if (e_was && e_now && ((bus ^ lcd.last) & LCD_RS_BIT)) {
+        sim.st.lcd_rs_violations++;
+        vlog("lcd: %s", "RS changed while E high", t);
+    }
+
+    if (!e_was && e_now) {
+        lcd.e_rise = t;
+    } else if (e_was && !e_now) {
+        if (t - lcd.e_rise < LCD_PWEH_NS) {
+            sim.st.lcd_pulse_violations++;
+            vlog("lcd: %s", "E pulse too short", t);
+        }
+        lcd_latch(lcd.last, t);    /* data is sampled while E is still high */
+    }
+    lcd.last = bus;
+}
+
+/* ===== 7-seg ===== */
+static void seg_write(unsigned char v, long long t)
+{
+    char d = '?';
+    if (v == 0xFF) d = ' ';
+    for (int i = 0; i < 10; i++)
+        if (seg_code[i] == v) d = (char)('0' + i);
+
+    if (d == '?') sim.st.seg_unknown++;
+    if (d != seg.digit) {
+        char s[2] = { d, '\0' };
+        sim.st.seg_changes++;
+        vlog("7seg '%s'", s, t);
+    }
+    seg.v = v;
+    seg.digit = d;
+}
+
+/* ===== Keypad matrix ===== */
+static unsigned char kbd_read(long long t)
+{
+    unsigned char r = (unsigned char)(0xF0 | (kbd.drive & 0x0F));
+    sim.st.key_scans++;
+    for (int i = 0; i < kbd.n; i++) {
+        if (t < kbd.press[i].from || t >= kbd.press[i].to) continue;
+        unsigned char code = kbd.press[i].code;
+        if ((~kbd.drive) & (~code) & 0x0F)    /* its column is driven low */
+            r &= (unsigned char)((code & 0xF0) | 0x0F);
+    }
+    return r;
+}
+
+static int key_code(char key)
+{
+    if (key >= '0' && key <= '9') return key_scan[key - '0'];
+    if (key == 'A' || key == 'a') return key_scan[10];
+    if (key == 'B' || key == 'b') return key_scan[11];
+    return -1;
+}
+
+/* ===== Stepper ===== */
+static void sm_write(unsigned char v, long long t)
+{
+    if (v == sm.v) return;
+
+    if (sm.on_since) sim.st.stepper_energised_ns += t - sm.on_since;
+    sm.on_since = v ? t : 0;
+
+    if (v) {
+        int h = -1;
+        for (int i = 0; i < 8; i++)
+            if (sm_pattern[i] == v) h = i;
+
+        if (h < 0) {
+            sim.st.stepper_illegal++;
+            vlog("stepper: %s", "illegal coil pattern", t);
+        } else {
+            if (sm.pos >= 0) {
+                int d = (h - sm.pos + 8) % 8;
+                if (d > 4) d -= 8;
+                if (d >= 3 || d <= -3) {
+                    sim.st.stepper_illegal++;
+                    vlog("stepper: %s", "phase jump, rotor position lost", t);
+                } else {
+                    sim.st.stepper_half_steps += d;
+                }
+                if (sm.v && t - sm.since < sm.min_ns) {
+                    sim.st.stepper_too_fast++;
+                    vlog("stepper: %s", "phase shorter than the minimum", t);
+                }
+            }
+            sm.pos = h;
+            sim.st.stepper_phases++;
+        }
+    }
+    sm.v = v;
+    sm.since = t;
+}
+
+/* ===== DAC recorder ===== */
+static void dac_record(int ch, unsigned char v, long long t)
+{
+    sim.st.dac_samples++;
+    if (!dac.path || dac.n >= DAC_MAX) return;
+    if (dac.n == dac.cap) {
+        unsigned cap = dac.cap ? dac.cap * 2 : 4096;
+        DacSample *s = realloc(dac.s, cap * sizeof(*s));
+        if (!s) return;
+        dac.s = s;
+        dac.cap = cap;
+    }
+    dac.s[dac.n++] = (DacSample){ t, (unsigned char)ch, v };
+}
+
+static void put_le(FILE *fp, unsigned v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) fputc((int)((v >> (8 * i)) & 0xFF), fp);
+}
+
+/* Sample-and-hold render: ch3 left, ch5 right, unsigned 8-bit. */
+static void dac_write_wav(FILE *fp)
+{
+    long long t0 = dac.s[0].t_ns, t1 = dac.s[dac.n - 1].t_ns;
+    unsigned frames = (unsigned)((t1 - t0) * dac.rate / 1000000000LL) + 1;
+    unsigned char l = 0, r = 0;
+    unsigned i = 0;
+
+    fwrite("RIFF", 1, 4, fp);
+    put_le(fp, 36 + frames * 2, 4);
+    fwrite("WAVEfmt ", 1, 8, fp);
+    put_le(fp, 16, 4);
+    put_le(fp, 1, 2);                      /* PCM */
+    put_le(fp, 2, 2);
+    put_le(fp, (unsigned)dac.rate, 4);
+    put_le(fp, (unsigned)dac.rate * 2, 4);
+    put_le(fp, 2, 2);
+    put_le(fp, 8, 2);
+    fwrite("data", 1, 4, fp);
+    put_le(fp, frames * 2, 4);
+
+    for (unsigned f = 0; f < frames; f++) {
+        long long t = t0 + (long long)f * 1000000000LL / dac.rate;
+        for (; i < dac.n && dac.s[i].t_ns <= t; i++) {
+            if (dac.s[i].ch == 3) l = dac.s[i].v;
+            else if (dac.s[i].ch == 5) r = dac.s[i].v;
+        }
+        fputc(l, fp);
+        fputc(r, fp);
+    }
+}
+
+static void dac_save(void)
+{
+    if (!dac.path || dac.n == 0) return;
+    FILE *fp = fopen(dac.path, "wb");
+    if (!fp) return;
+
+    size_t len = strlen(dac.path);
+    if (len > 4 && strcmp(dac.path + len - 4, ".wav") == 0) {
+        dac_write_wav(fp);
+    } else {
+        fprintf(fp, "t_us,ch,value\n");
+        for (unsigned i = 0; i < dac.n; i++)
+            fprintf(fp, "%.3f,%d,%d\n", dac.s[i].t_ns / 1000.0, dac.s[i].ch, dac.s[i].v);
+    }
+    fclose(fp);
+}
+
+/* ===== Report ===== */
+static void report_locked(FILE *fp)
+{
+    const Cm3SimStats *s = &sim.st;
+    char l1[17], l2[17];
+    long long t = now_rel();
+    unsigned long presses = 0;
+
+    lcd_line(0, l1);
+    lcd_line(1, l2);
+    for (int i = 0; i < kbd.n; i++)
+        if (kbd.press[i].from <= t) presses++;
+
+    fprintf(fp, "cm3sim: %.3f s since CM3DeviceInit\n", t / 1e9);
+    fprintf(fp, "cm3sim: lcd |%s|%s| %lu instr, %lu bytes, violations: busy %lu, E pulse %lu, power-up %lu, RS %lu\n",
+            l1, l2, s->lcd_instrs, s->lcd_bytes, s->lcd_busy_violations, s->lcd_pulse_violations,
+            s->lcd_powerup_violations, s->lcd_rs_violations);
+    fprintf(fp, "cm3sim: 7seg '%c' (0x%02X), %lu changes, %lu unknown patterns\n",
+            seg.digit, seg.v, s->seg_changes, s->seg_unknown);
+    fprintf(fp, "cm3sim: keypad %lu/%d presses, %lu scans\n", presses, kbd.n, s->key_scans);
+    fprintf(fp, "cm3sim: stepper at %ld half-steps (%.1f full), %lu phases, %lu illegal, %lu too fast, energised %.1f ms\n",
+            s->stepper_half_steps, s->stepper_half_steps / 2.0, s->stepper_phases, s->stepper_illegal,
+            s->stepper_too_fast, s->stepper_energised_ns / 1e6);
+    fprintf(fp, "cm3sim: dac %lu samples%s%s\n", s->dac_samples,
+            dac.path ? " recorded to " : "", dac.path ? dac.path : "");
+    fprintf(fp, "cm3sim: %lu writes to unmapped ports, %lu accesses before CM3DeviceInit\n",
+            s->unmapped_writes, s->before_init);
+}
+
+static void report_once(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    if (!sim.reported) {
+        sim.reported = 1;
+        if (sm.on_since) {
+            long long t = now_rel();
+            sim.st.stepper_energised_ns += t - sm.on_since;
+            sm.on_since = t;
+        }
+        const char *path = getenv("CM3SIM_REPORT");
+        FILE *fp = (path && *path) ? fopen(path, "w") : NULL;
+        report_locked(fp ? fp : stderr);
+        if (fp) fclose(fp);
+        dac_save();
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+/* Called with the lock held at every port access. */
+static int run_over(long long t)
+{
+    return sim.run_ns > 0 && t >= sim.run_ns && !sim.reported;
+}
+
+/* SIGTERM asks the app's main loop to stop; it cleans up (joins its
+ * threads, closes its trace) once the current pass returns. Sent to the
+ * main thread, whichever thread noticed the deadline. */
+static void end_run(void)
+{
+    report_once();
+    pthread_kill(sim.main_th, SIGTERM);
+}
+
+/* ===== Vendor API ===== */
+void CM3DeviceInit(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    if (sim.inited) { pthread_mutex_unlock(&sim_lock); return; }
+
+    sim.inited = 1;
+    sim.t0 = clock_ns();
+    sim.main_th = pthread_self();
+    sim.verbose = env_int("CM3SIM_VERBOSE", 0);
+    sim.run_ns = env_int("CM3SIM_RUN_MS", 0) * 1000000LL;
+
+    lcd.bus8 = 1;
+    lcd.inc = 1;
+    memset(lcd.ddram, ' ', sizeof(lcd.ddram));
+    seg.digit = ' ';
+    seg.v = 0xFF;
+    kbd.drive = 0xFF;
+    sm.pos = -1;
+    sm.min_ns = env_int("CM3SIM_STEP_MIN_US", 1000) * 1000LL;
+    dac.path = getenv("CM3SIM_DAC");
+    if (dac.path && !*dac.path) dac.path = NULL;
+    dac.rate = env_int("CM3SIM_DAC_RATE", 22050);
+    if (dac.rate < 1000) dac.rate = 1000;
+    pthread_mutex_unlock(&sim_lock);
+
+    const char *keys = getenv("CM3SIM_KEYS");
+    if (keys)
+        cm3sim_script(keys, env_int("CM3SIM_KEY_DELAY_MS", 1000),
+                      env_int("CM3SIM_KEY_HOLD_MS", 150), env_int("CM3SIM_KEY_GAP_MS", 700));
+    atexit(report_once);
+}
+
+void CM3DeviceSpiInit(int n)
+{
+    (void)n;
+}
+
+void CM3PortInit(int port)
+{
+    (void)port;
+}
+
+void CM3PortWrite(int port, unsigned char v)
+{
+    pthread_mutex_lock(&sim_lock);
+    long long t = now_rel();
+    if (!sim.inited) sim.st.before_init++;
+    dac_record(port, v, t);
+    int over = run_over(t);
+    pthread_mutex_unlock(&sim_lock);
+    if (over) end_run();
+}
+
+void CM3_outport(unsigned char port, unsigned char v)
+{
+    pthread_mutex_lock(&sim_lock);
+    long long t = now_rel();
+    if (!sim.inited) sim.st.before_init++;
+    switch (port_dev(port)) {
+    case DEV_LED: seg_write(v, t); break;
+    case DEV_LCD: lcd_write(v, t); break;
+    case DEV_SM:  sm_write(v, t); break;
+    case DEV_KBD: kbd.drive = v; break;
+    default:      sim.st.unmapped_writes++; break;
+    }
+    int over = run_over(t);
+    pthread_mutex_unlock(&sim_lock);
+    if (over) end_run();
+}
+
+unsigned char CM3_inport(unsigned char port)
+{
+    unsigned char v = 0xFF;
+    pthread_mutex_lock(&sim_lock);
+    long long t = now_rel();
+    if (!sim.inited) sim.st.before_init++;
+    if (port_dev(port) == DEV_KBD) v = kbd_read(t);
+    int over = run_over(t);
+    pthread_mutex_unlock(&sim_lock);
+    if (over) end_run();
+    return v;
+}
+
+/* ===== Harness API ===== */
+void cm3sim_set_clock(long long (*now_ns)(void))
+{
+    pthread_mutex_lock(&sim_lock);
+    clock_ns = now_ns ? now_ns : mono_ns;
+    if (sim.inited) sim.t0 = clock_ns();
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int cm3sim_press(char key, long long at_ms, int hold_ms)
+{
+    int code = key_code(key);
+    if (code < 0) return -1;
+
+    pthread_mutex_lock(&sim_lock);
+    int rc = -1;
+    if (kbd.n < KEY_MAX) {
+        kbd.press[kbd.n].code = (unsigned char)code;
+        kbd.press[kbd.n].from = at_ms * 1000000LL;
+        kbd.press[kbd.n].to = (at_ms + hold_ms) * 1000000LL;
+        kbd.n++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return rc;
+}
+
+long long cm3sim_script(const char *keys, long long start_ms, int hold_ms, int gap_ms)
+{
+    long long t = start_ms;
+    for (const char *p = keys; *p; p++) {
+        if (*p != '_' && cm3sim_press(*p, t, hold_ms) < 0) continue;
+        t += gap_ms;
+    }
+    return t;
+}
+
+void cm3sim_lcd_text(char l1[17], char l2[17])
+{
+    pthread_mutex_lock(&sim_lock);
+    lcd_line(0, l1);
+    lcd_line(1, l2);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+char cm3sim_seg_digit(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    char d = seg.digit;
+    pthread_mutex_unlock(&sim_lock);
+    return d;
+}
+
+void cm3sim_stats(Cm3SimStats *s)
+{
+    pthread_mutex_lock(&sim_lock);
+    *s = sim.st;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void cm3sim_report(FILE *fp)
+{
+    pthread_mutex_lock(&sim_lock);
+    report_locked(fp);
+    pthread_mutex_unlock(&sim_lock);
+}
@@ -0,0 +1,67 @@
+/*********************************************************************
+ * SNACK DISPENSER - HOST SIMULATOR: HARNESS API
+ * * DESCRIPTION:
+ * Inspection and scripting hooks of the in-process CM3 simulator
+ * (sim/cm3sim.c). The dispenser itself only sees library.h; these are
+ * for test harnesses and tools linked into the same process. Times are
+ * relative to CM3DeviceInit().
+ * * MODELS:
+ * - HD44780 16x2 LCD (4-bit bus, E = 0x04, RS = 0x01, D7..D4 = high
+ *   nibble): DDRAM, address counter, 8/4-bit mode switching, and
+ *   timing checks (E pulse width, writes while busy, power-up delay)
+ * - 7-seg: decodes the LED port back to a digit
+ * - keypad matrix: scripted presses, answered per driven column
+ * - stepper: wave/half-step position, illegal phase jumps, step rate
+ * - DAC: every CM3PortWrite() sample with its timestamp
+ *********************************************************************/
+
+#ifndef SNACK_CM3SIM_H
+#define SNACK_CM3SIM_H
+
+#include <stdio.h>
+
+typedef struct {
+    unsigned long lcd_bytes;          /* data bytes written to DDRAM/CGRAM */
+    unsigned long lcd_instrs;
+    unsigned long lcd_busy_violations;     /* latched while still executing */
+    unsigned long lcd_pulse_violations;    /* E high shorter than the minimum */
+    unsigned long lcd_powerup_violations;  /* first access too soon after power-up */
+    unsigned long lcd_rs_violations;       /* RS changed while E was high */
+
+    unsigned long seg_changes;
+    unsigned long seg_unknown;        /* patterns that are not a digit or blank */
+
+    unsigned long key_presses;        /* scripted presses that have started */
+    unsigned long key_scans;          /* reads of the keypad port */
+
+    long stepper_half_steps;          /* signed position */
+    unsigned long stepper_phases;     /* phase changes */
+    unsigned long stepper_illegal;    /* bad patterns and jumps of 3+ half-steps */
+    unsigned long stepper_too_fast;   /* phases shorter than the minimum period */
+    long long stepper_energised_ns;
+
+    unsigned long dac_samples;
+    unsigned long unmapped_writes;
+    unsigned long before_init;        /* port I/O before CM3DeviceInit() */
+} Cm3SimStats;
+
+/* Replace the time source (default CLOCK_MONOTONIC). */
+void cm3sim_set_clock(long long (*now_ns)(void));
+
+/* Press key ('0'-'9', 'A', 'B') at at_ms for hold_ms. Returns -1 when full. */
+int cm3sim_press(char key, long long at_ms, int hold_ms);
+
+/* One press per character from start_ms, hold_ms down and gap_ms apart;
+ * '_' adds an extra gap. Returns the time after the last key. */
+long long cm3sim_script(const char *keys, long long start_ms, int hold_ms, int gap_ms);
+
+/* What the LCD shows now (blank while the display is off). */
+void cm3sim_lcd_text(char l1[17], char l2[17]);
+
+/* The 7-seg digit, ' ' when blank, '?' for an unknown pattern. */
+char cm3sim_seg_digit(void);
+
+void cm3sim_stats(Cm3SimStats *s);
+void cm3sim_report(FILE *fp);
+
+#endif
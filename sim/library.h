@@ -0,0 +1,20 @@
+/*********************************************************************
+ * SNACK DISPENSER - HOST SIMULATOR: VENDOR API
+ * * DESCRIPTION:
+ * Drop-in replacement for the vendor library.h, implemented by
+ * sim/cm3sim.c so the dispenser builds and runs on a normal Linux
+ * host. Put sim/ on the include path (-Isim) instead of the vendor
+ * headers and link sim/cm3sim.c instead of the vendor library.
+ *********************************************************************/
+
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+void CM3DeviceInit(void);
+void CM3DeviceSpiInit(int n);
+void CM3PortInit(int port);
+void CM3PortWrite(int port, unsigned char v);
+void CM3_outport(unsigned char port, unsigned char v);
+unsigned char CM3_inport(unsigned char port);
+
+#endif
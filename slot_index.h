@@ -0,0 +1,106 @@
+/*********************************************************************
+ * SNACK DISPENSER - SLOT INDEX
+ * * DESCRIPTION:
+ * Maps the selection number typed on the keypad to its slot in the
+ * item array in O(1), built once when the catalogue is loaded.
+ * * LAYOUT:
+ * - dense: when the selection numbers span at most SLOT_DENSE_SPREAD
+ *   times the item count (plus SLOT_DENSE_SLACK), a direct-address
+ *   table over [lowest, highest] holds the slot or -1; a lookup is one
+ *   range check and one load
+ * - hash: otherwise an open-addressing table (multiplicative hash,
+ *   linear probing) at most half full, so a miss ends within a couple
+ *   of probes on average
+ * With repeated numbers the first item wins, like a linear scan.
+ *********************************************************************/
+
+#ifndef SNACK_SLOT_INDEX_H
+#define SNACK_SLOT_INDEX_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLOT_DENSE_SPREAD 8
+#define SLOT_DENSE_SLACK  64
+
+typedef struct {
+    int dense;
+    int base;              /* dense: lowest selection number */
+    unsigned size;         /* dense: span; hash: buckets (a power of two) */
+    unsigned shift;        /* hash: 32 - log2(size) */
+    int *slot;             /* slot per entry, -1 when empty */
+    int *key;              /* hash: selection number per bucket */
+} SlotIndex;
+
+static inline unsigned slot_hash(const SlotIndex *ix, int key)
+{
+    return ((unsigned)key * 2654435769u) >> ix->shift;
+}
+
+/* Returns the slot holding selection `key`, -1 when there is none. */
+static inline int slot_index_find(const SlotIndex *ix, int key)
+{
+    if (ix->dense) {
+        unsigned off = (unsigned)key - (unsigned)ix->base;
+        return off < ix->size ? ix->slot[off] : -1;
+    }
+    unsigned mask = ix->size - 1;
+    for (unsigned h = slot_hash(ix, key);; h = (h + 1) & mask) {
+        if (ix->slot[h] < 0) return -1;
+        if (ix->key[h] == key) return ix->slot[h];
+    }
+}
+
+static inline void slot_index_free(SlotIndex *ix)
+{
+    free(ix->slot);
+    free(ix->key);
+    memset(ix, 0, sizeof(*ix));
+}
+
+/* Index n selection numbers, the first at *first_key and each next one
+ * `stride` bytes on (so an array of item structs can be indexed in
+ * place). Returns -1 when out of memory. */
+static inline int slot_index_build(SlotIndex *ix, const int *first_key, int n, size_t stride)
+{
+    const char *p = (const char *)first_key;
+    long long lo = 0, hi = -1;
+
+    memset(ix, 0, sizeof(*ix));
+    for (int i = 0; i < n; i++) {
+        int k = *(const int *)(p + (size_t)i * stride);
+        if (i == 0 || k < lo) lo = k;
+        if (i == 0 || k > hi) hi = k;
+    }
+    if (n == 0) hi = lo;                   /* one empty entry */
+
+    if (hi - lo + 1 <= (long long)n * SLOT_DENSE_SPREAD + SLOT_DENSE_SLACK) {
+        ix->dense = 1;
+        ix->base = (int)lo;
+        ix->size = (unsigned)(hi - lo + 1);
+    } else {
+        ix->size = 2;
+        ix->shift = 31;
+        while (ix->size < 2u * (unsigned)n) { ix->size <<= 1; ix->shift--; }
+        ix->key = malloc(ix->size * sizeof(int));
+        if (!ix->key) return -1;
+    }
+    ix->slot = malloc(ix->size * sizeof(int));
+    if (!ix->slot) { slot_index_free(ix); return -1; }
+    memset(ix->slot, 0xFF, ix->size * sizeof(int));   /* all -1 */
+
+    for (int i = 0; i < n; i++) {
+        int k = *(const int *)(p + (size_t)i * stride);
+        if (ix->dense) {
+            int *s = &ix->slot[k - ix->base];
+            if (*s < 0) *s = i;
+            continue;
+        }
+        unsigned h = slot_hash(ix, k);
+        while (ix->slot[h] >= 0 && ix->key[h] != k) h = (h + 1) & (ix->size - 1);
+        if (ix->slot[h] < 0) { ix->slot[h] = i; ix->key[h] = k; }
+    }
+    return 0;
+}
+
+#endif
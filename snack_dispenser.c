@@ -18,9 +18,11 @@
  * - Door Animation: 4 frames at 800ms intervals.
  * - Sound Cues: DAC-driven beeps for keypresses, errors, success, 
  * and slot-specific dispensing tones.
- * - Timing: High-precision monotonic clock handling for non-blocking loops.
+ * - Timing: epoll/timerfd event loop; sleeps until the next deadline.
+ * Optional fixed-rate SCHED_FIFO control loop (SNACK_RT) for port I/O.
  *********************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -28,10 +30,40 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/fb.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#if defined(__has_include)
+#if __has_include(<drm/drm.h>) && __has_include(<drm/drm_mode.h>)
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#define HAVE_DRM 1
+#endif
+#endif
 
 #include "library.h"
+#include "assets.h"
+#include "ui_fsm.h"
+#include "spsc.h"
+#include "trace.h"
+#include "slot_index.h"
 
 /* ===== Ports (NORMAL mapping) ===== */
 #define LEDPORT_NORMAL 0x3A
@@ -45,32 +77,12 @@
 #define SMPORT_ADMIN   0x19
 #define KBDPORT_ADMIN  0x1C
 
-/* Runtime ports */
-static unsigned char gLedPort = LEDPORT_NORMAL;
-static unsigned char gLcdPort = LCDPORT_NORMAL;
-static unsigned char gSmPort  = SMPORT_NORMAL;
-static unsigned char gKbdPort = KBDPORT_NORMAL;
-
-static void set_port_mapping(int admin)
-{
-    if (admin) {
-        gLedPort = LEDPORT_ADMIN;
-        gLcdPort = LCDPORT_ADMIN;
-        gSmPort  = SMPORT_ADMIN;
-        gKbdPort = KBDPORT_ADMIN;
-    } else {
-        gLedPort = LEDPORT_NORMAL;
-        gLcdPort = LCDPORT_NORMAL;
-        gSmPort  = SMPORT_NORMAL;
-        gKbdPort = KBDPORT_NORMAL;
-    }
-}
-
 /* ===== Keypad scan constants ===== */
 #define Col7Lo 0xF7
 #define Col6Lo 0xFB
 #define Col5Lo 0xFD
 #define Col4Lo 0xFE
+#define KbdAllLo 0xF0      /* every column low: any key pulls its row low */
 
 static const unsigned char ScanTable[12] =
 /* 0..9, A, B */
@@ -79,7 +91,6 @@ static const unsigned char ScanTable[12] =
     0x7D, 0xBD, 0xDD, 0x7B,
     0xBB, 0xDB, 0x77, 0xD7
 };
-static unsigned char ScanCode;
 
 /* ===== 7-seg ===== */
 static const unsigned char Bin2LED[] =
@@ -90,11 +101,13 @@ static const unsigned char Bin2LED[] =
     0x46, 0x21, 0x06, 0x0E
 };
 
-static void seg_blank(void) { CM3_outport(gLedPort, 0xFF); }
+static void rt_seg_set(unsigned char v);   /* see SNACK_RT control loop */
+
+static void seg_blank(void) { rt_seg_set(0xFF); }
 static void seg_show_digit(int d)
 {
     if (d < 0 || d > 9) { seg_blank(); return; }
-    CM3_outport(gLedPort, Bin2LED[d]);
+    rt_seg_set(Bin2LED[d]);
 }
 
 /* ===== Stepper ===== */
@@ -116,6 +129,7 @@ static int full_seq_drive[4] = {0x08, 0x04, 0x02, 0x01};
 #define IMG_RESTOCK        "/tmp/restock.jpg"
 #define IMG_SOUND          "/tmp/sound.jpg"
 #define IMG_MOTOR          "/tmp/motor.jpg"
+#define IMG_SLEEP          "/tmp/sleep.jpg"   /* optional, pqiv low-power screen */
 
 /* Door animation frames */
 #define IMG_DOOR_1         "/tmp/door_1.jpg"
@@ -123,6 +137,10 @@ static int full_seq_drive[4] = {0x08, 0x04, 0x02, 0x01};
 #define IMG_DOOR_3         "/tmp/door_3.jpg"
 #define IMG_DOOR_4         "/tmp/door_4.jpg"
 
+/* Compiled delta animations (tools/asset_compiler -a) */
+#define IMG_DOOR_ANIM      "/tmp/door.snka"
+#define IMG_DISP_ANIM      "/tmp/disp.snka"
+
 /* Zoom images (normal) */
 #define IMG_ZOOM_1         "/tmp/cheetos.jpg"
 #define IMG_ZOOM_2         "/tmp/lays.jpg"
@@ -144,1190 +162,5489 @@ static int full_seq_drive[4] = {0x08, 0x04, 0x02, 0x01};
 #define SVC_GATE_TIMEOUT_MS    8000
 #define RETURN_GATE_TIMEOUT_MS 8000
 #define MAX_COUNT 15
+#define KEY_SCAN_MS 20             /* keypad scan timer period */
+
+/* ===== Overlay durations ===== */
+#define OVERLAY_ERR_SHORT_MS       700
+#define OVERLAY_ERR_LONG_MS       1200
+#define OVERLAY_SUCCESS_MS        5000
+#define OVERLAY_SVC_DONE_MS       1200
+#define OVERLAY_OOS_MS            4500
+#define OVERLAY_SOUND_WAIT_MS     1000
+
+/* ===== Clock =====
+ * Every time read and every delay goes through gClock. The real clock
+ * is CLOCK_MONOTONIC + usleep; the simulated one is a plain counter that
+ * sleeps advance, so delays cost nothing and the event loop jumps
+ * straight to the next deadline (see SNACK_SIM). */
+typedef struct {
+    const char *name;
+    int simulated;
+    long long (*now_us)(void);
+    void (*sleep_us)(long long us);
+} Clock;
 
-/* ===== Sleeps ===== */
-#define USLEEP_ERR_SHORT_US        700000
-#define USLEEP_ERR_LONG_US        1200000
-#define USLEEP_SUCCESS_SCREEN_US  5000000
-#define USLEEP_SVC_DONE_US        1200000
-#define USLEEP_OOS_SCREEN_US      4500000
-
-static long long now_ms(void)
+static long long real_now_us(void)
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
 }
 
-/* ===== LCD ===== */
-static void initlcd(void);
-static void lcd_writecmd(char cmd);
-static void LCDprint(char *sptr);
-static void lcddata(unsigned char cmd);
-
-static void lcd_clear(void)
+static void real_sleep_us(long long us)
 {
-    lcd_writecmd(0x01);
-    usleep(2000);
+    if (us > 0) usleep((useconds_t)us);
 }
-static void lcd_line2(void) { lcd_writecmd(0xC0); }
 
-static void lcd_print2(const char *l1, const char *l2)
+static long long sim_epoch_us = 1000000;   /* starts past 0 so no deadline reads as unset */
+static long long *sim_us = &sim_epoch_us;  /* timeline of the current machine */
+
+static long long sim_now_us(void)
 {
-    char a[17], b[17];
-    snprintf(a, sizeof(a), "%-16.16s", l1);
-    snprintf(b, sizeof(b), "%-16.16s", l2);
-    initlcd();
-    lcd_clear();
-    lcd_writecmd(0x80);
-    LCDprint(a);
-    lcd_line2();
-    LCDprint(b);
+    return *sim_us;
 }
 
-/* ===== Files ===== */
-static int file_exists(const char *p)
+static void sim_sleep_us(long long us)
 {
-    struct stat st;
-    return (stat(p, &st) == 0);
+    if (us > 0) *sim_us += us;
 }
 
-/* ===== PQIV / X helpers ===== */
-static void env_for_x(void)
-{
-    const char *disp = getenv("DISPLAY");
-    if (!disp || !*disp) {
-        if (file_exists("/tmp/.X11-unix/X1")) disp = ":1";
-        else if (file_exists("/tmp/.X11-unix/X0")) disp = ":0";
-        else disp = ":0";
-        setenv("DISPLAY", disp, 1);
-    }
+static const Clock clock_real = { "real", 0, real_now_us, real_sleep_us };
+static const Clock clock_sim  = { "sim",  1, sim_now_us,  sim_sleep_us };
+static const Clock *gClock = &clock_real;
 
-    const char *home = getenv("HOME");
-    if (home && *home) {
-        char xa[512];
-        snprintf(xa, sizeof(xa), "%s/.Xauthority", home);
-        setenv("XAUTHORITY", xa, 1);
-    } else {
-        unsetenv("XAUTHORITY");
-    }
+static long long now_ms(void)
+{
+    return gClock->now_us() / 1000;
+}
 
-    setenv("NO_AT_BRIDGE", "1", 1);
+static void clock_sleep_us(long long us)
+{
+    gClock->sleep_us(us);
 }
 
-static void kill_pid_soft_hard(pid_t p)
+/* Simulated clock only: jump forward to an absolute time. */
+static void clock_advance_to_ms(long long ms)
 {
-    if (p <= 0) return;
-    kill(p, SIGTERM);
-    usleep(60000);
-    kill(p, SIGKILL);
+    if (gClock->simulated && ms * 1000 > *sim_us) *sim_us = ms * 1000;
 }
 
-/* ===== UNIVERSAL PQIV ROLLING 8 (NO killall) ===== */
-#define PQIV_KEEP 8
-static pid_t pqiv_ring[PQIV_KEEP] = {0};
-static int pqiv_pos = 0;
-static int pqiv_count = 0;
+/* ===== Watchdog heartbeat =====
+ * The main loop beats once per pass and goes idle while it waits for
+ * events; long operations beat as they make progress. WD_MARK() records
+ * which function the main thread last entered and the state machine
+ * records its state, so a stall report can say where it stopped. */
+static struct {
+    atomic_llong beat_ms;      /* last heartbeat */
+    atomic_int busy;           /* 0 while blocked in loop_wait() */
+    atomic_int state;
+    const char *_Atomic where;
+    pthread_t main_th;
+    int on;
+} wd_hb;
+
+static void wd_beat(void)
+{
+    atomic_store(&wd_hb.beat_ms, now_ms());
+    atomic_store(&wd_hb.busy, 1);
+}
 
-static void pqiv_kill_all_spawned(void)
+static void wd_idle(void)
 {
-    for (int i = 0; i < PQIV_KEEP; i++) {
-        kill_pid_soft_hard(pqiv_ring[i]);
-        pqiv_ring[i] = 0;
-    }
-    pqiv_pos = 0;
-    pqiv_count = 0;
+    atomic_store(&wd_hb.busy, 0);
 }
 
-static void show_image(const char *path)
+static void wd_mark(const char *fn)
 {
-    if (pqiv_count >= PQIV_KEEP) {
-        kill_pid_soft_hard(pqiv_ring[pqiv_pos]);
-        pqiv_ring[pqiv_pos] = 0;
-    }
+    if (wd_hb.on && pthread_equal(pthread_self(), wd_hb.main_th)) atomic_store(&wd_hb.where, fn);
+}
+#define WD_MARK() wd_mark(__func__)
+
+/* Cooperative abort. The watchdog sets wd_abort on a stall it is told to
+ * recover from; the long waits and port sequences poll op_aborted() and
+ * return early, and the main loop recovers once the pass has unwound.
+ * Recovery bumps dev_epoch: device threads drop commands queued before
+ * it and abandon the one they are running. */
+static atomic_int wd_abort;
+static atomic_uint dev_epoch = 1;
+static _Thread_local unsigned dev_cur_epoch;   /* device threads: the command's epoch */
+
+static int op_aborted(void)
+{
+    if (atomic_load_explicit(&wd_abort, memory_order_relaxed)) return 1;
+    return dev_cur_epoch && dev_cur_epoch != atomic_load_explicit(&dev_epoch, memory_order_relaxed);
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        env_for_x();
-        execlp("pqiv", "pqiv", "-f", path, (char*)NULL);
-        _exit(127);
-    } else if (pid > 0) {
-        pqiv_ring[pqiv_pos] = pid;
-        pqiv_pos = (pqiv_pos + 1) % PQIV_KEEP;
-        if (pqiv_count < PQIV_KEEP) pqiv_count++;
-    }
+/* ===== Timer wheel =====
+ * Hierarchical wheel with 1 ms ticks: 4 levels of 64 slots reach ~4.6 h
+ * (anything longer is parked in the top level and re-cascaded). Arm,
+ * re-arm and cancel are O(1) list splices; tw_run() fires the expired
+ * callbacks and tw_next() hands the event loop its single wakeup time.
+ * Slot occupancy bitmaps let both skip empty stretches in one step. */
+#define TW_BITS   6
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_MASK   (TW_SLOTS - 1)
+#define TW_LEVELS 4
+
+typedef struct Timer Timer;
+typedef void (*TimerFn)(Timer *t, void *ctx);
+
+struct Timer {
+    Timer *next;
+    Timer **pprev;         /* NULL = not armed */
+    long long expires;     /* absolute ms, now_ms() clock */
+    TimerFn fn;
+    void *ctx;
+    int lvl, slot;
+};
 
-    usleep(25000);
-}
+typedef struct {
+    long long base;        /* next tick to process */
+    Timer *slot[TW_LEVELS][TW_SLOTS];
+    uint64_t used[TW_LEVELS];
+    int count;
+    unsigned long fired;
+    unsigned long cascaded;
+} TimerWheel;
+
+/* ===== Machine context =====
+ * Everything that belongs to one dispenser: port mapping and I/O, its
+ * timer wheel, screen and overlay, animations, countdown/blink/gate
+ * timers, input queues and the UI. M is the machine being served; a
+ * process normally has exactly one, the bank run loop (SNACK_MACHINES)
+ * swaps it per instance. Process-wide things stay global: the clock,
+ * the display backend, the event loop fds, the worker threads and the
+ * stats counters (summed over all machines). */
+#define KEYQ_LEN   16
+#define SCRIPT_LEN 64
+#define UI_EVQ_LEN 16
+
+typedef struct Machine Machine;
+typedef struct Anim Anim;
+typedef struct Ui Ui;
+typedef void (*OverlayDoneFn)(void *ctx);
+
+/* One set of device ports - a DIP position, a cabinet tray - and what it
+ * has; the table is built in or loaded by port_maps_load(). */
+#define PM_NAME_LEN    16
+#define PM_MAX_MOTORS  4
+#define PM_MAX_DACS    2
+#define PM_MAX_SENSORS 8
+
+enum {
+    PMC_LED    = 1 << 0,
+    PMC_LCD    = 1 << 1,
+    PMC_MOTOR  = 1 << 2,
+    PMC_KEYPAD = 1 << 3,
+    PMC_DAC    = 1 << 4,
+    PMC_SENSOR = 1 << 5
+};
 
-/* ===== Shared Animation Engine (non-blocking) ===== */
 typedef struct {
-    int active;
-    const char **frames;
-    int nframes;
+    char name[PM_NAME_LEN];
+    unsigned caps;                     /* PMC_* of the devices present */
+    unsigned char led, lcd, keypad;
+    unsigned char motor[PM_MAX_MOTORS];
+    int n_motors;
+    unsigned char dac[PM_MAX_DACS];    /* DAC channels */
+    int n_dacs;
+    unsigned char sensor[PM_MAX_SENSORS];
+    int n_sensors;
+} PortMap;
+
+/* One write of a batch, then the pause before the next one. */
+typedef struct {
+    unsigned char port, value;
+    int delay_us;
+} PortOp;
 
-    int idx;
-    int direction;         /* +1 forward, -1 backward */
-    long long next_ms;
-    int frame_ms;
+typedef struct {
+    const char *name;
+    void (*out)(Machine *m, unsigned char port, unsigned char v);
+    unsigned char (*in)(Machine *m, unsigned char port);
+    void (*dac)(Machine *m, int ch, unsigned char v);
+    /* run a whole write sequence and return the ns spent in the writes
+     * themselves; NULL = out() and clock_sleep_us() per op */
+    long long (*batch)(Machine *m, const PortOp *ops, int n);
+} PortIo;
+
+struct Machine {
+    int id;
+    const PortIo *io;
+    unsigned char port[256];           /* simulated ports: last value written */
+    unsigned long port_writes;
+    atomic_ulong io_ops;               /* port accesses, from any thread (port I/O accounting) */
+    atomic_ullong io_ns;
+    unsigned long sale_ops;            /* io_ops/io_ns when the sale in progress began */
+    unsigned long long sale_ns;
+    long long sim_us;                  /* own timeline under the simulated clock */
+
+    const PortMap *pm;                 /* active port map (normal, or admin via DIP) */
+    unsigned char lcd_io_port;         /* port of the LCD write in progress */
+    unsigned char scan_code;
+
+    TimerWheel tw;
+
+    /* The screen the UI last asked for. While a timed overlay is up it is
+     * only recorded here, and the overlay puts it back when it ends. */
+    struct {
+        char l1[17];
+        char l2[17];
+        const char *img;               /* last image shown, NULL = none yet */
+    } screen;
+    int overlay_lcd;                   /* overlay owns the LCD */
+    int overlay_img;                   /* overlay owns the display too */
+    Timer overlay_timer;
+    OverlayDoneFn overlay_done;
+    void *overlay_ctx;
+
+    Anim *door_anim;
+    Anim *disp_anim;
+
+    int motor_phase;                   /* shared by dispense and motor test */
+    unsigned long motor_step_count;    /* full steps since boot */
+
+    long long idle_deadline;           /* 9s countdown, 0 = off */
+    int last_shown;
+    Timer idle_timer;                  /* fires on each digit change and at the deadline */
+    Timer blink_timer;                 /* service 7-seg blink */
+    int blink_on;
+    Timer gate_timer;                  /* DIP gate timeout */
+
+    /* from_pad keys still need wait_key_release(); injected keys do not */
+    struct { unsigned char key, from_pad; } keyq[KEYQ_LEN];
+    int keyq_head, keyq_len;
+    int key_latched;
+
+    /* scripted keys (simulated clock): each is due gap_ms after the previous one */
+    struct { int gap_ms; unsigned char key; } script[SCRIPT_LEN];
+    int script_head, script_len;
+    long long script_due;              /* head key due time, 0 = not yet scheduled */
+
+    int ui_evq[UI_EVQ_LEN];
+    int ui_evq_head, ui_evq_len;
+
+    Ui *ui;
+};
 
-    int oneshot_done;      /* 1 when reached end */
-} Anim;
+static Machine *M;
+static Machine **bank;                 /* every machine in this process */
+static int bank_n = 0;
 
-static void anim_start(Anim *a, const char **frames, int nframes, int direction, int frame_ms)
+/* Make m current. Simulated machines each keep their own time, so one
+ * machine's blocking delays never make another's scripted keys late. */
+static void machine_use(Machine *m)
 {
-    a->active = 1;
-    a->frames = frames;
-    a->nframes = nframes;
-    a->direction = (direction >= 0) ? +1 : -1;
-    a->frame_ms = frame_ms;
-    a->oneshot_done = 0;
-
-    a->idx = (a->direction > 0) ? 0 : (nframes - 1);
-    a->next_ms = now_ms(); /* show immediately */
+    M = m;
+    sim_us = &m->sim_us;
 }
 
-static void anim_tick(Anim *a)
+static long long mono_ns(void)
 {
-    if (!a->active || a->oneshot_done) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    long long t = now_ms();
-    if (t < a->next_ms) return;
+/* ----- Port I/O: the vendor library, or a private set of simulated ports ----- */
+#define BATCH_SPIN_US 100      /* shorter pauses spin on the vDSO clock instead of sleeping */
 
-    const char *p = a->frames[a->idx];
-    if (!file_exists(p)) p = IMG_MENU;
-    show_image(p);
+/* Set by vendor_init(), which refuses under SNACK_SIM: until then the
+ * vendor calls are no-ops (inputs read idle), so a simulated run can
+ * never touch the real ports whatever PortIo it ends up with. */
+static int vendor_up = 0;
 
-    a->next_ms = t + a->frame_ms;
+static void vendor_out(Machine *m, unsigned char port, unsigned char v)
+{
+    (void)m;
+    if (vendor_up) CM3_outport(port, v);
+}
 
-    if (a->direction > 0) {
-        if (a->idx == a->nframes - 1) {
-            a->oneshot_done = 1;
-            a->active = 0;
-        } else {
-            a->idx++;
-        }
-    } else {
-        if (a->idx == 0) {
-            a->oneshot_done = 1;
-            a->active = 0;
+static unsigned char vendor_in(Machine *m, unsigned char port)
+{
+    (void)m;
+    return vendor_up ? CM3_inport(port) : 0xFF;
+}
+
+static void vendor_dac(Machine *m, int ch, unsigned char v)
+{
+    (void)m;
+    if (vendor_up) CM3PortWrite(ch, v);
+}
+
+/* Each pause is a minimum (an E pulse must stay high at least that long),
+ * timed from the write before it. The short ones - the E pulses and
+ * nibble gaps of an LCD byte - spin instead of costing a syscall and a
+ * wakeup overshoot each. */
+static long long vendor_batch(Machine *m, const PortOp *ops, int n)
+{
+    (void)m;
+    long long io_ns = 0;
+    if (!vendor_up) return 0;
+    for (int i = 0; i < n && !op_aborted(); i++) {
+        long long t0 = mono_ns();
+        CM3_outport(ops[i].port, ops[i].value);
+        long long t1 = mono_ns();
+        io_ns += t1 - t0;
+        if (ops[i].delay_us <= 0) continue;
+        long long due = t1 + ops[i].delay_us * 1000LL;
+        if (ops[i].delay_us > BATCH_SPIN_US) {
+            struct timespec ts = { (time_t)(due / 1000000000LL), (long)(due % 1000000000LL) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
         } else {
-            a->idx--;
+            while (mono_ns() < due) { }
         }
     }
+    return io_ns;
 }
 
-/* Door frames */
-static const char* door_frames[] = { IMG_DOOR_1, IMG_DOOR_2, IMG_DOOR_3, IMG_DOOR_4 };
-static const int DOOR_N = 4;
-#define DOOR_FRAME_MS 800
-
-/* Dispense frames */
-static const char* disp_frames[] = { IMG_DISP_1, IMG_DISP_2, IMG_DISP_3, IMG_DISP_4 };
-static const int DISP_N = 4;
-#define DISP_FRAME_MS DOOR_FRAME_MS
+static void simport_out(Machine *m, unsigned char port, unsigned char v)
+{
+    m->port[port] = v;
+    m->port_writes++;
+}
 
-static Anim gDoorAnim;
-static Anim gDispAnim;
+/* no key is ever down: simulated machines get their keys from the script */
+static unsigned char simport_in(Machine *m, unsigned char port)
+{
+    (void)m;
+    (void)port;
+    return 0xFF;
+}
 
-/* ===== Exit handling (NO killall) ===== */
-static void cleanup(void) { pqiv_kill_all_spawned(); }
-static void on_sig(int sig)
+static void simport_dac(Machine *m, int ch, unsigned char v)
 {
-    (void)sig;
-    cleanup();
-    _exit(0);
+    m->port[ch & 0xFF] = v;
+    m->port_writes++;
 }
 
-/* ===== Keypad ===== */
-static unsigned char ProcKey(void)
+/* Only the final value of each port is visible, so the pauses are one clock step. */
+static long long simport_batch(Machine *m, const PortOp *ops, int n)
 {
-    for (unsigned char j = 0; j < 12; j++) {
-        if (ScanCode == ScanTable[j]) {
-            if (j > 9) return (unsigned char)(j + 0x37); /* A, B */
-            return (unsigned char)(j + 0x30);            /* 0-9 */
-        }
+    long long us = 0;
+    for (int i = 0; i < n; i++) {
+        m->port[ops[i].port] = ops[i].value;
+        us += ops[i].delay_us;
     }
-    return 0xFF;
+    m->port_writes += (unsigned long)n;
+    if (us > 0) clock_sleep_us(us);
+    return 0;
 }
 
-static unsigned char ScanKey(void)
+static int vendor_init(void)
 {
-    CM3_outport(gKbdPort, Col7Lo);
-    ScanCode = CM3_inport(gKbdPort);
-    ScanCode |= 0x0F;
-    ScanCode &= Col7Lo;
-    if (ScanCode != Col7Lo) return ProcKey();
-
-    CM3_outport(gKbdPort, Col6Lo);
-    ScanCode = CM3_inport(gKbdPort);
-    ScanCode |= 0x0F;
-    ScanCode &= Col6Lo;
-    if (ScanCode != Col6Lo) return ProcKey();
-
-    CM3_outport(gKbdPort, Col5Lo);
-    ScanCode = CM3_inport(gKbdPort);
-    ScanCode |= 0x0F;
-    ScanCode &= Col5Lo;
-    if (ScanCode != Col5Lo) return ProcKey();
-
-    CM3_outport(gKbdPort, Col4Lo);
-    ScanCode = CM3_inport(gKbdPort);
-    ScanCode |= 0x0F;
-    ScanCode &= Col4Lo;
-    if (ScanCode != Col4Lo) return ProcKey();
+    if (gClock->simulated) {
+        fprintf(stderr, "vendor: device init refused under SNACK_SIM\n");
+        return -1;
+    }
+    CM3DeviceInit();
+    CM3DeviceSpiInit(0);
 
-    return 0xFF;
+    CM3PortInit(4);
+    CM3PortInit(1);
+    CM3PortInit(0);
+    CM3PortInit(3);
+    CM3PortInit(5);
+    vendor_up = 1;
+    return 0;
 }
 
-static void wait_key_release(void)
+static const PortIo port_io_vendor = { "vendor", vendor_out, vendor_in, vendor_dac, vendor_batch };
+static const PortIo port_io_sim    = { "sim",    simport_out, simport_in, simport_dac, simport_batch };
+
+/* Device class of a port; port_class[] holds it for every port in any
+ * map (filled by port_maps_load()). */
+enum { IOC_LED, IOC_LCD, IOC_MOTOR, IOC_KEYPAD, IOC_DAC, IOC_OTHER, IOC_COUNT };
+static const char *const io_class_names[IOC_COUNT] = { "led", "lcd", "motor", "keypad", "dac", "other" };
+static unsigned char port_class[256];
+
+/* ----- Port I/O trace and replay (SNACK_TRACE, SNACK_REPLAY) -----
+ * SNACK_TRACE=<file.snkt> wraps the port layer and logs every access
+ * with its time since startup (trace.h). SNACK_REPLAY=<base.snkt>
+ * recovers the key presses from a recorded trace and answers keypad
+ * reads from them at the same times, so a new build can be run through
+ * the same session and its output timeline diffed against the baseline
+ * (tools/trace_tool.c). Accesses come from the UI, device and RT
+ * threads alike, so writes to the trace are serialised. */
+static struct {
+    const PortIo *inner;
+    TraceWriter *w;
+    const char *path;
+    pthread_mutex_t lock;
+    long long t0;
+    unsigned char out[256];            /* last value written per port (keypad column drive) */
+    TraceKey *keys;                    /* replay */
+    int nkeys;
+    unsigned long records, bytes;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void trace_log(int op, unsigned char port, unsigned char v)
 {
-    while (ScanKey() != 0xFF) usleep(12000);
+    pthread_mutex_lock(&trace.lock);
+    if (op == TRACE_OUT) trace.out[port] = v;
+    if (trace.w) trace_put(trace.w, op, port, v, mono_ns());
+    pthread_mutex_unlock(&trace.lock);
 }
 
-/* ===== Motor helpers ===== */
-static void motor_write_phase(int phase)
+/* The keypad matrix as the baseline saw it: rows of pressed keys in driven columns. */
+static unsigned char replay_keypad(unsigned char port)
 {
-    CM3_outport(gSmPort, full_seq_drive[phase & 3]);
+    long long t = mono_ns() - trace.t0;
+    pthread_mutex_lock(&trace.lock);
+    unsigned char drive = trace.out[port];
+    pthread_mutex_unlock(&trace.lock);
+
+    unsigned char r = (unsigned char)(0xF0 | (drive & 0x0F));
+    for (int i = 0; i < trace.nkeys && trace.keys[i].from_ns <= t; i++) {
+        if (t >= trace.keys[i].to_ns) continue;
+        unsigned char code = trace.keys[i].code;
+        if ((~drive) & (~code) & 0x0F) r &= (unsigned char)((code & 0xF0) | 0x0F);
+    }
+    return r;
 }
 
-/* ===== DAC beeps ===== */
-static void dac_write(unsigned char v)
+static void traced_out(Machine *m, unsigned char port, unsigned char v)
 {
-    CM3PortWrite(3, v);
-    CM3PortWrite(5, v);
+    trace_log(TRACE_OUT, port, v);
+    trace.inner->out(m, port, v);
 }
 
-static void beep_square(int duration_ms, int half_period_us, unsigned char hi, unsigned char lo)
+static unsigned char traced_in(Machine *m, unsigned char port)
 {
-    long long end = now_ms() + duration_ms;
-    while (now_ms() < end) {
-        dac_write(hi);
-        usleep(half_period_us);
-        dac_write(lo);
-        usleep(half_period_us);
-    }
-    dac_write(0);
+    unsigned char v;
+    if (trace.keys && port_class[port] == IOC_KEYPAD) v = replay_keypad(port);
+    else v = trace.inner->in(m, port);
+    trace_log(TRACE_IN, port, v);
+    return v;
 }
 
-static void beep_keypress(void) { beep_square(25, 650, 200, 20); }
-static void beep_error(void)    { beep_square(140, 1400, 180, 0); }
-
-static void beep_success(void)
+static void traced_dac(Machine *m, int ch, unsigned char v)
 {
-    beep_square(70, 800, 220, 10);
-    usleep(35000);
-    beep_square(70, 500, 220, 10);
+    trace_log(TRACE_DAC, (unsigned char)ch, v);
+    trace.inner->dac(m, ch, v);
 }
 
-static void beep_payment_ok(void)
+/* no batch: each write is timestamped as it happens */
+static const PortIo port_io_trace = { "trace", traced_out, traced_in, traced_dac, NULL };
+
+/* Wrap m's port layer; call before the first port access. */
+static void trace_start(Machine *m)
 {
-    beep_square(60, 900, 220, 0);
-    usleep(20000);
-    beep_square(60, 650, 220, 0);
+    const char *path = getenv("SNACK_TRACE");
+    const char *base = getenv("SNACK_REPLAY");
+    if ((!path || !*path) && (!base || !*base)) return;
+
+    trace.t0 = mono_ns();
+    if (base && *base) {
+        unsigned char kbd[256];
+        int nkbd = 0;
+        for (int p = 0; p < 256; p++)
+            if (port_class[p] == IOC_KEYPAD) kbd[nkbd++] = (unsigned char)p;
+        Trace *t = trace_load(base);
+        int n = t && nkbd ? trace_keys(t, kbd, nkbd, &trace.keys) : -1;
+        trace_free(t);
+        if (n < 0) {
+            fprintf(stderr, "replay: cannot read %s\n", base);
+        } else {
+            trace.nkeys = n;
+            fprintf(stderr, "replay: %d key presses from %s\n", n, base);
+        }
+    }
+    if (path && *path) {
+        trace.w = trace_create(path, trace.t0);
+        if (!trace.w) fprintf(stderr, "trace: cannot create %s\n", path);
+        trace.path = path;
+    }
+    if (!trace.w && !trace.keys) return;
+
+    for (int p = 0; p < 256; p++)
+        if (port_class[p] == IOC_KEYPAD) trace.out[p] = 0xFF;
+    trace.inner = m->io;
+    m->io = &port_io_trace;
 }
 
-/* Dispensing sound cues (slot-specific) */
-static void beep_dispensing_slot(int slot)
+static void trace_stop(void)
 {
-    switch (slot) {
-        case 1: beep_square(180, 900, 220, 0); break;
-        case 2: beep_square(220, 700, 220, 0); break;
-        case 3: beep_square(260, 550, 220, 0); break;
-        case 4: beep_square(320, 450, 220, 0); break;
-        default: beep_square(200, 650, 220, 0); break;
+    pthread_mutex_lock(&trace.lock);
+    if (trace.w) {
+        trace.records = trace.w->records;
+        trace.bytes = trace.w->bytes;
+        trace_close(trace.w);
+        trace.w = NULL;
+        fprintf(stderr, "trace: %lu records, %lu bytes (%.1f B/record) -> %s\n", trace.records,
+                trace.bytes, trace.records ? (double)(trace.bytes - SNKT_HEADER_SIZE) / trace.records : 0.0,
+                trace.path);
     }
+    pthread_mutex_unlock(&trace.lock);
 }
 
-/* ===== Items ===== */
+/* ----- Port I/O accounting -----
+ * Every access is counted, and timed on real hardware, by the device it
+ * hits and by the operation that issued it. The operation is a tag of
+ * the calling thread (io_op_begin/io_op_end around the work, innermost
+ * wins); motor runs carry it to the device/RT thread that drives them.
+ * Each machine also totals its own accesses so a sale can be costed
+ * from the amount screen to the dispense. The matrix goes to the
+ * [port_io] stats section and to the service I/O screen (menu 5). */
+#define IO_OPS(X) \
+    X(IOP_OTHER,     "other")         \
+    X(IOP_LCD_INIT,  "initlcd")       \
+    X(IOP_LCD_PRINT, "lcd_print2")    \
+    X(IOP_LCD_POWER, "lcd_power")     \
+    X(IOP_SCAN,      "ScanKey")       \
+    X(IOP_PROBE,     "keypad_probe")  \
+    X(IOP_SEG,       "7seg")          \
+    X(IOP_DISPENSE,  "dispense_item") \
+    X(IOP_MOTOR_TEST, "motor_test")   \
+    X(IOP_BEEP,      "beep")
+
+enum {
+#define IO_OP_ENUM(op, name) op,
+    IO_OPS(IO_OP_ENUM)
+#undef IO_OP_ENUM
+    IOP_COUNT
+};
+
+static const char *const io_op_names[IOP_COUNT] = {
+#define IO_OP_NAME(op, name) name,
+    IO_OPS(IO_OP_NAME)
+#undef IO_OP_NAME
+};
+
+
+static struct {
+    int timed;                          /* off under SNACK_SIM: host time means nothing there */
+    atomic_ulong ops[IOP_COUNT][IOC_COUNT];
+    atomic_ullong ns[IOP_COUNT][IOC_COUNT];
+    atomic_ulong calls[IOP_COUNT];
+    atomic_ullong busy_ns[IOP_COUNT];   /* wall time inside the operation, waits included */
+    atomic_ulong sales;
+    atomic_ulong sale_ops;
+    atomic_ullong sale_ns;
+} io_acct;
+
+/* SNACK_SIM runs every machine on one thread: plain adds there, locked ones otherwise. */
+#define IO_ADD(c, v) \
+    (io_acct.timed ? (void)atomic_fetch_add_explicit(&(c), (v), memory_order_relaxed) \
+                   : atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed) + (v), \
+                                           memory_order_relaxed))
+
+static _Thread_local int io_op_cur = IOP_OTHER;
+
 typedef struct {
-    int index;
-    const char *name;
-    float price;
-    const char *img;
-    const char *img_oos;
-    int stock;
-} Item;
+    int op, prev;
+    long long t0;
+} IoScope;
 
-static void format_money(char out[12], float v)
+static IoScope io_op_begin(int op)
 {
-    snprintf(out, 12, "$%.2f", (double)(v + 0.0001f));
+    IoScope sc = { op, io_op_cur, 0 };
+    if (sc.prev != op) {
+        io_op_cur = op;
+        IO_ADD(io_acct.calls[op], 1);
+        if (io_acct.timed) sc.t0 = mono_ns();
+    }
+    return sc;
 }
 
-static int find_slot_by_index(Item *items, int n, int idx)
+static void io_op_end(const IoScope *sc)
 {
-    for (int i = 0; i < n; i++) if (items[i].index == idx) return i;
-    return -1;
+    if (sc->t0) atomic_fetch_add_explicit(&io_acct.busy_ns[sc->op], (unsigned long long)(mono_ns() - sc->t0),
+                                          memory_order_relaxed);
+    io_op_cur = sc->prev;
 }
 
-/* ===== 9s timer (normal mode only) ===== */
-static long long idle_deadline = 0;
-static int last_shown = -1;
+static int io_class(unsigned char port)
+{
+    return port_class[port];
+}
 
-static void timer_start_or_reset(void)
+static void io_account(Machine *m, int cls, long long t0)
 {
-    idle_deadline = now_ms() + IDLE_MS;
-    last_shown = -1;
+    IO_ADD(io_acct.ops[io_op_cur][cls], 1);
+    IO_ADD(m->io_ops, 1);
+    if (!io_acct.timed) return;
+    unsigned long long d = (unsigned long long)(mono_ns() - t0);
+    IO_ADD(io_acct.ns[io_op_cur][cls], d);
+    IO_ADD(m->io_ns, d);
 }
 
-static int timer_seconds_left(long long t)
+static void port_out(unsigned char port, unsigned char v)
 {
-    if (idle_deadline <= 0) return -1;
-    long long rem = idle_deadline - t;
-    if (rem <= 0) return 0;
-    int sec = (int)((rem + 999) / 1000);
-    if (sec > 9) sec = 9;
-    if (sec < 0) sec = 0;
-    return sec;
+    long long t0 = io_acct.timed ? mono_ns() : 0;
+    M->io->out(M, port, v);
+    io_account(M, io_class(port), t0);
 }
 
-static void timer_update_display(long long t)
+static unsigned char port_in(unsigned char port)
 {
-    int left = timer_seconds_left(t);
-    if (left < 0) return;
-    if (left != last_shown) { seg_show_digit(left); last_shown = left; }
+    long long t0 = io_acct.timed ? mono_ns() : 0;
+    unsigned char v = M->io->in(M, port);
+    io_account(M, io_class(port), t0);
+    return v;
 }
 
-static void timer_stop_and_blank(void)
+static void port_dac(int ch, unsigned char v)
 {
-    idle_deadline = 0;
-    last_shown = -1;
-    seg_blank();
+    long long t0 = io_acct.timed ? mono_ns() : 0;
+    M->io->dac(M, ch, v);
+    io_account(M, IOC_DAC, t0);
 }
 
-/* ===== Service 7-seg blink ===== */
-static long long svc_blink_next = 0;
-static int svc_blink_on = 1;
+/* ----- Batched port writes -----
+ * A whole (port, value, pause) sequence - an LCD screen, a motor step -
+ * built with pb_out() and handed to the port layer in one pb_run(). The
+ * accounting still sees every write; the pauses are not I/O time. */
+#define PORT_BATCH_MAX 160
 
-static void service_blink_tick(long long t)
+typedef struct {
+    int n;
+    PortOp op[PORT_BATCH_MAX];
+} PortBatch;
+
+static void pb_run(PortBatch *b)
 {
-    if (svc_blink_next == 0) {
-        svc_blink_next = t + 500;
-        svc_blink_on = 1;
-        seg_show_digit(0);
-        return;
+    if (b->n == 0) return;
+    long long io_ns = 0;
+    if (M->io->batch) {
+        io_ns = M->io->batch(M, b->op, b->n);
+    } else {
+        for (int i = 0; i < b->n && !op_aborted(); i++) {
+            long long t0 = io_acct.timed ? mono_ns() : 0;
+            M->io->out(M, b->op[i].port, b->op[i].value);
+            if (io_acct.timed) io_ns += mono_ns() - t0;
+            if (b->op[i].delay_us > 0) clock_sleep_us(b->op[i].delay_us);
+        }
     }
-    if (t >= svc_blink_next) {
-        svc_blink_next += 500;
-        svc_blink_on = !svc_blink_on;
-        if (svc_blink_on) seg_show_digit(0);
-        else seg_blank();
+
+    long long per = io_acct.timed ? io_ns / b->n : 0;
+    for (int i = 0; i < b->n; i++) {
+        int cls = io_class(b->op[i].port);
+        IO_ADD(io_acct.ops[io_op_cur][cls], 1);
+        if (per) IO_ADD(io_acct.ns[io_op_cur][cls], (unsigned long long)per);
     }
+    IO_ADD(M->io_ops, (unsigned long)b->n);
+    if (per) IO_ADD(M->io_ns, (unsigned long long)(per * b->n));
+    b->n = 0;
 }
 
-static void service_blink_reset(void)
+/* Append a write; a full batch is run first. */
+static void pb_out(PortBatch *b, unsigned char port, unsigned char v, int delay_us)
 {
-    svc_blink_next = 0;
-    svc_blink_on = 1;
-    seg_show_digit(0);
+    if (b->n == PORT_BATCH_MAX) pb_run(b);
+    b->op[b->n++] = (PortOp){ port, v, delay_us };
 }
 
-/* ===== Service menu LCD (fits 16 chars) ===== */
-static void service_menu_screen(const char *typed)
+/* A sale runs from the amount screen to the end of its dispense. */
+static void io_sale_begin(void)
 {
-    show_image(IMG_SERVICE_MANUAL);
-
-    char l1[17], l2[17];
-    if (typed && *typed) snprintf(l1, sizeof(l1), "Svc:%-12.12s", typed);
-    else                snprintf(l1, sizeof(l1), "Svc:");
-    snprintf(l2, sizeof(l2), "B=OK 1-4/1234");
-    lcd_print2(l1, l2);
+    M->sale_ops = atomic_load(&M->io_ops);
+    M->sale_ns = atomic_load(&M->io_ns);
 }
 
-/* ===== DIP gate prompts ===== */
-static void show_service_gate_prompt(void)
-{
-    show_image(IMG_MENU);
-    lcd_print2("Flip SA5 DIP", "Press any key");
-}
-static void show_return_gate_prompt(void)
+static void io_sale_end(void)
 {
-    show_image(IMG_SERVICE_MANUAL);
-    lcd_print2("Revert SA5 DIP", "Press any key");
+    atomic_fetch_add(&io_acct.sales, 1);
+    atomic_fetch_add(&io_acct.sale_ops, atomic_load(&M->io_ops) - M->sale_ops);
+    atomic_fetch_add(&io_acct.sale_ns, atomic_load(&M->io_ns) - M->sale_ns);
 }
 
-/* ===== Dispense motor timing: 3 seconds per item ===== */
-#define TOTAL_STEPS_PER_ITEM 60
-#define DISPENSE_CYCLE_US 3000000
-#define DISP_PHASE_DELAY_US (DISPENSE_CYCLE_US / (TOTAL_STEPS_PER_ITEM * 4))
-
-static void run_one_dispense_cycle_with_anim(void)
+static void io_totals(int op, int cls, unsigned long *ops, unsigned long long *ns)
 {
-    static int phase = 0;
-
-    for (int s = 0; s < TOTAL_STEPS_PER_ITEM; s++) {
-        anim_tick(&gDispAnim);
-        for (int i = 0; i < 4; i++) {
-            motor_write_phase(phase);
-            phase = (phase + 1) & 3;
-            anim_tick(&gDispAnim);
-            usleep(DISP_PHASE_DELAY_US);
+    *ops = 0;
+    *ns = 0;
+    for (int o = 0; o < IOP_COUNT; o++) {
+        if (op >= 0 && o != op) continue;
+        for (int c = 0; c < IOC_COUNT; c++) {
+            if (cls >= 0 && c != cls) continue;
+            *ops += atomic_load_explicit(&io_acct.ops[o][c], memory_order_relaxed);
+            *ns += atomic_load_explicit(&io_acct.ns[o][c], memory_order_relaxed);
         }
     }
-    CM3_outport(gSmPort, 0x00);
+}
+
+static void io_stats_dump(FILE *fp)
+{
+    unsigned long all, n;
+    unsigned long long all_ns, ns;
+    io_totals(-1, -1, &all, &all_ns);
+
+    fprintf(fp, "\n[port_io]\n");
+    fprintf(fp, "timed=%d\ntotal=ops:%lu us:%llu\n", io_acct.timed, all, all_ns / 1000);
+    for (int c = 0; c < IOC_COUNT; c++) {
+        io_totals(-1, c, &n, &ns);
+        fprintf(fp, "port_%s=ops:%lu us:%llu share:%.1f%%\n", io_class_names[c], n, ns / 1000,
+                all ? 100.0 * n / all : 0.0);
+    }
+    for (int o = 0; o < IOP_COUNT; o++) {
+        unsigned long calls = atomic_load(&io_acct.calls[o]);
+        io_totals(o, -1, &n, &ns);
+        if (!n && !calls) continue;
+        fprintf(fp, "op_%s=calls:%lu ops:%lu us:%llu busy_ms:%llu", io_op_names[o], calls, n, ns / 1000,
+                atomic_load(&io_acct.busy_ns[o]) / 1000000);
+        if (calls) fprintf(fp, " ops_per_call:%.1f us_per_call:%.1f", (double)n / calls, ns / 1000.0 / calls);
+        for (int c = 0; c < IOC_COUNT; c++) {
+            unsigned long k = atomic_load(&io_acct.ops[o][c]);
+            if (k) fprintf(fp, " %s:%lu", io_class_names[c], k);
+        }
+        fprintf(fp, "\n");
+    }
+    unsigned long sales = atomic_load(&io_acct.sales);
+    fprintf(fp, "sales=%lu\n", sales);
+    if (sales)
+        fprintf(fp, "per_sale=ops:%.1f us:%.1f\n", (double)atomic_load(&io_acct.sale_ops) / sales,
+                atomic_load(&io_acct.sale_ns) / 1000.0 / sales);
+}
+
+/* ===== Port maps =====
+ * Named device descriptor sets. The UI runs on "normal" and the service
+ * mode on "admin" (the DIP gate); further maps describe cabinet trays.
+ * A machine points at its active map, so switching is one pointer swap
+ * that the device and RT threads can never see half done.
+ *
+ * SNACK_PORTMAPS=<file> replaces the built-in pair, one map per line:
+ *   map <name> led=0x3A lcd=0x3B motor=0x39[,0x38..] keypad=0x3C
+ *              dac=3,5 sensor=0x3D[,..]
+ * Devices left out are absent (no PMC_* capability). Map names are
+ * unique, and a port may serve one kind of device only, across all maps. */
+#define PORT_MAPS_MAX 16
+#define ALL_DEVICES (PMC_LED | PMC_LCD | PMC_MOTOR | PMC_KEYPAD | PMC_DAC)
+
+static PortMap port_maps[PORT_MAPS_MAX] = {
+    { "normal", ALL_DEVICES, LEDPORT_NORMAL, LCDPORT_NORMAL, KBDPORT_NORMAL,
+      { SMPORT_NORMAL }, 1, { 3, 5 }, 2, { 0 }, 0 },
+    { "admin",  ALL_DEVICES, LEDPORT_ADMIN,  LCDPORT_ADMIN,  KBDPORT_ADMIN,
+      { SMPORT_ADMIN },  1, { 3, 5 }, 2, { 0 }, 0 },
+};
+static int n_port_maps = 2;
+static const PortMap *pm_normal = &port_maps[0];
+static const PortMap *pm_admin = &port_maps[1];
+
+static const PortMap *port_map_find(const char *name)
+{
+    for (int i = 0; i < n_port_maps; i++)
+        if (strcmp(port_maps[i].name, name) == 0) return &port_maps[i];
+    return NULL;
+}
+
+static void port_map_use(const PortMap *pm)
+{
+    M->pm = pm;
+}
+
+/* "0x39,0x38" -> up to max ports; returns the count, -1 on a bad list. */
+static int pm_parse_ports(const char *v, unsigned char *out, int max)
+{
+    int n = 0;
+    while (*v) {
+        char *end;
+        long x = strtol(v, &end, 0);
+        if (end == v || x < 0 || x > 255 || n == max) return -1;
+        out[n++] = (unsigned char)x;
+        v = end;
+        if (*v == ',') v++;
+        else if (*v) return -1;
+    }
+    return n;
+}
+
+static int pm_parse_line(PortMap *pm, char *line)
+{
+    char *save, *tok = strtok_r(line, " \t", &save);
+    if (!tok || strlen(tok) >= PM_NAME_LEN) return -1;
+    memset(pm, 0, sizeof(*pm));
+    strcpy(pm->name, tok);
+
+    while ((tok = strtok_r(NULL, " \t", &save))) {
+        char *v = strchr(tok, '=');
+        if (!v) return -1;
+        *v++ = '\0';
+        unsigned char one[1];
+        int n;
+        if (!strcmp(tok, "led") && pm_parse_ports(v, one, 1) == 1) {
+            pm->led = one[0];
+            pm->caps |= PMC_LED;
+        } else if (!strcmp(tok, "lcd") && pm_parse_ports(v, one, 1) == 1) {
+            pm->lcd = one[0];
+            pm->caps |= PMC_LCD;
+        } else if (!strcmp(tok, "keypad") && pm_parse_ports(v, one, 1) == 1) {
+            pm->keypad = one[0];
+            pm->caps |= PMC_KEYPAD;
+        } else if (!strcmp(tok, "motor") && (n = pm_parse_ports(v, pm->motor, PM_MAX_MOTORS)) > 0) {
+            pm->n_motors = n;
+            pm->caps |= PMC_MOTOR;
+        } else if (!strcmp(tok, "dac") && (n = pm_parse_ports(v, pm->dac, PM_MAX_DACS)) > 0) {
+            pm->n_dacs = n;
+            pm->caps |= PMC_DAC;
+        } else if (!strcmp(tok, "sensor") && (n = pm_parse_ports(v, pm->sensor, PM_MAX_SENSORS)) > 0) {
+            pm->n_sensors = n;
+            pm->caps |= PMC_SENSOR;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int pm_claim(unsigned char *cls, unsigned char port, int c)
+{
+    if (cls[port] != IOC_OTHER && cls[port] != c) return -1;
+    cls[port] = (unsigned char)c;
+    return 0;
+}
+
+/* Device class of every mapped port; -1 when a port is used two ways. */
+static int pm_classify(const PortMap *maps, int n, unsigned char *cls)
+{
+    memset(cls, IOC_OTHER, 256);
+    for (int i = 0; i < n; i++) {
+        const PortMap *pm = &maps[i];
+        int bad = 0;
+        if (pm->caps & PMC_LED) bad |= pm_claim(cls, pm->led, IOC_LED);
+        if (pm->caps & PMC_LCD) bad |= pm_claim(cls, pm->lcd, IOC_LCD);
+        if (pm->caps & PMC_KEYPAD) bad |= pm_claim(cls, pm->keypad, IOC_KEYPAD);
+        for (int k = 0; k < pm->n_motors; k++) bad |= pm_claim(cls, pm->motor[k], IOC_MOTOR);
+        if (bad) {
+            fprintf(stderr, "portmaps: %s reuses a port for another device\n", pm->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Load SNACK_PORTMAPS if set (keeping the built-in maps on any error)
+ * and classify the ports. Returns -1 only for a bad file. */
+static int port_maps_load(void)
+{
+    static PortMap maps[PORT_MAPS_MAX];
+    unsigned char cls[256];
+    const char *path = getenv("SNACK_PORTMAPS");
+    int n = 0, rc = 0;
+
+    FILE *fp = path && *path ? fopen(path, "r") : NULL;
+    if (path && *path && !fp) {
+        fprintf(stderr, "portmaps: cannot open %s, using the built-in maps\n", path);
+        rc = -1;
+    }
+    if (fp) {
+        char line[256];
+        int lineno = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            lineno++;
+            char *hash = strchr(line, '#');
+            if (hash) *hash = '\0';
+            line[strcspn(line, "\r\n")] = '\0';
+            char *t = line + strspn(line, " \t");
+            if (!*t) continue;
+            if (strncmp(t, "map", 3) != 0 || (t[3] != ' ' && t[3] != '\t') || n == PORT_MAPS_MAX ||
+                pm_parse_line(&maps[n], t + 4) < 0) {
+                fprintf(stderr, "portmaps: %s:%d: bad map line\n", path, lineno);
+                rc = -1;
+                break;
+            }
+            int dup = 0;
+            for (int i = 0; i < n; i++) dup |= !strcmp(maps[i].name, maps[n].name);
+            if (dup) {
+                fprintf(stderr, "portmaps: %s:%d: duplicate map %s\n", path, lineno, maps[n].name);
+                rc = -1;
+                break;
+            }
+            n++;
+        }
+        fclose(fp);
+    }
+
+    if (rc == 0 && n > 0) {
+        int have_normal = 0, have_admin = 0;
+        for (int i = 0; i < n; i++) {
+            have_normal |= !strcmp(maps[i].name, "normal");
+            have_admin |= !strcmp(maps[i].name, "admin");
+        }
+        if (!have_normal || !have_admin) {
+            fprintf(stderr, "portmaps: %s needs maps named normal and admin\n", path);
+            rc = -1;
+        } else if (pm_classify(maps, n, cls) == 0) {
+            memcpy(port_maps, maps, (size_t)n * sizeof(maps[0]));
+            n_port_maps = n;
+        } else {
+            rc = -1;
+        }
+    }
+
+    pm_classify(port_maps, n_port_maps, port_class);
+    pm_normal = port_map_find("normal");
+    pm_admin = port_map_find("admin");
+    return rc;
+}
+
+static uint64_t tw_rotr(uint64_t x, int r)
+{
+    return r ? (x >> r) | (x << (64 - r)) : x;
+}
+
+static void tw_link(Timer *t)
+{
+    long long e = t->expires;
+    long long d = e - M->tw.base;
+    int lvl = 0;
+
+    if (d < 0) {
+        e = M->tw.base;
+    } else {
+        if (d >= (1LL << (TW_BITS * TW_LEVELS))) {
+            d = (1LL << (TW_BITS * TW_LEVELS)) - 1;
+            e = M->tw.base + d;
+        }
+        while (d >= (1LL << (TW_BITS * (lvl + 1)))) lvl++;
+    }
+
+    int i = (int)((e >> (TW_BITS * lvl)) & TW_MASK);
+    Timer **head = &M->tw.slot[lvl][i];
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    t->lvl = lvl;
+    t->slot = i;
+    M->tw.used[lvl] |= 1ULL << i;
+}
+
+static void tw_unlink(Timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    if (!M->tw.slot[t->lvl][t->slot]) M->tw.used[t->lvl] &= ~(1ULL << t->slot);
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static int timer_armed(const Timer *t) { return t->pprev != NULL; }
+
+/* Arm or re-arm t to call fn(t, ctx) at expires (ms). */
+static void timer_arm(Timer *t, long long expires, TimerFn fn, void *ctx)
+{
+    if (timer_armed(t)) tw_unlink(t);
+    else if (M->tw.count++ == 0) M->tw.base = now_ms();
+    t->expires = expires;
+    t->fn = fn;
+    t->ctx = ctx;
+    tw_link(t);
+}
+
+static void timer_cancel(Timer *t)
+{
+    if (!timer_armed(t)) return;
+    tw_unlink(t);
+    M->tw.count--;
+}
+
+static void tw_cascade(int lvl, int i)
+{
+    Timer *t = M->tw.slot[lvl][i];
+    M->tw.slot[lvl][i] = NULL;
+    M->tw.used[lvl] &= ~(1ULL << i);
+    while (t) {
+        Timer *next = t->next;
+        tw_link(t);
+        M->tw.cascaded++;
+        t = next;
+    }
+}
+
+static void tw_run(long long now)
+{
+    if (M->tw.count == 0) { M->tw.base = now + 1; return; }
+
+    while (M->tw.base <= now) {
+        int idx = (int)(M->tw.base & TW_MASK);
+        if (idx == 0) {
+            for (int l = 1; l < TW_LEVELS; l++) {
+                int j = (int)((M->tw.base >> (TW_BITS * l)) & TW_MASK);
+                tw_cascade(l, j);
+                if (j != 0) break;
+            }
+        }
+        if (!(M->tw.used[0] >> idx)) {
+            /* nothing left in this lap of level 0: jump to the next lap */
+            long long lap = (M->tw.base | TW_MASK) + 1;
+            M->tw.base = (lap <= now) ? lap : now + 1;
+            continue;
+        }
+        M->tw.base++;
+
+        /* detach the slot: callbacks may re-arm into it or cancel siblings */
+        Timer *pending = M->tw.slot[0][idx];
+        M->tw.slot[0][idx] = NULL;
+        M->tw.used[0] &= ~(1ULL << idx);
+        if (pending) pending->pprev = &pending;
+        while (pending) {
+            Timer *t = pending;
+            pending = t->next;
+            if (pending) pending->pprev = &pending;
+            t->next = NULL;
+            t->pprev = NULL;
+            M->tw.count--;
+            M->tw.fired++;
+            t->fn(t, t->ctx);
+        }
+    }
+}
+
+/* Earliest time tw_run() has work (an expiry or a cascade), -1 = none. */
+static long long tw_next(void)
+{
+    if (M->tw.count == 0) return -1;
+
+    long long best = -1;
+    if (M->tw.used[0]) {
+        int idx = (int)(M->tw.base & TW_MASK);
+        best = M->tw.base + __builtin_ctzll(tw_rotr(M->tw.used[0], idx));
+    }
+    for (int l = 1; l < TW_LEVELS; l++) {
+        if (!M->tw.used[l]) continue;
+        int sh = TW_BITS * l;
+        long long lap = (M->tw.base + (1LL << sh) - 1) >> sh;
+        long long at = (lap + __builtin_ctzll(tw_rotr(M->tw.used[l], (int)(lap & TW_MASK)))) << sh;
+        if (best < 0 || at < best) best = at;
+    }
+    return best;
+}
+
+/* Sleep until the next timer is due, but no longer than max_ms. */
+static void tw_sleep(long long t, int max_ms)
+{
+    long long wake = t + max_ms;
+    long long d = tw_next();
+    if (d >= 0 && d < wake) wake = d;
+    if (wake > t) clock_sleep_us((wake - t) * 1000);
+}
+
+/* ===== LCD ===== */
+static void initlcd(void);
+static void lcd_writecmd(char cmd);
+static void lcd_put(PortBatch *pb, unsigned char byte, int rs, int settle_us);
+static void LCDprint(PortBatch *pb, const char *sptr);
+static int dev_lcd(const char *l1, const char *l2);
+static int dev_lcd_power(int on);
+
+
+static void lcd_write2_on(unsigned char port, const char *l1, const char *l2)
+{
+    char a[17], b[17];
+    WD_MARK();
+    IoScope io = io_op_begin(IOP_LCD_PRINT);
+    M->lcd_io_port = port;
+    snprintf(a, sizeof(a), "%-16.16s", l1);
+    snprintf(b, sizeof(b), "%-16.16s", l2);
+    initlcd();
+
+    PortBatch pb = { .n = 0 };
+    lcd_put(&pb, 0x01, 0, 4000);       /* clear, then the 1.52 ms it executes */
+    lcd_put(&pb, 0x80, 0, 2000);
+    LCDprint(&pb, a);
+    lcd_put(&pb, 0xC0, 0, 2000);
+    LCDprint(&pb, b);
+    pb_run(&pb);
+    io_op_end(&io);
+}
+
+static void lcd_write2(const char *l1, const char *l2)
+{
+    if (!(M->pm->caps & PMC_LCD)) return;
+    if (dev_lcd(l1, l2) < 0) lcd_write2_on(M->pm->lcd, l1, l2);
+}
+
+/* Display on/off only: DDRAM keeps the text, so switching back on is one command. */
+static void lcd_power_on(unsigned char port, int on)
+{
+    IoScope io = io_op_begin(IOP_LCD_POWER);
+    M->lcd_io_port = port;
+    lcd_writecmd(on ? 0x0C : 0x08);
+    io_op_end(&io);
+}
+
+static void lcd_power(int on)
+{
+    if (!(M->pm->caps & PMC_LCD)) return;
+    if (dev_lcd_power(on) < 0) lcd_power_on(M->pm->lcd, on);
+}
+
+static void lcd_print2(const char *l1, const char *l2)
+{
+    snprintf(M->screen.l1, sizeof(M->screen.l1), "%s", l1);
+    snprintf(M->screen.l2, sizeof(M->screen.l2), "%s", l2);
+    if (!M->overlay_lcd) lcd_write2(l1, l2);
+}
+
+/* ===== Files ===== */
+static int file_exists(const char *p)
+{
+    struct stat st;
+    return (stat(p, &st) == 0);
+}
+
+/* ===== PQIV / X helpers ===== */
+static void env_for_x(void)
+{
+    const char *disp = getenv("DISPLAY");
+    if (!disp || !*disp) {
+        if (file_exists("/tmp/.X11-unix/X1")) disp = ":1";
+        else if (file_exists("/tmp/.X11-unix/X0")) disp = ":0";
+        else disp = ":0";
+        setenv("DISPLAY", disp, 1);
+    }
+
+    const char *home = getenv("HOME");
+    if (home && *home) {
+        char xa[512];
+        snprintf(xa, sizeof(xa), "%s/.Xauthority", home);
+        setenv("XAUTHORITY", xa, 1);
+    } else {
+        unsetenv("XAUTHORITY");
+    }
+
+    setenv("NO_AT_BRIDGE", "1", 1);
+}
+
+static void kill_pid_soft_hard(pid_t p)
+{
+    if (p <= 0) return;
+    kill(p, SIGTERM);
+    clock_sleep_us(60000);
+    kill(p, SIGKILL);
+}
+
+/* ===== Decoded image cache (LRU) + speculative prefetch =====
+ * Holds compiled .snkf frames (tools/asset_compiler) keyed by the JPEG
+ * path. When no compiled frame exists the JPEG is read ahead into the
+ * page cache instead, so pqiv still finds it warm. */
+#define IMG_CACHE_SLOTS 6
+#define IMG_PATH_MAX    64
+
+typedef struct {
+    char path[IMG_PATH_MAX];
+    Frame *frame;              /* NULL = JPEG read-ahead only */
+    unsigned long long used;   /* LRU stamp, 0 = empty */
+    int prefetched;            /* loaded speculatively, not yet shown */
+} ImgCacheEntry;
+
+static ImgCacheEntry img_cache[IMG_CACHE_SLOTS];
+static unsigned long long img_cache_clock = 0;
+static int img_cache_frames = 0;   /* set when the display blits frames */
+
+static struct {
+    unsigned long hits;        /* show_image found the image cached */
+    unsigned long misses;
+    unsigned long prefetches;  /* speculative loads issued */
+    unsigned long useful;      /* prefetched entries later shown */
+} img_stats;
+
+static ImgCacheEntry *img_cache_find(const char *path)
+{
+    for (int i = 0; i < IMG_CACHE_SLOTS; i++)
+        if (img_cache[i].used && strcmp(img_cache[i].path, path) == 0) return &img_cache[i];
+    return NULL;
+}
+
+static ImgCacheEntry *img_cache_insert(const char *path)
+{
+    ImgCacheEntry *e = &img_cache[0];
+    for (int i = 1; i < IMG_CACHE_SLOTS; i++)
+        if (img_cache[i].used < e->used) e = &img_cache[i];
+
+    frame_free(e->frame);
+    memset(e, 0, sizeof(*e));
+    snprintf(e->path, sizeof(e->path), "%s", path);
+
+    if (img_cache_frames) {
+        char snkf[IMG_PATH_MAX + 8];
+        asset_path_for(path, SNKF_EXT, snkf, sizeof(snkf));
+        e->frame = frame_load(snkf);
+    }
+    if (!e->frame) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+    e->used = ++img_cache_clock;
+    return e;
+}
+
+/* Look up an image about to be shown, loading it on a miss. */
+static Frame *img_cache_get(const char *path)
+{
+    ImgCacheEntry *e = img_cache_find(path);
+    if (e) {
+        img_stats.hits++;
+        if (e->prefetched) { img_stats.useful++; e->prefetched = 0; }
+        e->used = ++img_cache_clock;
+        return e->frame;
+    }
+    img_stats.misses++;
+    return img_cache_insert(path)->frame;
+}
+
+static void img_prefetch(const char *path)
+{
+    if (img_cache_find(path)) return;
+    img_cache_insert(path)->prefetched = 1;
+    img_stats.prefetches++;
+}
+
+static void img_cache_clear(void)
+{
+    for (int i = 0; i < IMG_CACHE_SLOTS; i++) {
+        frame_free(img_cache[i].frame);
+        memset(&img_cache[i], 0, sizeof(img_cache[i]));
+    }
+}
+
+/* ===== UNIVERSAL PQIV ROLLING 8 (NO killall) ===== */
+#define PQIV_KEEP 8
+static pid_t pqiv_ring[PQIV_KEEP] = {0};
+static int pqiv_pos = 0;
+static int pqiv_count = 0;
+
+static void pqiv_kill_all_spawned(void)
+{
+    for (int i = 0; i < PQIV_KEEP; i++) {
+        kill_pid_soft_hard(pqiv_ring[i]);
+        pqiv_ring[i] = 0;
+    }
+    pqiv_pos = 0;
+    pqiv_count = 0;
+}
+
+static void pqiv_present(const char *path, const Frame *f, const Rect *dirty, int ndirty)
+{
+    (void)f; (void)dirty; (void)ndirty;
+    WD_MARK();
+
+    if (pqiv_count >= PQIV_KEEP) {
+        kill_pid_soft_hard(pqiv_ring[pqiv_pos]);
+        pqiv_ring[pqiv_pos] = 0;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        env_for_x();
+        execlp("pqiv", "pqiv", "-f", path, (char*)NULL);
+        _exit(127);
+    } else if (pid > 0) {
+        pqiv_ring[pqiv_pos] = pid;
+        pqiv_pos = (pqiv_pos + 1) % PQIV_KEEP;
+        if (pqiv_count < PQIV_KEEP) pqiv_count++;
+    }
+
+    clock_sleep_us(25000);
+}
+
+static int pqiv_init(void) { return 0; }
+
+/* ===== Display backends =====
+ * show_image() is the only entry point the UI uses. SNACK_DISPLAY picks
+ * the backend: "pqiv" (default, needs X), "fb" (/dev/fb0), "drm"
+ * (dumb buffers on /dev/dri/card0) or "null" (draws nothing, default
+ * under SNACK_SIM). fb/drm blit compiled .snkf frames directly,
+ * double-buffered with vsync-aligned flips where the device allows it,
+ * and only repaint dirty rectangles.
+ * SNACK_FBDEV may name a regular file: it is then used as a fake
+ * framebuffer of SNACK_FB_GEOM (WxHxBPP, default 800x480x32). */
+#define DISP_MAX_STALE 32
+
+typedef struct {
+    unsigned char *buf[2];
+    int nbuf;
+    int front;
+    int width, height, format, bpp;
+    size_t stride;
+    Rect stale[2][DISP_MAX_STALE];   /* regions a buffer has not caught up on */
+    int nstale[2];                   /* -1 = whole buffer */
+} Surface;
+
+typedef struct {
+    const char *name;
+    int wants_frames;
+    int  (*init)(void);
+    void (*present)(const char *path, const Frame *f, const Rect *dirty, int ndirty);
+    void (*shutdown)(void);
+} DisplayBackend;
+
+static void surface_mark(Surface *s, int b, const Rect *r, int n)
+{
+    if (s->nstale[b] < 0) return;
+    if (s->nstale[b] + n > DISP_MAX_STALE) { s->nstale[b] = -1; return; }
+    memcpy(&s->stale[b][s->nstale[b]], r, sizeof(Rect) * (size_t)n);
+    s->nstale[b] += n;
+}
+
+/* Copy rect r of f (frame coords) to buffer b, centred and clipped. */
+static void surface_blit(Surface *s, int b, const Frame *f, const Rect *r)
+{
+    int ox = (s->width - f->width) / 2;
+    int oy = (s->height - f->height) / 2;
+
+    int x0 = r->x, y0 = r->y, x1 = r->x + r->w, y1 = r->y + r->h;
+    if (x0 + ox < 0) x0 = -ox;
+    if (y0 + oy < 0) y0 = -oy;
+    if (x1 + ox > s->width) x1 = s->width - ox;
+    if (y1 + oy > s->height) y1 = s->height - oy;
+    if (x0 >= x1 || y0 >= y1) return;
+
+    for (int y = y0; y < y1; y++) {
+        const unsigned char *src = f->pixels + ((size_t)y * f->width + x0) * f->bpp;
+        unsigned char *dst = s->buf[b] + (size_t)(y + oy) * s->stride + (size_t)(x0 + ox) * s->bpp;
+        if (f->format == s->format) {
+            memcpy(dst, src, (size_t)(x1 - x0) * f->bpp);
+            continue;
+        }
+        for (int x = x0; x < x1; x++, src += f->bpp, dst += s->bpp) {
+            int rgb[3];
+            pixel_unpack(src, f->format, rgb);
+            pixel_pack(dst, s->format, (unsigned char)rgb[0], (unsigned char)rgb[1], (unsigned char)rgb[2]);
+        }
+    }
+}
+
+/* Bring the back buffer (or the only buffer) up to date with f and
+ * return its index. dirty == NULL means the whole frame changed. */
+static int surface_present(Surface *s, const Frame *f, const Rect *dirty, int ndirty)
+{
+    static int last_w = -1, last_h = -1;
+    int b = (s->nbuf > 1) ? !s->front : s->front;
+
+    Rect full = { 0, 0, f->width, f->height };
+    if (!dirty || ndirty <= 0) { dirty = &full; ndirty = 1; }
+    if (f->width != last_w || f->height != last_h) {
+        s->nstale[0] = s->nstale[1] = -1;
+        last_w = f->width;
+        last_h = f->height;
+    }
+
+    surface_mark(s, b, dirty, ndirty);
+    if (s->nstale[b] < 0) {
+        for (int y = 0; y < s->height; y++) memset(s->buf[b] + (size_t)y * s->stride, 0, s->stride);
+        surface_blit(s, b, f, &full);
+    } else {
+        for (int i = 0; i < s->nstale[b]; i++) surface_blit(s, b, f, &s->stale[b][i]);
+    }
+    s->nstale[b] = 0;
+    if (s->nbuf > 1) surface_mark(s, !b, dirty, ndirty);
+    return b;
+}
+
+static int surface_format_for_bpp(int bits)
+{
+    if (bits == 16) return PIXFMT_RGB565;
+    if (bits == 32) return PIXFMT_BGRA32;
+    return -1;
+}
+
+/* ----- Linux framebuffer ----- */
+static int fb_fd = -1;
+static unsigned char *fb_mem = NULL;
+static size_t fb_len = 0;
+static int fb_is_file = 0;
+static struct fb_var_screeninfo fb_var;
+static Surface fb_surf;
+
+static int fb_init(void)
+{
+    const char *dev = getenv("SNACK_FBDEV");
+    int fake_ok = (dev && *dev);   /* only an explicit path may be created */
+    if (!fake_ok) dev = "/dev/fb0";
+
+    fb_fd = open(dev, O_RDWR | O_CLOEXEC);
+    if (fb_fd < 0 && errno == ENOENT && fake_ok) fb_fd = open(dev, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fb_fd < 0) return -1;
+
+    struct stat st;
+    fstat(fb_fd, &st);
+    memset(&fb_surf, 0, sizeof(fb_surf));
+
+    int bits;
+    if (S_ISREG(st.st_mode)) {
+        const char *geom = getenv("SNACK_FB_GEOM");
+        int w = 800, h = 480;
+        bits = 32;
+        if (geom) sscanf(geom, "%dx%dx%d", &w, &h, &bits);
+        fb_surf.width = w;
+        fb_surf.height = h;
+        fb_surf.stride = (size_t)w * (size_t)(bits / 8);
+        fb_len = fb_surf.stride * (size_t)h;
+        if (ftruncate(fb_fd, (off_t)fb_len) != 0) goto fail;
+        fb_is_file = 1;
+        fb_surf.nbuf = 1;
+    } else {
+        struct fb_fix_screeninfo fix;
+        if (ioctl(fb_fd, FBIOGET_VSCREENINFO, &fb_var) != 0 ||
+            ioctl(fb_fd, FBIOGET_FSCREENINFO, &fix) != 0) goto fail;
+        bits = (int)fb_var.bits_per_pixel;
+        fb_surf.width = (int)fb_var.xres;
+        fb_surf.height = (int)fb_var.yres;
+        fb_surf.stride = fix.line_length;
+        fb_len = fix.smem_len;
+
+        /* page flipping needs a second page in the virtual area */
+        size_t page = fb_surf.stride * fb_var.yres;
+        if (fb_var.yres_virtual < 2 * fb_var.yres) {
+            fb_var.yres_virtual = 2 * fb_var.yres;
+            ioctl(fb_fd, FBIOPUT_VSCREENINFO, &fb_var);
+            ioctl(fb_fd, FBIOGET_VSCREENINFO, &fb_var);
+        }
+        fb_surf.nbuf = (fb_var.yres_virtual >= 2 * fb_var.yres && fb_len >= 2 * page) ? 2 : 1;
+    }
+
+    fb_surf.format = surface_format_for_bpp(bits);
+    if (fb_surf.format < 0) goto fail;
+    fb_surf.bpp = bits / 8;
+
+    fb_mem = mmap(NULL, fb_len, PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
+    if (fb_mem == MAP_FAILED) { fb_mem = NULL; goto fail; }
+    fb_surf.buf[0] = fb_mem;
+    fb_surf.buf[1] = fb_mem + fb_surf.stride * (size_t)fb_surf.height;
+    fb_surf.front = (fb_surf.nbuf > 1 && fb_var.yoffset >= fb_var.yres) ? 1 : 0;
+    fb_surf.nstale[0] = fb_surf.nstale[1] = -1;
+    return 0;
+
+fail:
+    close(fb_fd);
+    fb_fd = -1;
+    return -1;
+}
+
+static void fb_wait_vsync(void)
+{
+    if (fb_is_file) return;
+    uint32_t crtc = 0;
+    ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc);
+}
+
+static void fb_present(const char *path, const Frame *f, const Rect *dirty, int ndirty)
+{
+    (void)path;
+    if (!f) return;
+
+    if (fb_surf.nbuf < 2) {
+        fb_wait_vsync();   /* write during blanking to limit tearing */
+        surface_present(&fb_surf, f, dirty, ndirty);
+        return;
+    }
+
+    int b = surface_present(&fb_surf, f, dirty, ndirty);
+    fb_var.yoffset = (uint32_t)b * fb_var.yres;
+    fb_wait_vsync();
+    if (ioctl(fb_fd, FBIOPAN_DISPLAY, &fb_var) == 0) fb_surf.front = b;
+}
+
+static void fb_shutdown(void)
+{
+    if (fb_mem) munmap(fb_mem, fb_len);
+    if (fb_fd >= 0) close(fb_fd);
+    fb_mem = NULL;
+    fb_fd = -1;
+}
+
+/* ----- DRM dumb buffers ----- */
+#ifdef HAVE_DRM
+static int drm_fd = -1;
+static uint32_t drm_crtc_id = 0;
+static uint32_t drm_conn_id = 0;
+static struct drm_mode_modeinfo drm_mode;
+static int drm_flip_pending = 0;
+static Surface drm_surf;
+
+static struct {
+    uint32_t handle;
+    uint32_t fb_id;
+    uint64_t size;
+    unsigned char *map;
+} drm_bufs[2];
+
+static int drm_pick_output(void)
+{
+    struct drm_mode_card_res res;
+    memset(&res, 0, sizeof(res));
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) != 0 || !res.count_connectors || !res.count_crtcs) return -1;
+
+    uint32_t *conns = calloc(res.count_connectors, sizeof(uint32_t));
+    uint32_t *crtcs = calloc(res.count_crtcs, sizeof(uint32_t));
+    if (!conns || !crtcs) { free(conns); free(crtcs); return -1; }
+    res.connector_id_ptr = (uint64_t)(uintptr_t)conns;
+    res.crtc_id_ptr = (uint64_t)(uintptr_t)crtcs;
+    res.count_fbs = 0;
+    res.count_encoders = 0;
+
+    int rc = -1;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, &res) != 0) goto done;
+
+    for (uint32_t i = 0; i < res.count_connectors && rc != 0; i++) {
+        struct drm_mode_get_connector c;
+        memset(&c, 0, sizeof(c));
+        c.connector_id = conns[i];
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &c) != 0) continue;
+        if (c.connection != 1 || c.count_modes == 0) continue;   /* 1 = connected */
+
+        struct drm_mode_modeinfo *modes = calloc(c.count_modes, sizeof(*modes));
+        if (!modes) continue;
+        c.modes_ptr = (uint64_t)(uintptr_t)modes;
+        c.count_props = 0;
+        c.count_encoders = 0;
+        if (ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, &c) == 0) {
+            drm_mode = modes[0];
+            for (uint32_t m = 0; m < c.count_modes; m++)
+                if (modes[m].type & DRM_MODE_TYPE_PREFERRED) { drm_mode = modes[m]; break; }
+
+            struct drm_mode_get_encoder e;
+            memset(&e, 0, sizeof(e));
+            e.encoder_id = c.encoder_id;
+            drm_crtc_id = (c.encoder_id && ioctl(drm_fd, DRM_IOCTL_MODE_GETENCODER, &e) == 0 && e.crtc_id)
+                        ? e.crtc_id : crtcs[0];
+            drm_conn_id = conns[i];
+            rc = 0;
+        }
+        free(modes);
+    }
+
+done:
+    free(conns);
+    free(crtcs);
+    return rc;
+}
+
+static int drm_create_buffer(int i)
+{
+    struct drm_mode_create_dumb cd;
+    memset(&cd, 0, sizeof(cd));
+    cd.width = drm_mode.hdisplay;
+    cd.height = drm_mode.vdisplay;
+    cd.bpp = 32;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &cd) != 0) return -1;
+    drm_bufs[i].handle = cd.handle;
+    drm_bufs[i].size = cd.size;
+    drm_surf.stride = cd.pitch;
+
+    struct drm_mode_fb_cmd fc;
+    memset(&fc, 0, sizeof(fc));
+    fc.width = cd.width;
+    fc.height = cd.height;
+    fc.pitch = cd.pitch;
+    fc.bpp = 32;
+    fc.depth = 24;
+    fc.handle = cd.handle;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_ADDFB, &fc) != 0) return -1;
+    drm_bufs[i].fb_id = fc.fb_id;
+
+    struct drm_mode_map_dumb md;
+    memset(&md, 0, sizeof(md));
+    md.handle = cd.handle;
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &md) != 0) return -1;
+    drm_bufs[i].map = mmap(NULL, cd.size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, (off_t)md.offset);
+    if (drm_bufs[i].map == MAP_FAILED) { drm_bufs[i].map = NULL; return -1; }
+    memset(drm_bufs[i].map, 0, cd.size);
+    drm_surf.buf[i] = drm_bufs[i].map;
+    return 0;
+}
+
+static int drm_set_crtc(int b)
+{
+    struct drm_mode_crtc cr;
+    memset(&cr, 0, sizeof(cr));
+    cr.crtc_id = drm_crtc_id;
+    cr.fb_id = drm_bufs[b].fb_id;
+    cr.set_connectors_ptr = (uint64_t)(uintptr_t)&drm_conn_id;
+    cr.count_connectors = 1;
+    cr.mode = drm_mode;
+    cr.mode_valid = 1;
+    return ioctl(drm_fd, DRM_IOCTL_MODE_SETCRTC, &cr);
+}
+
+static void drm_shutdown(void);
+
+static int drm_init(void)
+{
+    const char *dev = getenv("SNACK_DRMDEV");
+    if (!dev || !*dev) dev = "/dev/dri/card0";
+
+    memset(&drm_surf, 0, sizeof(drm_surf));
+    memset(drm_bufs, 0, sizeof(drm_bufs));
+    drm_fd = open(dev, O_RDWR | O_CLOEXEC);
+    if (drm_fd < 0) return -1;
+    if (drm_pick_output() != 0 || drm_create_buffer(0) != 0 || drm_create_buffer(1) != 0 ||
+        drm_set_crtc(0) != 0) {
+        drm_shutdown();
+        return -1;
+    }
+
+    drm_surf.nbuf = 2;
+    drm_surf.front = 0;
+    drm_surf.width = drm_mode.hdisplay;
+    drm_surf.height = drm_mode.vdisplay;
+    drm_surf.format = PIXFMT_BGRA32;   /* XRGB8888 */
+    drm_surf.bpp = 4;
+    drm_surf.nstale[0] = drm_surf.nstale[1] = -1;
+    return 0;
+}
+
+/* Block until the queued flip has hit vblank, so the back buffer is free. */
+static void drm_wait_flip(void)
+{
+    while (drm_flip_pending) {
+        char buf[256];
+        ssize_t n = read(drm_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { drm_flip_pending = 0; break; }
+
+        for (ssize_t off = 0; off + (ssize_t)sizeof(struct drm_event) <= n; ) {
+            struct drm_event *ev = (struct drm_event *)(buf + off);
+            if (ev->type == DRM_EVENT_FLIP_COMPLETE) drm_flip_pending = 0;
+            if (ev->length == 0) break;
+            off += ev->length;
+        }
+    }
+}
+
+static void drm_present(const char *path, const Frame *f, const Rect *dirty, int ndirty)
+{
+    (void)path;
+    if (!f) return;
+
+    drm_wait_flip();
+    int b = surface_present(&drm_surf, f, dirty, ndirty);
+
+    struct drm_mode_crtc_page_flip pf;
+    memset(&pf, 0, sizeof(pf));
+    pf.crtc_id = drm_crtc_id;
+    pf.fb_id = drm_bufs[b].fb_id;
+    pf.flags = DRM_MODE_PAGE_FLIP_EVENT;
+    /* if neither shows b, the old front is still scanned out: keep drawing into b */
+    if (ioctl(drm_fd, DRM_IOCTL_MODE_PAGE_FLIP, &pf) == 0) {
+        drm_flip_pending = 1;
+        drm_surf.front = b;
+    } else if (drm_set_crtc(b) == 0) {
+        drm_surf.front = b;
+    }
+}
+
+static void drm_shutdown(void)
+{
+    if (drm_fd < 0) return;
+    drm_wait_flip();
+    for (int i = 0; i < 2; i++) {
+        if (drm_bufs[i].map) munmap(drm_bufs[i].map, drm_bufs[i].size);
+        if (drm_bufs[i].fb_id) ioctl(drm_fd, DRM_IOCTL_MODE_RMFB, &drm_bufs[i].fb_id);
+        if (drm_bufs[i].handle) {
+            struct drm_mode_destroy_dumb dd = { .handle = drm_bufs[i].handle };
+            ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dd);
+        }
+    }
+    memset(drm_bufs, 0, sizeof(drm_bufs));
+    close(drm_fd);
+    drm_fd = -1;
+}
+#endif /* HAVE_DRM */
+
+/* ----- null: draws nothing (simulation, headless runs) ----- */
+static int null_init(void) { return 0; }
+
+static void null_present(const char *path, const Frame *f, const Rect *dirty, int ndirty)
+{
+    (void)path;
+    (void)f;
+    (void)dirty;
+    (void)ndirty;
+}
+
+static void null_shutdown(void) { }
+
+static const DisplayBackend display_backends[] = {
+    { "pqiv", 0, pqiv_init, pqiv_present, pqiv_kill_all_spawned },
+    { "fb",   1, fb_init,   fb_present,   fb_shutdown },
+#ifdef HAVE_DRM
+    { "drm",  1, drm_init,  drm_present,  drm_shutdown },
+#endif
+    { "null", 0, null_init, null_present, null_shutdown },
+};
+static const DisplayBackend *gDisplay = &display_backends[0];
+
+static void display_init(void)
+{
+    const char *want = getenv("SNACK_DISPLAY");
+    if (!want || !*want) want = gClock->simulated ? "null" : "pqiv";
+
+    for (size_t i = 0; i < sizeof(display_backends) / sizeof(display_backends[0]); i++) {
+        if (strcmp(display_backends[i].name, want) != 0) continue;
+        if (display_backends[i].init() == 0) {
+            gDisplay = &display_backends[i];
+            img_cache_frames = gDisplay->wants_frames;
+            return;
+        }
+        fprintf(stderr, "display: %s unavailable, using pqiv\n", want);
+        break;
+    }
+    gDisplay = &display_backends[0];
+    img_cache_frames = 0;
+}
+
+static void display_shutdown(void) { gDisplay->shutdown(); }
+
+static int dev_image(const char *path);
+
+static void display_image(const char *path)
+{
+    Frame *f = img_cache_get(path);
+    if (dev_image(path) == 0) return;
+    if (gDisplay->wants_frames && !f) {
+        fprintf(stderr, "display: no compiled frame for %s\n", path);
+        return;
+    }
+    gDisplay->present(path, f, NULL, 0);
+}
+
+static void show_image(const char *path)
+{
+    M->screen.img = path;
+    if (!M->overlay_img) display_image(path);
+}
+
+/* Present part of a frame that is already decoded (delta animations). */
+static void show_frame_rects(const char *path, const Frame *f, const Rect *dirty, int ndirty)
+{
+    M->screen.img = path;
+    if (!M->overlay_img) gDisplay->present(path, f, dirty, ndirty);
+}
+
+/* ===== Timed overlays =====
+ * A transient message (LCD lines, optionally an image) shown on top of
+ * the current screen for a fixed time. Everything keeps running below
+ * it: screen updates are recorded and replayed when the overlay ends,
+ * either on its timer or early through overlay_dismiss() (any key). */
+
+static void overlay_dismiss(void);
+
+static void overlay_on_timer(Timer *tm, void *ctx)
+{
+    (void)tm;
+    (void)ctx;
+    overlay_dismiss();
+}
+
+/* img may be NULL (LCD only). done runs once the overlay is gone. */
+static void overlay_show(const char *img, const char *l1, const char *l2, int ms,
+                         OverlayDoneFn done, void *ctx)
+{
+    overlay_dismiss();
+
+    M->overlay_lcd = 1;
+    M->overlay_img = (img != NULL);
+    M->overlay_done = done;
+    M->overlay_ctx = ctx;
+    if (img) display_image(img);
+    lcd_write2(l1, l2);
+    timer_arm(&M->overlay_timer, now_ms() + ms, overlay_on_timer, NULL);
+}
+
+static int overlay_active(void) { return M->overlay_lcd; }
+
+static void overlay_dismiss(void)
+{
+    if (!M->overlay_lcd) return;
+    timer_cancel(&M->overlay_timer);
+
+    if (M->overlay_img && M->screen.img) display_image(M->screen.img);
+    M->overlay_lcd = 0;
+    M->overlay_img = 0;
+    lcd_write2(M->screen.l1, M->screen.l2);
+
+    OverlayDoneFn fn = M->overlay_done;
+    M->overlay_done = NULL;
+    if (fn) fn(M->overlay_ctx);
+}
+
+/* ===== Timeline: N concurrent animations (non-blocking) =====
+ * Every playing Anim owns a wheel timer armed for its next key frame
+ * (or in-between), so nothing is polled: the expiry callback renders,
+ * advances and re-arms.
+ * On frame-capable displays an Anim can also cross-fade: in-between
+ * frames are blended from decoded key frames every tween_ms. */
+enum {
+    ANIM_ONESHOT = 0,      /* stop on the last frame */
+    ANIM_LOOP,             /* wrap around */
+    ANIM_PINGPONG          /* bounce between the ends */
+};
+
+typedef void (*AnimDoneFn)(Anim *a, void *ctx);
+
+#define TWEEN_MAX_FRAMES 8
+#define TWEEN_FPS        30
+
+typedef struct {
+    Frame *keys[TWEEN_MAX_FRAMES];       /* decoded key frames */
+    Frame *out;                          /* blend target */
+    int from, to;                        /* pair currently staged in out */
+    Rect *pair_rects[TWEEN_MAX_FRAMES][TWEEN_MAX_FRAMES];   /* where a pair differs */
+    int pair_n[TWEEN_MAX_FRAMES][TWEEN_MAX_FRAMES];         /* -1 = not computed */
+    int failed;
+} Tween;
+
+struct Anim {
+    int active;
+    const char **frames;
+    int nframes;
+
+    int idx;
+    int direction;         /* +1 forward, -1 backward */
+    long long next_ms;     /* next key frame */
+    Timer tick;            /* armed for next_ms or the next in-between */
+    int frame_ms;
+    const int *durations;  /* per-frame ms, NULL = frame_ms for all */
+    int mode;              /* ANIM_* */
+
+    int oneshot_done;      /* 1 when reached end */
+    AnimDoneFn on_done;
+    void *done_ctx;
+
+    /* compiled delta animation (.snka), used when the display blits frames */
+    const char *delta_path;
+    AnimAsset *delta;
+    AnimCursor *cursor;
+    int delta_failed;
+    int fresh;             /* next frame must repaint in full */
+
+    /* cross-fade */
+    int tween_ms;          /* in-between period, 0 = off */
+    Tween *tween;
+    int shown;             /* key frame on screen, -1 = none */
+    long long shown_ms;
+    int tween_alpha;       /* last blended alpha (progress-driven) */
+    long long tween_last_ms;
+};
+
+static void anim_on_tick(Timer *tm, void *ctx);
+
+static void anim_stop(Anim *a)
+{
+    timer_cancel(&a->tick);
+    a->active = 0;
+}
+
+static void anim_play(Anim *a, const char **frames, int nframes, int direction, int frame_ms,
+                      int mode, const int *durations, AnimDoneFn on_done, void *ctx)
+{
+    if (a->active) anim_stop(a);
+
+    a->active = 1;
+    a->frames = frames;
+    a->nframes = nframes;
+    a->direction = (direction >= 0) ? +1 : -1;
+    a->frame_ms = frame_ms;
+    a->durations = durations;
+    a->mode = mode;
+    a->on_done = on_done;
+    a->done_ctx = ctx;
+    a->oneshot_done = 0;
+
+    a->idx = (a->direction > 0) ? 0 : (nframes - 1);
+    a->next_ms = now_ms(); /* show immediately */
+    a->fresh = 1;
+    a->shown = -1;
+
+    timer_arm(&a->tick, a->next_ms, anim_on_tick, a);
+}
+
+static void anim_set_tween(Anim *a, int fps)
+{
+    a->tween_ms = (fps > 0) ? 1000 / fps : 0;
+}
+
+/* Show frame idx through the delta cursor, blitting only what changed.
+ * Returns 0 when the display cannot take frames or no .snka exists. */
+static int anim_load_delta(Anim *a)
+{
+    if (a->cursor) return 1;
+    if (!a->delta_path || a->delta_failed) return 0;
+
+    a->delta = animasset_load(a->delta_path);
+    a->cursor = (a->delta && a->delta->nframes == a->nframes) ? animcursor_new(a->delta) : NULL;
+    if (!a->cursor) {
+        animasset_free(a->delta);
+        a->delta = NULL;
+        a->delta_failed = 1;
+        return 0;
+    }
+    a->fresh = 1;
+    return 1;
+}
+
+static int anim_show_delta(Anim *a, int idx)
+{
+    if (!gDisplay->wants_frames || !anim_load_delta(a)) return 0;
+
+    AnimCursor *c = a->cursor;
+    if (a->fresh || (idx != (c->cur + 1) % a->nframes && idx != (c->cur + a->nframes - 1) % a->nframes)) {
+        if (idx != c->cur && animcursor_seek(c, idx) != 0) return 0;
+        show_frame_rects(a->frames[idx], c->canvas, NULL, 0);
+        a->fresh = 0;
+        return 1;
+    }
+    if (idx == c->cur) return 1;
+
+    int dir = (idx == (c->cur + 1) % a->nframes) ? +1 : -1;
+    if (animcursor_step(c, dir) < 0) { a->fresh = 1; return 0; }
+    if (c->ndirty > 0) show_frame_rects(a->frames[idx], c->canvas, c->dirty, c->ndirty);
+    return 1;
+}
+
+/* ----- Cross-fade ----- */
+static void tween_free(Tween *tw)
+{
+    if (!tw) return;
+    for (int i = 0; i < TWEEN_MAX_FRAMES; i++) {
+        frame_free(tw->keys[i]);
+        for (int j = 0; j < TWEEN_MAX_FRAMES; j++) free(tw->pair_rects[i][j]);
+    }
+    frame_free(tw->out);
+    free(tw);
+}
+
+/* Decode every key frame once (from the .snka, else per-frame .snkf). */
+static int anim_tweening(Anim *a)
+{
+    if (a->tween_ms <= 0 || !gDisplay->wants_frames || a->nframes < 2 || a->nframes > TWEEN_MAX_FRAMES) return 0;
+    if (a->tween) return !a->tween->failed;
+
+    Tween *tw = calloc(1, sizeof(*tw));
+    if (!tw) return 0;
+    a->tween = tw;
+    tw->from = tw->to = -1;
+    for (int i = 0; i < TWEEN_MAX_FRAMES; i++)
+        for (int j = 0; j < TWEEN_MAX_FRAMES; j++) tw->pair_n[i][j] = -1;
+
+    int have_delta = anim_load_delta(a);
+    for (int i = 0; i < a->nframes; i++) {
+        if (have_delta && animcursor_seek(a->cursor, i) == 0) {
+            const Frame *c = a->cursor->canvas;
+            tw->keys[i] = frame_alloc(c->width, c->height, c->format);
+            if (tw->keys[i]) memcpy(tw->keys[i]->pixels, c->pixels, c->size);
+        } else {
+            char snkf[IMG_PATH_MAX + 8];
+            asset_path_for(a->frames[i], SNKF_EXT, snkf, sizeof(snkf));
+            tw->keys[i] = frame_load(snkf);
+        }
+        if (!tw->keys[i] || tw->keys[i]->width != tw->keys[0]->width ||
+            tw->keys[i]->height != tw->keys[0]->height || tw->keys[i]->format != tw->keys[0]->format) {
+            tw->failed = 1;
+            return 0;
+        }
+    }
+    if (have_delta) a->fresh = 1;   /* cursor was moved around */
+
+    tw->out = frame_alloc(tw->keys[0]->width, tw->keys[0]->height, tw->keys[0]->format);
+    if (!tw->out) tw->failed = 1;
+    return !tw->failed;
+}
+
+static const Rect *tween_pair(Tween *tw, int from, int to, int *n)
+{
+    if (tw->pair_n[from][to] < 0) {
+        Rect *r = NULL;
+        int k = frame_diff_rects(tw->keys[from], tw->keys[to], SNKA_TILE, 0, &r);
+        tw->pair_rects[from][to] = r;
+        tw->pair_n[from][to] = (k < 0) ? 0 : k;
+    }
+    *n = tw->pair_n[from][to];
+    return tw->pair_rects[from][to];
+}
+
+/* Key frame `to`, repainting only where it differs from `from`. */
+static void tween_show_key(Anim *a, int from, int to)
+{
+    Tween *tw = a->tween;
+    if (from < 0 || a->fresh) {
+        show_frame_rects(a->frames[to], tw->keys[to], NULL, 0);
+        a->fresh = 0;
+        return;
+    }
+    int n;
+    const Rect *r = tween_pair(tw, from, to, &n);
+    if (n > 0) show_frame_rects(a->frames[to], tw->keys[to], r, n);
+}
+
+/* In-between frame: blend from -> to by alpha/256 inside the pair rects. */
+static void tween_show_blend(Anim *a, int from, int to, int alpha)
+{
+    Tween *tw = a->tween;
+    if (from < 0 || from == to) return;
+
+    /* outside the pair rects out must match the screen, i.e. keys[from] */
+    if (tw->from != from || tw->to != to) {
+        memcpy(tw->out->pixels, tw->keys[from]->pixels, tw->out->size);
+        tw->from = from;
+        tw->to = to;
+    }
+
+    int n;
+    const Rect *r = tween_pair(tw, from, to, &n);
+    for (int i = 0; i < n; i++) frame_blend_rect(tw->out, tw->keys[from], tw->keys[to], &r[i], alpha);
+    if (n > 0) show_frame_rects(a->frames[to], tw->out, r, n);
+}
+
+static void anim_release(Anim *a)
+{
+    animcursor_free(a->cursor);
+    animasset_free(a->delta);
+    tween_free(a->tween);
+    a->cursor = NULL;
+    a->delta = NULL;
+    a->tween = NULL;
+}
+
+/* Advance to the next frame index; returns 0 when a one-shot ends. */
+static int anim_advance(Anim *a)
+{
+    if (a->nframes <= 1) return a->mode != ANIM_ONESHOT;
+
+    int next = a->idx + a->direction;
+    if (next >= 0 && next < a->nframes) { a->idx = next; return 1; }
+
+    switch (a->mode) {
+        case ANIM_LOOP:
+            a->idx = (next < 0) ? a->nframes - 1 : 0;
+            return 1;
+        case ANIM_PINGPONG:
+            a->direction = -a->direction;
+            a->idx += a->direction;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void anim_render(Anim *a)
+{
+    if (anim_tweening(a)) tween_show_key(a, a->shown, a->idx);
+    else if (!anim_show_delta(a, a->idx)) {
+        const char *p = a->frames[a->idx];
+        if (!file_exists(p)) p = IMG_MENU;
+        show_image(p);
+    }
+    a->shown = a->idx;
+    a->shown_ms = now_ms();
+    a->tween_last_ms = a->shown_ms;
+    a->tween_alpha = 0;
+}
+
+/* Frame or in-between due: show it and re-arm on the animation's own
+ * deadline (no drift; resync if we fell more than a frame behind). */
+static void anim_on_tick(Timer *tm, void *ctx)
+{
+    Anim *a = (Anim *)ctx;
+    long long t = now_ms();
+
+    if (t < a->next_ms) {
+        /* in-between frame towards the upcoming key frame */
+        long long span = a->next_ms - a->shown_ms;
+        int alpha = (span > 0) ? (int)((t - a->shown_ms) * 256 / span) : 256;
+        tween_show_blend(a, a->shown, a->idx, alpha);
+        long long due = t + a->tween_ms;
+        timer_arm(tm, (due < a->next_ms) ? due : a->next_ms, anim_on_tick, a);
+        return;
+    }
+
+    anim_render(a);
+
+    int dur = a->durations ? a->durations[a->idx] : a->frame_ms;
+    if (!anim_advance(a)) {
+        a->active = 0;
+        a->oneshot_done = 1;
+        if (a->on_done) a->on_done(a, a->done_ctx);
+        return;
+    }
+
+    a->next_ms += dur;
+    if (a->next_ms <= t) a->next_ms = t + dur;
+    long long due = a->next_ms;
+    if (anim_tweening(a) && t + a->tween_ms < a->next_ms) due = t + a->tween_ms;
+    timer_arm(tm, due, anim_on_tick, a);
+}
+
+/* ----- Progress-driven playback -----
+ * The frame index follows an external counter (e.g. motor steps)
+ * instead of the clock, so the animation never arms its timer. */
+static void anim_follow(Anim *a, const char **frames, int nframes, AnimDoneFn on_done, void *ctx)
+{
+    if (a->active) anim_stop(a);
+    a->active = 1;
+    a->frames = frames;
+    a->nframes = nframes;
+    a->direction = +1;
+    a->mode = ANIM_LOOP;
+    a->on_done = on_done;
+    a->done_ctx = ctx;
+    a->oneshot_done = 0;
+    a->idx = -1;
+    a->fresh = 1;
+    a->shown = -1;
+}
+
+/* done/total of the current cycle; each cycle sweeps all frames once.
+ * With cross-fade on, the fractional position blends towards the next
+ * frame, at most once per tween_ms. */
+static void anim_set_progress(Anim *a, long done, long total)
+{
+    if (!a->active || total <= 0) return;
+    long pos = done * a->nframes * 256 / total;
+    int idx = (int)(pos >> 8);
+    if (idx >= a->nframes) idx = a->nframes - 1;
+    if (idx < 0) idx = 0;
+
+    if (idx != a->idx) {
+        a->idx = idx;
+        anim_render(a);
+        return;
+    }
+
+    int alpha = (int)(pos & 0xFF);
+    if (alpha > a->tween_alpha && anim_tweening(a) && now_ms() - a->tween_last_ms >= a->tween_ms) {
+        tween_show_blend(a, idx, (idx + 1) % a->nframes, alpha);
+        a->tween_alpha = alpha;
+        a->tween_last_ms = now_ms();
+    }
+}
+
+static void anim_finish(Anim *a)
+{
+    timer_cancel(&a->tick);
+    a->active = 0;
+    a->oneshot_done = 1;
+    if (a->on_done) a->on_done(a, a->done_ctx);
+}
+
+/* Door frames */
+static const char* door_frames[] = { IMG_DOOR_1, IMG_DOOR_2, IMG_DOOR_3, IMG_DOOR_4 };
+static const int DOOR_N = 4;
+#define DOOR_FRAME_MS 800
+
+/* Dispense frames (position follows the motor, one sweep per item) */
+static const char* disp_frames[] = { IMG_DISP_1, IMG_DISP_2, IMG_DISP_3, IMG_DISP_4 };
+static const int DISP_N = 4;
+
+
+/* ===== Stats export (written at exit and on SIGUSR1) ===== */
+#define STATS_PATH "/tmp/snack_stats.txt"
+
+static volatile sig_atomic_t stats_dump_requested = 0;
+static volatile sig_atomic_t quit_requested = 0;
+static int loop_wake_fd = -1;          /* eventfd in the epoll set, bumped by signal handlers */
+
+/* Async-signal-safe: get the main loop out of epoll_wait(). */
+static void loop_wake(void)
+{
+    uint64_t one = 1;
+    if (loop_wake_fd >= 0 && write(loop_wake_fd, &one, sizeof(one)) < 0) { }
+}
+
+static struct {
+    unsigned long wakeups;
+    unsigned long scans;
+    unsigned long keys;
+    unsigned long ctl_cmds;
+} loop_stats;
+
+static struct {
+    unsigned long events;
+    unsigned long transitions;
+    unsigned long unhandled;
+    unsigned long rejected;
+} ui_stats;
+
+static void loop_shutdown(void);
+static void rt_stats_dump(FILE *fp);
+static void rt_stop(void);
+static void dev_stats_dump(FILE *fp);
+static void dev_stop(void);
+static void wd_stats_dump(FILE *fp);
+static void wd_stop(void);
+static void pm_stats_dump(FILE *fp);
+static void inv_stats_dump(FILE *fp);
+static void inv_close(void);
+
+static void stats_dump(void)
+{
+    FILE *fp = fopen(STATS_PATH, "w");
+    if (!fp) return;
+
+    unsigned long shown = img_stats.hits + img_stats.misses;
+    fprintf(fp, "[image_cache]\n");
+    fprintf(fp, "hits=%lu\nmisses=%lu\nhit_rate=%.3f\n",
+            img_stats.hits, img_stats.misses, shown ? (double)img_stats.hits / shown : 0.0);
+    fprintf(fp, "prefetches=%lu\nprefetch_useful=%lu\n", img_stats.prefetches, img_stats.useful);
+
+    fprintf(fp, "\n[event_loop]\n");
+    fprintf(fp, "wakeups=%lu\nkeypad_scans=%lu\nkeys=%lu\nctl_cmds=%lu\n",
+            loop_stats.wakeups, loop_stats.scans, loop_stats.keys, loop_stats.ctl_cmds);
+
+    fprintf(fp, "\n[timers]\n");
+    int armed = 0;
+    unsigned long fired = 0, cascaded = 0;
+    for (int i = 0; i < bank_n; i++) {
+        armed += bank[i]->tw.count;
+        fired += bank[i]->tw.fired;
+        cascaded += bank[i]->tw.cascaded;
+    }
+    fprintf(fp, "armed=%d\nfired=%lu\ncascaded=%lu\n", armed, fired, cascaded);
+
+    fprintf(fp, "\n[ui_fsm]\n");
+    fprintf(fp, "events=%lu\ntransitions=%lu\nunhandled=%lu\nrejected=%lu\n",
+            ui_stats.events, ui_stats.transitions, ui_stats.unhandled, ui_stats.rejected);
+
+    rt_stats_dump(fp);
+    dev_stats_dump(fp);
+    wd_stats_dump(fp);
+    pm_stats_dump(fp);
+    io_stats_dump(fp);
+    inv_stats_dump(fp);
+    fclose(fp);
+}
+
+static void on_usr1(int sig)
+{
+    (void)sig;
+    stats_dump_requested = 1;
+    loop_wake();
+}
+
+/* ===== Exit handling (NO killall) =====
+ * SIGINT/SIGTERM only ask the main loop to stop; main() then returns and
+ * cleanup() runs from atexit in normal context, where joining threads,
+ * taking locks, syncing and allocating are safe. A second signal while
+ * the first is pending (a wedged main thread) exits at once. */
+static void cleanup(void)
+{
+    wd_stop();
+    rt_stop();
+    dev_stop();
+    trace_stop();
+    inv_close();
+    stats_dump();
+    loop_shutdown();
+    display_shutdown();
+    for (int i = 0; i < bank_n; i++) {
+        machine_use(bank[i]);
+        anim_release(M->door_anim);
+        anim_release(M->disp_anim);
+    }
+    img_cache_clear();
+}
+static void on_sig(int sig)
+{
+    (void)sig;
+    if (quit_requested) _exit(1);
+    quit_requested = 1;
+    loop_wake();
+}
+
+/* ===== Keypad ===== */
+static unsigned char ProcKey(void)
+{
+    for (unsigned char j = 0; j < 12; j++) {
+        if (M->scan_code == ScanTable[j]) {
+            if (j > 9) return (unsigned char)(j + 0x37); /* A, B */
+            return (unsigned char)(j + 0x30);            /* 0-9 */
+        }
+    }
+    return 0xFF;
+}
+
+static unsigned char scan_columns(void)
+{
+    port_out(M->pm->keypad, Col7Lo);
+    M->scan_code = port_in(M->pm->keypad);
+    M->scan_code |= 0x0F;
+    M->scan_code &= Col7Lo;
+    if (M->scan_code != Col7Lo) return ProcKey();
+
+    port_out(M->pm->keypad, Col6Lo);
+    M->scan_code = port_in(M->pm->keypad);
+    M->scan_code |= 0x0F;
+    M->scan_code &= Col6Lo;
+    if (M->scan_code != Col6Lo) return ProcKey();
+
+    port_out(M->pm->keypad, Col5Lo);
+    M->scan_code = port_in(M->pm->keypad);
+    M->scan_code |= 0x0F;
+    M->scan_code &= Col5Lo;
+    if (M->scan_code != Col5Lo) return ProcKey();
+
+    port_out(M->pm->keypad, Col4Lo);
+    M->scan_code = port_in(M->pm->keypad);
+    M->scan_code |= 0x0F;
+    M->scan_code &= Col4Lo;
+    if (M->scan_code != Col4Lo) return ProcKey();
+
+    return 0xFF;
+}
+
+static unsigned char ScanKey(void)
+{
+    if (!(M->pm->caps & PMC_KEYPAD)) return 0xFF;
+    IoScope io = io_op_begin(IOP_SCAN);
+    unsigned char k = scan_columns();
+    io_op_end(&io);
+    return k;
+}
+
+/* One write and one read instead of a full scan: is any key down at all? */
+static int keypad_any_down(void)
+{
+    if (!(M->pm->caps & PMC_KEYPAD)) return 0;
+    IoScope io = io_op_begin(IOP_PROBE);
+    port_out(M->pm->keypad, KbdAllLo);
+    int down = (port_in(M->pm->keypad) | 0x0F) != 0xFF;
+    io_op_end(&io);
+    return down;
+}
+
+/* ===== Motor helpers ===== */
+static void motor_write_phase(int phase)
+{
+    port_out(M->pm->motor[0], full_seq_drive[phase & 3]);
+}
+
+/* Coils off; a no-op on boards whose map has no motor port. */
+static void motor_release(void)
+{
+    if (M->pm->caps & PMC_MOTOR) port_out(M->pm->motor[0], 0x00);
+}
+
+/* One full step (4 phases, delay_us apart) as a single batch; returns the next phase. */
+static int motor_step_batch(int phase, int delay_us)
+{
+    PortBatch pb = { .n = 0 };
+    for (int i = 0; i < 4; i++) {
+        pb_out(&pb, M->pm->motor[0], full_seq_drive[phase & 3], delay_us);
+        phase = (phase + 1) & 3;
+    }
+    pb_run(&pb);
+    return phase;
+}
+
+/* ===== DAC ===== */
+static void dac_write(unsigned char v)
+{
+    const PortMap *pm = M->pm;
+    for (int i = 0; i < pm->n_dacs; i++) port_dac(pm->dac[i], v);
+}
+
+static void dac_square(int duration_ms, int half_period_us, unsigned char hi, unsigned char lo)
+{
+    WD_MARK();
+    IoScope io = io_op_begin(IOP_BEEP);
+    long long end = now_ms() + duration_ms;
+    while (now_ms() < end && !op_aborted()) {
+        dac_write(hi);
+        clock_sleep_us(half_period_us);
+        dac_write(lo);
+        clock_sleep_us(half_period_us);
+    }
+    dac_write(0);
+    io_op_end(&io);
+}
+
+/* ===== Hard real-time control loop (SNACK_RT) =====
+ * SNACK_RT=<hz> (e.g. 1000) moves the timing-critical port I/O onto one
+ * fixed-rate thread: SCHED_FIFO, memory locked, pinned to SNACK_RT_CPU
+ * (default: the last CPU). Each tick runs the slots that are due; every
+ * slot has a budget, and a tick whose slots end after the next release
+ * counts as a deadline miss (releases that could not be met at all are
+ * skipped and counted too). The UI thread only hands over work:
+ * - keypad: scanned every KEY_SCAN_MS, the UI reads the latest scan
+ * - 7-seg: the UI sets a pattern, the loop refreshes the port
+ * - motor: the UI queues N full steps and waits; one phase per period
+ * - DAC: the UI queues a square wave and waits; edges land on ticks,
+ *   so half periods round to whole ticks (1 kHz -> <= 500 Hz tones)
+ * Without SNACK_RT (or under SNACK_SIM) everything runs inline as before. */
+#define RT_PRIO_DEFAULT 80
+#define RT_SEG_REFRESH_MS 10
+
+typedef struct {
+    const char *name;
+    int period;                /* ticks */
+    int budget_us;
+    void (*run)(void);
+    unsigned long runs;
+    unsigned long over_budget;
+    unsigned long worst_ns;
+} RtSlot;
+
+static struct {
+    int hz;
+    long period_ns;
+    int cpu;
+    int fifo;                  /* got SCHED_FIFO */
+    int locked;                /* mlockall succeeded */
+    atomic_int running;
+    pthread_t thread;
+
+    unsigned long ticks;
+    unsigned long misses;      /* slots ended after the next release */
+    unsigned long skipped;     /* releases dropped to catch up */
+    unsigned long late_max_ns; /* worst wakeup latency */
+} rt;
+
+static atomic_int rt_key_latest = 0xFF;
+static atomic_int rt_seg_latch = 0xFF;
+
+static struct {
+    atomic_int phases;         /* left to drive, 0 = idle */
+    atomic_int done;           /* driven so far in this job */
+    int period;                /* ticks per phase */
+    int countdown;
+    int phase;
+    atomic_int busy;           /* coils need releasing */
+    int io_op;                 /* port I/O accounting tag of the job */
+} rt_motor;
+
+static struct {
+    atomic_int ticks;          /* left to play, 0 = idle */
+    int half;                  /* ticks per half period */
+    int countdown;
+    int high;
+    unsigned char hi, lo;
+} rt_dac;
+
+
+static int rt_active(void)
+{
+    return atomic_load(&rt.running);
+}
+
+static long long rt_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int rt_ticks_for_us(long long us)
+{
+    long long t = (us * rt.hz + 500000) / 1000000;
+    return t < 1 ? 1 : (int)t;
+}
+
+/* ----- Slots ----- */
+static void rt_slot_dac(void)
+{
+    if (atomic_load_explicit(&rt_dac.ticks, memory_order_acquire) <= 0) return;
+    io_op_cur = IOP_BEEP;
+
+    if (--rt_dac.countdown <= 0) {
+        rt_dac.high = !rt_dac.high;
+        dac_write(rt_dac.high ? rt_dac.hi : rt_dac.lo);
+        rt_dac.countdown = rt_dac.half;
+    }
+    if (atomic_fetch_sub(&rt_dac.ticks, 1) == 1) dac_write(0);
+}
+
+static void rt_slot_motor(void)
+{
+    if (atomic_load_explicit(&rt_motor.phases, memory_order_acquire) <= 0) {
+        if (rt_motor.busy && --rt_motor.countdown <= 0) {
+            io_op_cur = rt_motor.io_op;
+            motor_release();                     /* last phase has had its period */
+            rt_motor.busy = 0;
+        }
+        return;
+    }
+    if (--rt_motor.countdown > 0) return;
+
+    io_op_cur = rt_motor.io_op;
+    motor_write_phase(rt_motor.phase);
+    rt_motor.phase = (rt_motor.phase + 1) & 3;
+    rt_motor.countdown = rt_motor.period;
+    rt_motor.busy = 1;
+    atomic_fetch_add(&rt_motor.done, 1);
+    atomic_fetch_sub(&rt_motor.phases, 1);
+}
+
+static void rt_slot_seg(void)
+{
+    if (!(M->pm->caps & PMC_LED)) return;
+    io_op_cur = IOP_SEG;
+    port_out(M->pm->led, (unsigned char)atomic_load(&rt_seg_latch));
+}
+
+static void rt_slot_keypad(void)
+{
+    atomic_store(&rt_key_latest, ScanKey());
+}
+
+/* run order within a tick; periods are filled in by rt_start() */
+static RtSlot rt_slots[] = {
+    { "dac",    1, 50,  rt_slot_dac,    0, 0, 0 },
+    { "motor",  1, 50,  rt_slot_motor,  0, 0, 0 },
+    { "seg",    0, 50,  rt_slot_seg,    0, 0, 0 },
+    { "keypad", 0, 200, rt_slot_keypad, 0, 0, 0 },
+};
+#define RT_NSLOTS ((int)(sizeof(rt_slots) / sizeof(rt_slots[0])))
+
+static void *rt_main(void *arg)
+{
+    (void)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long long release = (long long)next.tv_sec * 1000000000LL + next.tv_nsec;
+
+    while (atomic_load(&rt.running)) {
+        release += rt.period_ns;
+        next.tv_sec = (time_t)(release / 1000000000LL);
+        next.tv_nsec = (long)(release % 1000000000LL);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) { }
+
+        long long t = rt_now_ns();
+        if (t - release > (long long)rt.late_max_ns) rt.late_max_ns = (unsigned long)(t - release);
+        if (t - release >= rt.period_ns) {
+            long long behind = (t - release) / rt.period_ns;
+            rt.skipped += (unsigned long)behind;
+            release += behind * rt.period_ns;
+        }
+
+        rt.ticks++;
+        for (int i = 0; i < RT_NSLOTS; i++) {
+            RtSlot *s = &rt_slots[i];
+            if (rt.ticks % (unsigned long)s->period) continue;
+            long long t0 = rt_now_ns();
+            s->run();
+            unsigned long d = (unsigned long)(rt_now_ns() - t0);
+            s->runs++;
+            if (d > s->worst_ns) s->worst_ns = d;
+            if (d > (unsigned long)s->budget_us * 1000UL) s->over_budget++;
+        }
+        if (rt_now_ns() > release + rt.period_ns) rt.misses++;
+    }
+    return NULL;
+}
+
+static int rt_default_cpu(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 1 ? (int)n - 1 : 0;
+}
+
+/* Start the control loop if SNACK_RT asks for it. Missing privileges
+ * (SCHED_FIFO, mlockall) degrade to a best-effort thread, reported in
+ * the stats file; returns -1 only if no thread could be started. */
+static int rt_start(void)
+{
+    const char *hz = getenv("SNACK_RT");
+    if (!hz || atoi(hz) <= 0 || gClock->simulated) return 0;
+
+    const char *cpu = getenv("SNACK_RT_CPU");
+    const char *prio = getenv("SNACK_RT_PRIO");
+    rt.hz = atoi(hz);
+    if (rt.hz > 20000) rt.hz = 20000;
+    rt.period_ns = 1000000000L / rt.hz;
+    rt.cpu = cpu ? atoi(cpu) : rt_default_cpu();
+
+    rt_slots[2].period = rt_ticks_for_us(RT_SEG_REFRESH_MS * 1000LL);
+    rt_slots[3].period = rt_ticks_for_us(KEY_SCAN_MS * 1000LL);
+
+    rt.locked = (mlockall(MCL_CURRENT | MCL_FUTURE) == 0);
+    if (!rt.locked) fprintf(stderr, "rt: mlockall failed (%s)\n", strerror(errno));
+
+    pthread_attr_t attr;
+    struct sched_param sp;
+    cpu_set_t set;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = prio ? atoi(prio) : RT_PRIO_DEFAULT;
+    CPU_ZERO(&set);
+    CPU_SET(rt.cpu, &set);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &sp);
+
+    atomic_store(&rt_seg_latch, 0xFF);
+    atomic_store(&rt.running, 1);
+    rt.fifo = 1;
+    int err = pthread_create(&rt.thread, &attr, rt_main, NULL);
+    if (err == EPERM || err == EINVAL) {
+        fprintf(stderr, "rt: SCHED_FIFO unavailable, running best effort\n");
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        rt.fifo = 0;
+        err = pthread_create(&rt.thread, &attr, rt_main, NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+        fprintf(stderr, "rt: cannot start control loop (%s)\n", strerror(err));
+        atomic_store(&rt.running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void rt_stop(void)
+{
+    if (!atomic_exchange(&rt.running, 0)) return;
+    pthread_join(rt.thread, NULL);
+    motor_release();
+    dac_write(0);
+}
+
+static void rt_stats_dump(FILE *fp)
+{
+    if (rt.hz <= 0) return;
+    fprintf(fp, "\n[rt]\n");
+    fprintf(fp, "hz=%d\ncpu=%d\nsched_fifo=%d\nmlocked=%d\n", rt.hz, rt.cpu, rt.fifo, rt.locked);
+    fprintf(fp, "ticks=%lu\ndeadline_misses=%lu\nskipped_releases=%lu\nwakeup_late_max_us=%lu\n",
+            rt.ticks, rt.misses, rt.skipped, rt.late_max_ns / 1000);
+    for (int i = 0; i < RT_NSLOTS; i++) {
+        const RtSlot *s = &rt_slots[i];
+        fprintf(fp, "slot_%s=period:%d budget_us:%d runs:%lu over_budget:%lu worst_us:%lu\n",
+                s->name, s->period, s->budget_us, s->runs, s->over_budget, s->worst_ns / 1000);
+    }
+}
+
+/* ----- What the UI thread calls ----- */
+static void rt_seg_set(unsigned char v)
+{
+    if (!(M->pm->caps & PMC_LED)) return;
+    if (rt_active()) {
+        atomic_store(&rt_seg_latch, v);
+    } else {
+        IoScope io = io_op_begin(IOP_SEG);
+        port_out(M->pm->led, v);
+        io_op_end(&io);
+    }
+}
+
+/* The keypad as the UI sees it: the loop's last scan, or a direct scan. */
+static unsigned char keypad_read(void)
+{
+    if (rt_active()) return (unsigned char)atomic_load(&rt_key_latest);
+    return ScanKey();
+}
+
+static void rt_tone(int duration_ms, int half_period_us, unsigned char hi, unsigned char lo)
+{
+    rt_dac.half = rt_ticks_for_us(half_period_us);
+    rt_dac.countdown = 1;
+    rt_dac.high = 0;
+    rt_dac.hi = hi;
+    rt_dac.lo = lo;
+    atomic_store_explicit(&rt_dac.ticks, rt_ticks_for_us(duration_ms * 1000LL), memory_order_release);
+    while (atomic_load(&rt_dac.ticks) > 0 && !op_aborted()) clock_sleep_us(1000);
+}
+
+/* ===== Device threads (SNACK_THREADS) =====
+ * SNACK_THREADS=1 gives each slow device its own thread so a pqiv fork,
+ * an LCD rewrite or a beep no longer stalls everything else:
+ * - input:   scans the keypad every KEY_SCAN_MS, emits one key per press
+ *            (it owns the release wait) to the event loop via an eventfd
+ * - lcd:     two-line rewrites, on the port mapping active when queued
+ * - display: pqiv presents (fb/drm blits are memory copies and stay on
+ *            the UI thread, which owns the decoded frames)
+ * - motor:   step runs; reports each step and completion back
+ * - audio:   tones and gaps, played in order without blocking the UI
+ * Every link is an SPSC ring (spsc.h) plus an eventfd to wake the
+ * consumer, so the state machine stays the single-threaded coordinator.
+ * Per-channel depth and latency go to the [channels] stats section.
+ * Off under SNACK_SIM and when SNACK_RT already owns the port I/O. */
+#define DEV_CHAN_LEN 64
+
+enum {
+    DEV_QUIT,
+    DEV_LCD,           /* a = port, l1, l2 */
+    DEV_LCD_POWER,     /* a = port, b = on */
+    DEV_IMAGE,         /* path */
+    DEV_MOTOR_RUN,     /* a = steps, b = phase delay us, c = start phase, d = I/O op tag */
+    DEV_TONE,          /* a = ms, b = half period us, c = hi, d = lo */
+    DEV_GAP,           /* a = us */
+    DEV_KEY,           /* a = key */
+    DEV_MOTOR_STEP,    /* a = steps done */
+    DEV_MOTOR_DONE,
+    DEV_SCAN           /* a = scan period ms, b = probe only (asleep) */
+};
+
+typedef struct {
+    int op;
+    int a, b, c, d;
+    unsigned epoch;        /* dev_epoch when sent (0: stamped by dev_send) */
+    const char *path;
+    char l1[17];
+    char l2[17];
+} DevMsg;
+
+typedef struct {
+    Spsc q;
+    int efd;               /* consumer sleeps on it, producer bumps it */
+    int room_efd;          /* a blocked producer sleeps on it, consumer bumps it */
+    atomic_int blocked;
+} DevChan;
+
+typedef struct Device Device;
+struct Device {
+    const char *name;
+    DevChan cmd;                     /* UI -> device */
+    void (*handle)(Device *d, const DevMsg *m);
+    void (*tick)(Device *d);         /* periodic work, NULL = none */
+    int tick_ms;
+    pthread_t th;
+    int started;
+};
+
+static int dev_on = 0;
+static DevChan dev_input_ev = { .efd = -1, .room_efd = -1 };   /* input -> UI: keys */
+static DevChan dev_motor_ev = { .efd = -1, .room_efd = -1 };   /* motor -> UI: progress */
+
+static int dev_chan_init(DevChan *c, const char *name)
+{
+    c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->room_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    atomic_init(&c->blocked, 0);
+    if (c->efd < 0 || c->room_efd < 0 || spsc_init(&c->q, name, sizeof(DevMsg), DEV_CHAN_LEN) < 0) {
+        if (c->efd >= 0) close(c->efd);
+        if (c->room_efd >= 0) close(c->room_efd);
+        c->efd = c->room_efd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void dev_chan_free(DevChan *c)
+{
+    if (c->efd >= 0) close(c->efd);
+    if (c->room_efd >= 0) close(c->room_efd);
+    c->efd = c->room_efd = -1;
+    spsc_free(&c->q);
+}
+
+/* Commands wait for room, sleeping on room_efd; key events are dropped.
+ * Either way a send that found the ring full counts once as full. */
+static void dev_send(DevChan *c, const DevMsg *msg, int may_drop)
+{
+    DevMsg stamped = *msg, *m = &stamped;
+    if (!m->epoch) m->epoch = atomic_load(&dev_epoch);
+    if (spsc_push(&c->q, m, rt_now_ns()) < 0) {
+        c->q.full++;
+        if (may_drop) return;
+        atomic_store(&c->blocked, 1);
+        while (spsc_push(&c->q, m, rt_now_ns()) < 0) {
+            struct pollfd pfd = { .fd = c->room_efd, .events = POLLIN };
+            if (poll(&pfd, 1, 10) > 0) {     /* the timeout covers a missed bump */
+                uint64_t n;
+                if (read(c->room_efd, &n, sizeof(n)) < 0) { }
+            }
+        }
+        atomic_store(&c->blocked, 0);
+    }
+    uint64_t one = 1;
+    if (write(c->efd, &one, sizeof(one)) < 0) { }
+}
+
+static int dev_recv(DevChan *c, DevMsg *m)
+{
+    if (spsc_pop(&c->q, m, rt_now_ns()) < 0) return -1;
+    if (atomic_load(&c->blocked)) {
+        uint64_t one = 1;
+        if (write(c->room_efd, &one, sizeof(one)) < 0) { }
+    }
+    return 0;
+}
+
+/* Sleep until the channel is bumped or timeout_ms passes (-1 = forever). */
+static void dev_wait(DevChan *c, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = c->efd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        uint64_t n;
+        if (read(c->efd, &n, sizeof(n)) < 0) { }
+    }
+}
+
+static void *dev_main(void *arg)
+{
+    Device *d = (Device *)arg;
+    long long next_tick = d->tick ? now_ms() + d->tick_ms : 0;
+    DevMsg m;
+
+    while (1) {
+        int timeout = -1;
+        if (d->tick) {
+            long long left = next_tick - now_ms();
+            timeout = left > 0 ? (int)left : 0;
+        }
+        dev_wait(&d->cmd, timeout);
+
+        while (dev_recv(&d->cmd, &m) == 0) {
+            if (m.op == DEV_QUIT) return NULL;
+            /* commands from before a watchdog recovery are dropped (scan settings are state) */
+            if (m.op != DEV_SCAN && m.epoch != atomic_load(&dev_epoch)) continue;
+            dev_cur_epoch = m.epoch;
+            if (d->handle) d->handle(d, &m);
+            dev_cur_epoch = 0;
+        }
+        if (d->tick && now_ms() >= next_tick) {
+            d->tick(d);
+            next_tick += d->tick_ms;
+            if (next_tick <= now_ms()) next_tick = now_ms() + d->tick_ms;
+        }
+    }
+}
+
+/* ----- Device handlers ----- */
+static int dev_input_probe = 0;    /* input thread only */
+
+static void dev_input_handle(Device *d, const DevMsg *m)
+{
+    if (m->op != DEV_SCAN) return;
+    d->tick_ms = m->a;
+    dev_input_probe = m->b;
+}
+
+static void dev_input_tick(Device *d)
+{
+    static int latched = 0;
+    (void)d;
+    if (dev_input_probe && !keypad_any_down()) { latched = 0; return; }
+    unsigned char k = ScanKey();
+    if (k == 0xFF) { latched = 0; return; }
+    if (latched) return;
+    latched = 1;
+
+    DevMsg m = { .op = DEV_KEY, .a = k };
+    dev_send(&dev_input_ev, &m, 1);
+}
+
+static void dev_lcd_handle(Device *d, const DevMsg *m)
+{
+    (void)d;
+    if (m->op == DEV_LCD) lcd_write2_on((unsigned char)m->a, m->l1, m->l2);
+    else if (m->op == DEV_LCD_POWER) lcd_power_on((unsigned char)m->a, m->b);
+}
+
+static void dev_display_handle(Device *d, const DevMsg *m)
+{
+    (void)d;
+    if (m->op == DEV_IMAGE) gDisplay->present(m->path, NULL, NULL, 0);
+}
+
+static void dev_motor_handle(Device *d, const DevMsg *m)
+{
+    (void)d;
+    if (m->op != DEV_MOTOR_RUN) return;
+
+    IoScope io = io_op_begin(m->d);
+    int phase = m->c;
+    for (int s = 0; s < m->a && !op_aborted(); s++) {
+        DevMsg ev = { .op = DEV_MOTOR_STEP, .a = s, .epoch = m->epoch };
+        dev_send(&dev_motor_ev, &ev, 0);
+        phase = motor_step_batch(phase, m->b);
+    }
+    motor_release();
+    io_op_end(&io);
+
+    DevMsg done = { .op = DEV_MOTOR_DONE, .a = m->a, .epoch = m->epoch };
+    dev_send(&dev_motor_ev, &done, 0);
+}
+
+static void dev_audio_handle(Device *d, const DevMsg *m)
+{
+    (void)d;
+    if (m->op == DEV_TONE) dac_square(m->a, m->b, (unsigned char)m->c, (unsigned char)m->d);
+    else if (m->op == DEV_GAP) clock_sleep_us(m->a);
+}
+
+static Device devices[] = {
+    { "input",   { .efd = -1, .room_efd = -1 }, dev_input_handle,   dev_input_tick, KEY_SCAN_MS, 0, 0 },
+    { "lcd",     { .efd = -1, .room_efd = -1 }, dev_lcd_handle,     NULL, 0, 0, 0 },
+    { "display", { .efd = -1, .room_efd = -1 }, dev_display_handle, NULL, 0, 0, 0 },
+    { "motor",   { .efd = -1, .room_efd = -1 }, dev_motor_handle,   NULL, 0, 0, 0 },
+    { "audio",   { .efd = -1, .room_efd = -1 }, dev_audio_handle,   NULL, 0, 0, 0 },
+};
+#define DEV_N ((int)(sizeof(devices) / sizeof(devices[0])))
+enum { DEV_INPUT, DEV_LCDDEV, DEV_DISPLAY, DEV_MOTOR, DEV_AUDIO };
+
+static void dev_stop(void)
+{
+    DevMsg quit = { .op = DEV_QUIT };
+    for (int i = 0; i < DEV_N; i++) {
+        if (!devices[i].started) continue;
+        dev_send(&devices[i].cmd, &quit, 0);
+        pthread_join(devices[i].th, NULL);
+        devices[i].started = 0;
+    }
+    dev_on = 0;
+}
+
+static int dev_start(void)
+{
+    const char *t = getenv("SNACK_THREADS");
+    if (!t || atoi(t) <= 0 || gClock->simulated || rt_active()) return 0;
+
+    if (dev_chan_init(&dev_input_ev, "input->ui") < 0 ||
+        dev_chan_init(&dev_motor_ev, "motor->ui") < 0)
+        goto fail;
+
+    static char names[DEV_N][16];
+    for (int i = 0; i < DEV_N; i++) {
+        snprintf(names[i], sizeof(names[i]), "ui->%s", devices[i].name);
+        if (dev_chan_init(&devices[i].cmd, names[i]) < 0) goto fail;
+        if (pthread_create(&devices[i].th, NULL, dev_main, &devices[i]) != 0) goto fail;
+        devices[i].started = 1;
+    }
+    dev_on = 1;
+    return 0;
+
+fail:
+    fprintf(stderr, "threads: cannot start device threads, running inline\n");
+    dev_stop();
+    for (int i = 0; i < DEV_N; i++) dev_chan_free(&devices[i].cmd);
+    dev_chan_free(&dev_input_ev);
+    dev_chan_free(&dev_motor_ev);
+    return -1;
+}
+
+static void dev_chan_dump(FILE *fp, Spsc *q)
+{
+    fprintf(fp, "%s=pushed:%lu popped:%lu full:%lu depth:%u depth_max:%u lat_avg_us:%.1f lat_max_us:%.1f\n",
+            q->name, q->pushed, q->popped, q->full, spsc_depth(q), q->depth_max,
+            q->popped ? (double)q->lat_sum / q->popped / 1000.0 : 0.0, (double)q->lat_max / 1000.0);
+}
+
+static void dev_stats_dump(FILE *fp)
+{
+    if (!dev_input_ev.q.buf) return;
+    fprintf(fp, "\n[channels]\n");
+    for (int i = 0; i < DEV_N; i++)
+        if (devices[i].cmd.q.buf) dev_chan_dump(fp, &devices[i].cmd.q);
+    dev_chan_dump(fp, &dev_input_ev.q);
+    if (dev_motor_ev.q.buf) dev_chan_dump(fp, &dev_motor_ev.q);
+}
+
+/* ----- What the UI thread calls (0 = queued, -1 = run it inline) ----- */
+static int dev_lcd(const char *l1, const char *l2)
+{
+    if (!dev_on) return -1;
+    DevMsg m = { .op = DEV_LCD, .a = M->pm->lcd };
+    snprintf(m.l1, sizeof(m.l1), "%s", l1);
+    snprintf(m.l2, sizeof(m.l2), "%s", l2);
+    dev_send(&devices[DEV_LCDDEV].cmd, &m, 0);
+    return 0;
+}
+
+static int dev_lcd_power(int on)
+{
+    if (!dev_on) return -1;
+    DevMsg m = { .op = DEV_LCD_POWER, .a = M->pm->lcd, .b = on };
+    dev_send(&devices[DEV_LCDDEV].cmd, &m, 0);
+    return 0;
+}
+
+static int dev_image(const char *path)
+{
+    if (!dev_on || gDisplay->wants_frames) return -1;
+    DevMsg m = { .op = DEV_IMAGE, .path = path };
+    dev_send(&devices[DEV_DISPLAY].cmd, &m, 0);
+    return 0;
+}
+
+static int dev_tone(int duration_ms, int half_period_us, unsigned char hi, unsigned char lo)
+{
+    if (!dev_on) return -1;
+    DevMsg m = { .op = DEV_TONE, .a = duration_ms, .b = half_period_us, .c = hi, .d = lo };
+    dev_send(&devices[DEV_AUDIO].cmd, &m, 0);
+    return 0;
+}
+
+static int dev_gap(int us)
+{
+    if (!dev_on) return -1;
+    DevMsg m = { .op = DEV_GAP, .a = us };
+    dev_send(&devices[DEV_AUDIO].cmd, &m, 0);
+    return 0;
+}
+
+/* Hand a run to the motor thread and relay its progress until it ends
+ * (or the watchdog aborts it). Events of older runs are skipped. */
+static int dev_motor_run(int steps, int delay_us, int phase, void (*on_step)(int step))
+{
+    if (!dev_on) return -1;
+    unsigned epoch = atomic_load(&dev_epoch);
+    DevMsg m = { .op = DEV_MOTOR_RUN, .a = steps, .b = delay_us, .c = phase, .d = io_op_cur, .epoch = epoch };
+    dev_send(&devices[DEV_MOTOR].cmd, &m, 0);
+
+    while (!op_aborted()) {
+        DevMsg ev;
+        while (dev_recv(&dev_motor_ev, &ev) == 0) {
+            if (ev.epoch != epoch) continue;
+            if (ev.op == DEV_MOTOR_DONE) return 0;
+            if (ev.op == DEV_MOTOR_STEP && on_step) on_step(ev.a);
+        }
+        dev_wait(&dev_motor_ev, 100);
+    }
+    return 0;
+}
+
+/* ===== Motor runner ===== */
+/* Drive `steps` full steps (4 phases each, delay_us apart) and release the
+ * coils one period after the last phase. on_step, if set, is called with
+ * the steps completed so far before each new step starts. */
+static void motor_run_steps(int steps, int delay_us, void (*on_step)(int step))
+{
+    if (!(M->pm->caps & PMC_MOTOR)) return;
+    if (dev_motor_run(steps, delay_us, M->motor_phase, on_step) == 0) {
+        M->motor_phase = (M->motor_phase + steps * 4) & 3;
+        return;
+    }
+    if (!rt_active()) {
+        for (int s = 0; s < steps && !op_aborted(); s++) {
+            if (on_step) on_step(s);
+            M->motor_phase = motor_step_batch(M->motor_phase, delay_us);
+        }
+        motor_release();
+        return;
+    }
+
+    rt_motor.period = rt_ticks_for_us(delay_us);
+    rt_motor.countdown = 1;
+    rt_motor.phase = M->motor_phase;
+    rt_motor.io_op = io_op_cur;
+    atomic_store(&rt_motor.done, 0);
+    atomic_store_explicit(&rt_motor.phases, steps * 4, memory_order_release);
+
+    int shown = -1;
+    while ((atomic_load(&rt_motor.phases) > 0 || rt_motor.busy) && !op_aborted()) {
+        int step = atomic_load(&rt_motor.done) / 4;
+        if (on_step && step != shown && step < steps) { on_step(step); shown = step; }
+        clock_sleep_us(1000);
+    }
+    M->motor_phase = (M->motor_phase + steps * 4) & 3;
+}
+
+/* ===== Key release ===== */
+static void wait_key_release(void)
+{
+    WD_MARK();
+    while (!op_aborted() && keypad_read() != 0xFF) clock_sleep_us(12000);
+}
+
+/* ===== DAC beeps ===== */
+static void beep_square(int duration_ms, int half_period_us, unsigned char hi, unsigned char lo)
+{
+    if (rt_active()) rt_tone(duration_ms, half_period_us, hi, lo);
+    else if (dev_tone(duration_ms, half_period_us, hi, lo) < 0) dac_square(duration_ms, half_period_us, hi, lo);
+}
+
+/* Silence between the parts of a cue (queued behind them when threaded). */
+static void beep_gap(int us)
+{
+    if (dev_gap(us) < 0) clock_sleep_us(us);
+}
+
+static void beep_keypress(void) { beep_square(25, 650, 200, 20); }
+static void beep_error(void)    { beep_square(140, 1400, 180, 0); }
+
+static void beep_success(void)
+{
+    beep_square(70, 800, 220, 10);
+    beep_gap(35000);
+    beep_square(70, 500, 220, 10);
+}
+
+static void beep_payment_ok(void)
+{
+    beep_square(60, 900, 220, 0);
+    beep_gap(20000);
+    beep_square(60, 650, 220, 0);
+}
+
+/* Dispensing sound cues (slot-specific) */
+static void beep_dispensing_slot(int slot)
+{
+    switch (slot) {
+        case 1: beep_square(180, 900, 220, 0); break;
+        case 2: beep_square(220, 700, 220, 0); break;
+        case 3: beep_square(260, 550, 220, 0); break;
+        case 4: beep_square(320, 450, 220, 0); break;
+        default: beep_square(200, 650, 220, 0); break;
+    }
+}
+
+/* ===== Items ===== */
+typedef int Cents;         /* money, in integer cents */
+
+typedef struct {
+    int index;
+    const char *name;
+    Cents price;
+    const char *img;
+    const char *img_oos;
+    int stock;
+} Item;
+
+static const Item default_items[] = {
+    {  3, "Cheetos", 150, IMG_ZOOM_1, IMG_ZOOM_1_OOS, 1 },
+    {  8, "Lays",    150, IMG_ZOOM_2, IMG_ZOOM_2_OOS, 2 },
+    { 11, "Doritos", 150, IMG_ZOOM_3, IMG_ZOOM_3_OOS, 3 },
+    { 22, "Pocky",   175, IMG_ZOOM_4, IMG_ZOOM_4_OOS, 4 },
+};
+#define N_DEFAULT_ITEMS ((int)(sizeof(default_items) / sizeof(default_items[0])))
+
+/* Stock changes as logged by the persistent inventory (SNACK_INV). */
+enum { INV_SALE = 1, INV_SET = 2 };
+static void inv_log(int kind, int index, int value);
+static void inv_sync(void);
+
+static void format_money(char out[16], Cents v)
+{
+    unsigned c = v > 0 ? (unsigned)v : 0;
+    snprintf(out, 16, "$%u.%02u", c / 100, c % 100);
+}
+
+/* Total and pay-screen line for every amount of one slot, so the
+ * amount -> pay step only indexes (built in machine_new). */
+typedef struct {
+    Cents total[MAX_COUNT + 1];
+    char line[MAX_COUNT + 1][17];  /* "Total $x.xx" */
+} PriceRow;
+
+/* One row per item; returns NULL when out of memory. */
+static PriceRow *price_table_build(const Item *items, int n)
+{
+    PriceRow *rows = calloc((size_t)(n > 0 ? n : 1), sizeof(*rows));
+    if (!rows) return NULL;
+    for (int i = 0; i < n; i++) {
+        for (int a = 1; a <= MAX_COUNT; a++) {
+            char money[16];
+            rows[i].total[a] = items[i].price * a;
+            format_money(money, rows[i].total[a]);
+            snprintf(rows[i].line[a], sizeof(rows[i].line[a]), "Total %.10s", money);
+        }
+    }
+    return rows;
+}
+
+/* The selection number's slot via the catalogue's index (built in machine_new). */
+static int find_slot_by_index(const SlotIndex *slots, int idx)
+{
+    return slot_index_find(slots, idx);
+}
+
+/* Warm the images ENTER could show for the typed index prefix:
+ * exact match first, then the longer indexes it starts. */
+static void prefetch_for_prefix(const Item *items, int n, const char *prefix)
+{
+    size_t plen = strlen(prefix);
+    if (plen == 0) return;
+
+    int budget = IMG_CACHE_SLOTS - 1;   /* keep the current screen cached */
+    for (int pass = 0; pass < 2 && budget > 0; pass++) {
+        for (int i = 0; i < n && budget > 0; i++) {
+            char idx[12];
+            snprintf(idx, sizeof(idx), "%d", items[i].index);
+            int exact = (strcmp(idx, prefix) == 0);
+            if (pass == 0 ? !exact : (exact || strncmp(idx, prefix, plen) != 0)) continue;
+
+            img_prefetch(items[i].img);
+            budget--;
+            if (items[i].stock <= 0 && budget > 0) { img_prefetch(items[i].img_oos); budget--; }
+        }
+    }
+}
+
+/* ===== UI event queue =====
+ * Timer callbacks and entry actions post EV_* here; the main loop feeds
+ * them to the state machine after every tw_run(). */
+static void ui_post(int ev)
+{
+    if (M->ui_evq_len >= UI_EVQ_LEN) return;
+    M->ui_evq[(M->ui_evq_head + M->ui_evq_len) % UI_EVQ_LEN] = ev;
+    M->ui_evq_len++;
+}
+
+static int ui_take(void)
+{
+    if (M->ui_evq_len == 0) return -1;
+    int ev = M->ui_evq[M->ui_evq_head];
+    M->ui_evq_head = (M->ui_evq_head + 1) % UI_EVQ_LEN;
+    M->ui_evq_len--;
+    return ev;
+}
+
+static int ui_has_posted(void) { return M->ui_evq_len > 0; }
+
+/* ===== 9s timer (normal mode only) ===== */
+static void timer_update_display(long long t);
+static int timer_seconds_left(long long t);
+
+static void idle_on_timer(Timer *tm, void *ctx)
+{
+    (void)ctx;
+    long long t = now_ms();
+    timer_update_display(t);
+    if (timer_seconds_left(t) == 0) { ui_post(EV_IDLE_TIMEOUT); return; }
+
+    long long rem = M->idle_deadline - t;
+    timer_arm(tm, M->idle_deadline - ((rem - 1) / 1000) * 1000, idle_on_timer, NULL);
+}
+
+static void timer_start_or_reset(void)
+{
+    M->idle_deadline = now_ms() + IDLE_MS;
+    M->last_shown = -1;
+    timer_arm(&M->idle_timer, M->idle_deadline - IDLE_MS + 1000, idle_on_timer, NULL);
+}
+
+static int timer_seconds_left(long long t)
+{
+    if (M->idle_deadline <= 0) return -1;
+    long long rem = M->idle_deadline - t;
+    if (rem <= 0) return 0;
+    int sec = (int)((rem + 999) / 1000);
+    if (sec > 9) sec = 9;
+    if (sec < 0) sec = 0;
+    return sec;
+}
+
+static void timer_update_display(long long t)
+{
+    int left = timer_seconds_left(t);
+    if (left < 0) return;
+    if (left != M->last_shown) { seg_show_digit(left); M->last_shown = left; }
+}
+
+static void timer_stop_and_blank(void)
+{
+    M->idle_deadline = 0;
+    M->last_shown = -1;
+    timer_cancel(&M->idle_timer);
+    seg_blank();
+}
+
+/* ===== Service 7-seg blink ===== */
+#define SVC_BLINK_MS 500
+
+static void service_blink_on_timer(Timer *tm, void *ctx)
+{
+    (void)ctx;
+    M->blink_on = !M->blink_on;
+    if (M->blink_on) seg_show_digit(0);
+    else seg_blank();
+
+    long long next = tm->expires + SVC_BLINK_MS;
+    long long t = now_ms();
+    if (next <= t) next = t + SVC_BLINK_MS;
+    timer_arm(tm, next, service_blink_on_timer, NULL);
+}
+
+static void service_blink_reset(void)
+{
+    M->blink_on = 1;
+    seg_show_digit(0);
+    timer_arm(&M->blink_timer, now_ms() + SVC_BLINK_MS, service_blink_on_timer, NULL);
+}
+
+static void service_blink_stop(void)
+{
+    timer_cancel(&M->blink_timer);
+}
+
+/* ===== Service menu LCD (fits 16 chars) ===== */
+static void service_menu_screen(const char *typed)
+{
+    show_image(IMG_SERVICE_MANUAL);
+
+    char l1[17], l2[17];
+    if (typed && *typed) snprintf(l1, sizeof(l1), "Svc:%-12.12s", typed);
+    else                snprintf(l1, sizeof(l1), "Svc:");
+    snprintf(l2, sizeof(l2), "B=OK 1-5/1234");
+    lcd_print2(l1, l2);
+}
+
+/* ===== Event loop (epoll + timerfd) =====
+ * Every wakeup source lives in one epoll instance. All deadlines live in
+ * the timer wheel, which drives a single absolute CLOCK_MONOTONIC timerfd
+ * (the clock now_ms() reads) re-armed only when tw_next() moves, so the
+ * loop sleeps until the next thing is actually due. The keypad is just another source: the CM3
+ * pad has no interrupt line, so its source is a scan timer, and a
+ * control socket feeds keys and commands into the same queue. */
+#define LOOP_MAX_SOURCES 16
+#define CTL_SOCK_PATH "/tmp/snack.sock"   /* SNACK_CTL overrides, "" disables */
+
+typedef void (*LoopFn)(int fd, void *ctx);
+
+typedef struct {
+    int fd;
+    LoopFn fn;
+    void *ctx;
+} LoopSource;
+
+typedef struct {
+    int fd;
+    long long armed;       /* absolute ms, 0 = disarmed */
+} LoopTimer;
+
+static int loop_epfd = -1;
+static LoopSource loop_src[LOOP_MAX_SOURCES];
+static int loop_nsrc = 0;
+
+static LoopTimer lt_wheel = { .fd = -1 };
+static int lt_scan_fd = -1;
+static int loop_scan_ms = KEY_SCAN_MS;
+static int loop_scan_probe = 0;        /* asleep: probe before scanning */
+
+static int ctl_fd = -1;
+static char ctl_path[108] = "";
+
+static int loop_add_fd(int fd, LoopFn fn, void *ctx)
+{
+    if (loop_epfd < 0 || loop_nsrc >= LOOP_MAX_SOURCES) return -1;
+
+    LoopSource *s = &loop_src[loop_nsrc];
+    s->fd = fd;
+    s->fn = fn;
+    s->ctx = ctx;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+    loop_nsrc++;
+    return 0;
+}
+
+static void pm_note_key(void);
+
+static void keyq_push(unsigned char k, int from_pad)
+{
+    pm_note_key();
+    if (M->keyq_len >= KEYQ_LEN) return;
+    int i = (M->keyq_head + M->keyq_len) % KEYQ_LEN;
+    M->keyq[i].key = k;
+    M->keyq[i].from_pad = (unsigned char)from_pad;
+    M->keyq_len++;
+    loop_stats.keys++;
+}
+
+static unsigned char keyq_pop(int *from_pad)
+{
+    if (M->keyq_len == 0) return 0xFF;
+    unsigned char k = M->keyq[M->keyq_head].key;
+    *from_pad = M->keyq[M->keyq_head].from_pad;
+    M->keyq_head = (M->keyq_head + 1) % KEYQ_LEN;
+    M->keyq_len--;
+    return k;
+}
+
+/* Queue keys, the first gap_ms after the previous one, the rest key_ms apart. */
+static int script_keys(const char *keys, int gap_ms, int key_ms)
+{
+    for (const char *p = keys; *p; p++) {
+        if (M->script_len >= SCRIPT_LEN) return -1;
+        int i = (M->script_head + M->script_len) % SCRIPT_LEN;
+        M->script[i].gap_ms = (p == keys) ? gap_ms : key_ms;
+        M->script[i].key = (unsigned char)*p;
+        M->script_len++;
+    }
+    return 0;
+}
+
+/* Due time of the next scripted key, -1 when the script is empty. */
+static long long script_next_ms(void)
+{
+    if (M->script_len == 0) return -1;
+    if (M->script_due == 0) M->script_due = now_ms() + M->script[M->script_head].gap_ms;
+    return M->script_due;
+}
+
+static void script_deliver(long long now)
+{
+    if (M->script_len == 0 || script_next_ms() > now) return;
+    keyq_push(M->script[M->script_head].key, 0);
+    M->script_head = (M->script_head + 1) % SCRIPT_LEN;
+    M->script_len--;
+    M->script_due = 0;
+}
+
+static void timer_drain(int fd)
+{
+    uint64_t n;
+    while (read(fd, &n, sizeof(n)) == (ssize_t)sizeof(n)) { }
+}
+
+/* One-shot deadline fired: the main pass does the work, we just forget it. */
+static void loop_on_timer(int fd, void *ctx)
+{
+    LoopTimer *lt = (LoopTimer *)ctx;
+    timer_drain(fd);
+    lt->armed = 0;
+}
+
+/* Keys from the input thread (SNACK_THREADS); it already waited for release. */
+static void loop_take_input(void)
+{
+    DevMsg m;
+    while (dev_recv(&dev_input_ev, &m) == 0)
+        if (m.op == DEV_KEY) keyq_push((unsigned char)m.a, 0);
+}
+
+static void loop_on_input(int fd, void *ctx)
+{
+    (void)ctx;
+    timer_drain(fd);
+    loop_take_input();
+}
+
+static void loop_scan_keypad(void)
+{
+    if (dev_on) { loop_take_input(); return; }
+    loop_stats.scans++;
+    if (loop_scan_probe && !rt_active() && !keypad_any_down()) { M->key_latched = 0; return; }
+    unsigned char k = keypad_read();
+    if (k == 0xFF) { M->key_latched = 0; return; }
+    if (M->key_latched) return;
+    M->key_latched = 1;
+    keyq_push(k, 1);
+}
+
+/* A signal handler asked for stats or shutdown; the main loop checks the flags. */
+static void loop_on_wake(int fd, void *ctx)
+{
+    (void)ctx;
+    timer_drain(fd);
+}
+
+static void loop_on_scan(int fd, void *ctx)
+{
+    (void)ctx;
+    timer_drain(fd);
+    loop_scan_keypad();
+}
+
+/* "key 12B" queues keys, "stats" writes STATS_PATH. */
+static void loop_on_ctl(int fd, void *ctx)
+{
+    char buf[64];
+    ssize_t n;
+    (void)ctx;
+
+    while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        loop_stats.ctl_cmds++;
+        if (strncmp(buf, "key ", 4) == 0) {
+            for (char *p = buf + 4; *p; p++) {
+                unsigned char c = (unsigned char)toupper((unsigned char)*p);
+                if (isdigit(c) || c == KEY_BACK || c == KEY_ENTER) keyq_push(c, 0);
+            }
+        } else if (strncmp(buf, "stats", 5) == 0) {
+            stats_dump_requested = 1;
+        }
+    }
+}
+
+static int loop_timer_new(LoopTimer *lt)
+{
+    lt->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (lt->fd < 0) return -1;
+    if (loop_add_fd(lt->fd, loop_on_timer, lt) < 0) {
+        close(lt->fd);
+        lt->fd = -1;
+        return -1;
+    }
+    lt->armed = 0;
+    return 0;
+}
+
+static void loop_timer_set(LoopTimer *lt, long long deadline)
+{
+    if (lt->fd < 0 || deadline == lt->armed) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline > 0) {
+        its.it_value.tv_sec = (time_t)(deadline / 1000);
+        its.it_value.tv_nsec = (long)(deadline % 1000) * 1000000L;
+    }
+    timerfd_settime(lt->fd, TFD_TIMER_ABSTIME, &its, NULL);
+    lt->armed = deadline;
+}
+
+static void ctl_open(void)
+{
+    const char *p = getenv("SNACK_CTL");
+    if (!p) p = CTL_SOCK_PATH;
+    if (!*p || strlen(p) >= sizeof(ctl_path)) return;
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, p);
+
+    /* only a stale socket from an earlier run is removed, never a file SNACK_CTL names by mistake */
+    struct stat st;
+    if (lstat(p, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "ctl: %s exists and is not a socket, control socket disabled\n", p);
+            return;
+        }
+        unlink(p);
+    }
+
+    ctl_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl_fd < 0) return;
+    if (bind(ctl_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        loop_add_fd(ctl_fd, loop_on_ctl, NULL) < 0) {
+        close(ctl_fd);
+        ctl_fd = -1;
+        return;
+    }
+    strcpy(ctl_path, p);
+}
+
+static int loop_scan_timer(int ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (long)(ms % 1000) * 1000000L;
+    its.it_interval = its.it_value;
+    return timerfd_settime(lt_scan_fd, 0, &its, NULL);
+}
+
+/* Keypad scan period; with probe set, a scan first checks for any key down. */
+static void loop_set_scan(int ms, int probe)
+{
+    loop_scan_ms = ms;
+    loop_scan_probe = probe;
+    if (dev_on) {
+        DevMsg m = { .op = DEV_SCAN, .a = ms, .b = probe };
+        dev_send(&devices[DEV_INPUT].cmd, &m, 0);
+        return;
+    }
+    if (lt_scan_fd >= 0) loop_scan_timer(ms);
+}
+
+/* Returns -1 when epoll is unavailable; loop_wait() then falls back to polling. */
+static int loop_init(void)
+{
+    loop_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop_epfd < 0) return -1;
+
+    if (loop_timer_new(&lt_wheel) < 0) goto fail;
+
+    int wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wfd < 0 || loop_add_fd(wfd, loop_on_wake, NULL) < 0) {
+        if (wfd >= 0) close(wfd);
+        goto fail;
+    }
+    loop_wake_fd = wfd;
+
+    if (dev_on) {
+        int fd = dup(dev_input_ev.efd);     /* the loop closes its own copy */
+        if (fd < 0 || loop_add_fd(fd, loop_on_input, NULL) < 0) {
+            if (fd >= 0) close(fd);
+            goto fail;
+        }
+        ctl_open();
+        return 0;
+    }
+
+    lt_scan_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (lt_scan_fd < 0) goto fail;
+    if (loop_scan_timer(loop_scan_ms) < 0 ||
+        loop_add_fd(lt_scan_fd, loop_on_scan, NULL) < 0)
+        goto fail;
+
+    ctl_open();
+    return 0;
+
+fail:
+    loop_shutdown();
+    return -1;
+}
+
+static void loop_shutdown(void)
+{
+    loop_wake_fd = -1;
+    for (int i = 0; i < loop_nsrc; i++) close(loop_src[i].fd);
+    loop_nsrc = 0;
+    lt_wheel.fd = -1;
+    lt_scan_fd = -1;
+    ctl_fd = -1;
+    if (ctl_path[0]) { unlink(ctl_path); ctl_path[0] = '\0'; }
+    if (loop_epfd >= 0) { close(loop_epfd); loop_epfd = -1; }
+}
+
+/* Point the wheel timerfd at the next expiry (no-op when unchanged). */
+static void loop_arm(void)
+{
+    long long d = tw_next();
+    loop_timer_set(&lt_wheel, d > 0 ? d : 0);
+}
+
+/* Block until a source fires; busy (or queued keys) only drains what is ready. */
+static void loop_wait(int busy)
+{
+    int timeout = (busy || M->keyq_len > 0) ? 0 : -1;
+
+    if (loop_epfd < 0) {
+        if (timeout < 0) tw_sleep(now_ms(), loop_scan_ms);
+        loop_scan_keypad();
+        loop_stats.wakeups++;
+        return;
+    }
+
+    struct epoll_event ev[LOOP_MAX_SOURCES];
+    int n = epoll_wait(loop_epfd, ev, LOOP_MAX_SOURCES, timeout);
+    loop_stats.wakeups++;
+    for (int i = 0; i < n; i++) {
+        LoopSource *s = (LoopSource *)ev[i].data.ptr;
+        s->fn(s->fd, s->ctx);
+    }
+}
+
+/* ===== DIP gate prompts ===== */
+static void gate_on_timeout(Timer *tm, void *ctx)
+{
+    (void)tm;
+    (void)ctx;
+    ui_post(EV_GATE_TIMEOUT);
+}
+
+static void gate_arm(int ms)
+{
+    timer_arm(&M->gate_timer, now_ms() + ms, gate_on_timeout, NULL);
+}
+
+static void gate_cancel(void)
+{
+    timer_cancel(&M->gate_timer);
+}
+
+static void show_service_gate_prompt(void)
+{
+    show_image(IMG_MENU);
+    lcd_print2("Flip SA5 DIP", "Press any key");
+}
+static void show_return_gate_prompt(void)
+{
+    show_image(IMG_SERVICE_MANUAL);
+    lcd_print2("Revert SA5 DIP", "Press any key");
+}
+
+/* ===== Dispense motor timing: 3 seconds per item ===== */
+#define TOTAL_STEPS_PER_ITEM 60
+#define DISPENSE_CYCLE_US 3000000
+#define DISP_PHASE_DELAY_US (DISPENSE_CYCLE_US / (TOTAL_STEPS_PER_ITEM * 4))
+
+static void dispense_on_step(int step)
+{
+    wd_beat();
+    anim_set_progress(M->disp_anim, step, TOTAL_STEPS_PER_ITEM);
+    tw_run(now_ms());
+}
+
+static void run_one_dispense_cycle_with_anim(void)
+{
+    motor_run_steps(TOTAL_STEPS_PER_ITEM, DISP_PHASE_DELAY_US, dispense_on_step);
+    M->motor_step_count += TOTAL_STEPS_PER_ITEM;
+}
+
+/* Dispense n items; the animation loops once per item and ends with
+ * the last item's final step. */
+static void run_dispense_with_anim(int n)
+{
+    WD_MARK();
+    IoScope io = io_op_begin(IOP_DISPENSE);
+    anim_follow(M->disp_anim, disp_frames, DISP_N, NULL, NULL);
+    for (int i = 0; i < n && !op_aborted(); i++) {
+        run_one_dispense_cycle_with_anim();
+        if (i != n - 1) clock_sleep_us(150000);
+    }
+    anim_finish(M->disp_anim);
+    io_op_end(&io);
 }
 
 /* ===== Service motor test: short spin once + 0.5s gap, repeat N cycles ===== */
 #define MOTOR_STEPS_PER_CYCLE 18   /* smaller = less rotation (tune 12..30) */
 #define MOTOR_PHASE_DELAY_US  4500 /* tune speed */
 
-static void motor_spin_one_cycle(void)
+static void motor_spin_one_cycle(void)
+{
+    motor_run_steps(MOTOR_STEPS_PER_CYCLE, MOTOR_PHASE_DELAY_US, NULL);
+}
+
+static void run_motor_test_cycles(int cycles)
+{
+    WD_MARK();
+    if (cycles < 1) cycles = 1;
+    if (cycles > 15) cycles = 15;
+
+    IoScope io = io_op_begin(IOP_MOTOR_TEST);
+    for (int c = 0; c < cycles && !op_aborted(); c++) {
+        wd_beat();
+        motor_spin_one_cycle();
+        clock_sleep_us(500000); /* 0.5s delay */
+    }
+    io_op_end(&io);
+}
+
+/* ===== UI state machine =====
+ * States, events and the transition table live in ui_fsm.h; this binds
+ * them to actions. A row's action returns the next state (ST_STAY for
+ * none) and the entry/exit hooks own per-state setup and teardown, so
+ * e.g. every way back to the menu shares menu_entry. Dispatch is one
+ * table lookup. */
+struct Ui {
+    int st;
+    Item *items;
+    int nitems;
+    SlotIndex slots;       /* selection number -> slot, kept across ui_start */
+    PriceRow *prices;      /* per slot, likewise */
+
+    char selbuf[8];        /* index (normal) / option (service menu) */
+    int sellen;
+    char amtbuf[8];
+    int amtlen;
+    char svcbuf[8];        /* service sub-screen input */
+    int svclen;
+
+    int chosen_slot;
+    int amount;
+    Cents total;
+    int pay_zero_count;
+    int index_timer_active;
+    int svc_disp_slot;
+    int restock_slot;
+    int io_page;           /* service I/O screen */
+};
+
+typedef int (*UiAction)(Ui *u, int key);
+typedef void (*UiHook)(Ui *u);
+
+static void buf_clear(char *buf, int *len)
+{
+    *len = 0;
+    buf[0] = '\0';
+}
+
+static void buf_push(char *buf, int *len, int max, int key)
+{
+    if (*len < max) { buf[(*len)++] = (char)key; buf[*len] = '\0'; }
+}
+
+static void ui_error(const char *l1, const char *l2, int ms)
+{
+    beep_error();
+    overlay_show(NULL, l1, l2, ms, NULL, NULL);
+}
+
+static void door_on_done(Anim *a, void *ctx)
+{
+    (void)a;
+    (void)ctx;
+    ui_post(EV_ANIM_DONE);
+}
+
+/* ----- Entry / exit hooks ----- */
+static void ui_nop(Ui *u) { (void)u; }
+
+static void menu_index_screen(Ui *u)
+{
+    show_image(IMG_MENU);
+    char l1[17];
+    snprintf(l1, sizeof(l1), "Enter Index:%-4.4s", u->selbuf);
+    lcd_print2(l1, "B to enter");
+}
+
+static void amount_screen(Ui *u)
+{
+    char l1[17], l2[17];
+    snprintf(l1, sizeof(l1), "Enter amount:%-3.3s", u->amtbuf);
+    snprintf(l2, sizeof(l2), "Stock: %d", u->items[u->chosen_slot].stock);
+    lcd_print2(l1, l2);
+}
+
+static void ui_menu_entry(Ui *u)
+{
+    service_blink_stop();
+    port_map_use(pm_normal);
+
+    buf_clear(u->selbuf, &u->sellen);
+    buf_clear(u->amtbuf, &u->amtlen);
+    u->chosen_slot = -1;
+    u->amount = 0;
+    u->total = 0;
+    u->pay_zero_count = 0;
+    u->index_timer_active = 0;
+    timer_stop_and_blank();
+
+    show_image(IMG_MENU);
+    lcd_print2("Enter Index:", "B to enter");
+}
+
+static void ui_menu_exit(Ui *u)
+{
+    u->index_timer_active = 0;
+    timer_stop_and_blank();
+}
+
+static void ui_amount_entry(Ui *u)
+{
+    io_sale_begin();
+    buf_clear(u->amtbuf, &u->amtlen);
+    show_image(u->items[u->chosen_slot].img);
+    timer_start_or_reset();
+    timer_update_display(now_ms());
+    amount_screen(u);
+}
+
+static void ui_pay_entry(Ui *u)
+{
+    const PriceRow *row = &u->prices[u->chosen_slot];
+    u->total = row->total[u->amount];
+    u->pay_zero_count = 0;
+    lcd_print2(row->line[u->amount], "Pay: enter 00");
+
+    timer_start_or_reset();
+    timer_update_display(now_ms());
+}
+
+static void ui_idle_exit(Ui *u)
+{
+    (void)u;
+    timer_stop_and_blank();
+}
+
+static void ui_svc_gate_entry(Ui *u)
+{
+    (void)u;
+    show_service_gate_prompt();
+    clock_sleep_us(120000);
+    port_map_use(pm_admin);
+    gate_arm(SVC_GATE_TIMEOUT_MS);
+}
+
+static void ui_return_gate_entry(Ui *u)
+{
+    (void)u;
+    show_return_gate_prompt();
+    clock_sleep_us(120000);
+    port_map_use(pm_normal);
+    gate_arm(RETURN_GATE_TIMEOUT_MS);
+}
+
+static void ui_gate_exit(Ui *u)
+{
+    (void)u;
+    gate_cancel();
+}
+
+static void ui_door_open_entry(Ui *u)
+{
+    (void)u;
+    service_blink_reset();
+    anim_play(M->door_anim, door_frames, DOOR_N, +1, DOOR_FRAME_MS, ANIM_ONESHOT, NULL, door_on_done, NULL);
+}
+
+static void ui_door_close_entry(Ui *u)
+{
+    (void)u;
+    anim_play(M->door_anim, door_frames, DOOR_N, -1, DOOR_FRAME_MS, ANIM_ONESHOT, NULL, door_on_done, NULL);
+}
+
+static void ui_svc_menu_entry(Ui *u)
+{
+    port_map_use(pm_admin);
+    buf_clear(u->selbuf, &u->sellen);
+    buf_clear(u->svcbuf, &u->svclen);
+    u->svc_disp_slot = -1;
+    u->restock_slot = -1;
+    service_menu_screen(u->selbuf);
+}
+
+static void ui_svc_disp_idx_entry(Ui *u)
+{
+    buf_clear(u->svcbuf, &u->svclen);
+    u->svc_disp_slot = -1;
+    show_image(IMG_MENU_SERVICE);
+    lcd_print2("Disp idx:", "B=OK  A=Back");
+}
+
+static void ui_svc_disp_amt_entry(Ui *u)
+{
+    buf_clear(u->svcbuf, &u->svclen);
+    show_image(u->items[u->svc_disp_slot].img);
+    lcd_print2("Amount 1-15:", "B=Run A=Back");
+}
+
+static void ui_restock_idx_entry(Ui *u)
+{
+    buf_clear(u->svcbuf, &u->svclen);
+    u->restock_slot = -1;
+    show_image(IMG_RESTOCK);
+    lcd_print2("Restock idx:", "B=OK  A=Back");
+}
+
+static void ui_restock_qty_entry(Ui *u)
+{
+    /* prompt for NEW stock (1..15) */
+    buf_clear(u->svcbuf, &u->svclen);
+    show_image(u->items[u->restock_slot].img);
+    lcd_print2("New stock 1-15", "B=OK  A=Back");
+}
+
+static void ui_sound_entry(Ui *u)
+{
+    buf_clear(u->svcbuf, &u->svclen);
+    show_image(IMG_SOUND);
+    lcd_print2("Sound 1-8:", "B=Play A=Back");
+}
+
+static void ui_motor_entry(Ui *u)
+{
+    buf_clear(u->svcbuf, &u->svclen);
+    show_image(IMG_MOTOR);
+    lcd_print2("Motor cyc 1-15", "B=Run A=Back");
+}
+
+/* Port I/O accounting: 0 totals, 1 per sale, then one page per device and per operation. */
+#define IO_PAGES (2 + IOC_OTHER + IOP_COUNT)
+
+static void io_stats_screen(Ui *u)
+{
+    char l1[17], l2[17];
+    unsigned long n, all;
+    unsigned long long ns, all_ns;
+    int p = u->io_page;
+
+    io_totals(-1, -1, &all, &all_ns);
+    if (p == 0) {
+        snprintf(l1, sizeof(l1), "I/O ops %8lu", all);
+        snprintf(l2, sizeof(l2), "time %9.1fms", all_ns / 1e6);
+    } else if (p == 1) {
+        unsigned long sales = atomic_load(&io_acct.sales);
+        snprintf(l1, sizeof(l1), "Per sale (%lu)", sales);
+        if (sales)
+            snprintf(l2, sizeof(l2), "%.0f op %.1fms", (double)atomic_load(&io_acct.sale_ops) / sales,
+                     atomic_load(&io_acct.sale_ns) / 1e6 / sales);
+        else
+            snprintf(l2, sizeof(l2), "no sales yet");
+    } else if (p < 2 + IOC_OTHER) {
+        io_totals(-1, p - 2, &n, &ns);
+        snprintf(l1, sizeof(l1), "%-6s %9lu", io_class_names[p - 2], n);
+        snprintf(l2, sizeof(l2), "%7.1fms %5.1f%%", ns / 1e6, all ? 100.0 * n / all : 0.0);
+    } else {
+        int o = p - 2 - IOC_OTHER;
+        unsigned long calls = atomic_load(&io_acct.calls[o]);
+        io_totals(o, -1, &n, &ns);
+        snprintf(l1, sizeof(l1), "%-16.16s", io_op_names[o]);
+        snprintf(l2, sizeof(l2), "%6lu op %4.0f/c", n, calls ? (double)n / calls : 0.0);
+    }
+    show_image(IMG_SERVICE_MANUAL);
+    lcd_print2(l1, l2);
+}
+
+static void ui_io_stats_entry(Ui *u)
+{
+    u->io_page = 0;
+    io_stats_screen(u);
+}
+
+static void ui_dispensing_entry(Ui *u)
+{
+    (void)u;
+    anim_stop(M->disp_anim);
+    M->disp_anim->oneshot_done = 0;
+    ui_post(EV_RUN);
+}
+
+/* ----- Transition actions ----- */
+static int ui_key_reject(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    beep_error();
+    return ST_STAY;
+}
+
+static int ui_to_menu(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    return ST_MENU;
+}
+
+static int ui_idle_timeout(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    beep_error();
+    return ST_MENU;
+}
+
+static int ui_menu_digit(Ui *u, int key)
+{
+    buf_push(u->selbuf, &u->sellen, 4, key);
+    menu_index_screen(u);
+
+    if (!u->index_timer_active && u->sellen > 0) {
+        u->index_timer_active = 1;
+        timer_start_or_reset();
+        timer_update_display(now_ms());
+    }
+    prefetch_for_prefix(u->items, u->nitems, u->selbuf);
+    return ST_STAY;
+}
+
+static int ui_menu_back(Ui *u, int key)
+{
+    (void)key;
+    if (u->sellen > 0) { u->sellen--; u->selbuf[u->sellen] = '\0'; }
+    menu_index_screen(u);
+    if (u->sellen == 0) { u->index_timer_active = 0; timer_stop_and_blank(); }
+    prefetch_for_prefix(u->items, u->nitems, u->selbuf);
+    return ST_STAY;
+}
+
+static int ui_menu_enter(Ui *u, int key)
+{
+    (void)key;
+    if (u->sellen == 0) {
+        ui_error("No index", "Type digits", OVERLAY_ERR_SHORT_MS);
+        return ST_MENU;
+    }
+
+    /* enter service: 1234 + B */
+    if (strcmp(u->selbuf, "1234") == 0) return ST_SVC_GATE;
+
+    u->chosen_slot = find_slot_by_index(&u->slots, atoi(u->selbuf));
+    if (u->chosen_slot < 0) {
+        ui_error("Invalid index", "Try 3/8/11/22", OVERLAY_ERR_LONG_MS);
+        return ST_MENU;
+    }
+
+    const Item *it = &u->items[u->chosen_slot];
+    if (it->stock <= 0) {
+        overlay_show(it->img_oos, it->name, "OUT OF STOCK", OVERLAY_OOS_MS, NULL, NULL);
+        return ST_MENU;
+    }
+    return ST_AMOUNT;
+}
+
+static int ui_amount_digit(Ui *u, int key)
+{
+    buf_push(u->amtbuf, &u->amtlen, 3, key);
+    amount_screen(u);
+    return ST_STAY;
+}
+
+static int ui_amount_enter(Ui *u, int key)
+{
+    (void)key;
+    if (u->amtlen == 0) {
+        ui_error("No amount", "Type digits", OVERLAY_ERR_SHORT_MS);
+        amount_screen(u);
+        return ST_STAY;
+    }
+
+    u->amount = atoi(u->amtbuf);
+    if (u->amount < 1 || u->amount > MAX_COUNT) {
+        ui_error("Amount must", "be 1-15", OVERLAY_ERR_SHORT_MS);
+    } else if (u->amount > u->items[u->chosen_slot].stock) {
+        ui_error("Insufficient", "stock", OVERLAY_ERR_SHORT_MS);
+    } else {
+        return ST_PAY;
+    }
+    buf_clear(u->amtbuf, &u->amtlen);
+    amount_screen(u);
+    return ST_STAY;
+}
+
+static int ui_pay_digit(Ui *u, int key)
+{
+    if (key == '0') u->pay_zero_count++; else u->pay_zero_count = 0;
+
+    if (u->pay_zero_count >= 2) {
+        beep_payment_ok();
+        lcd_print2("Payment OK", "Dispensing...");
+        return ST_DISPENSING;
+    }
+    lcd_print2("Pay: enter 00", "Press 0 twice");
+    return ST_STAY;
+}
+
+static int ui_dispense_run(Ui *u, int key)
+{
+    (void)key;
+
+    /* the sale is on record before the motor turns */
+    Item *it = &u->items[u->chosen_slot];
+    it->stock -= u->amount;
+    if (it->stock < 0) it->stock = 0;
+    inv_log(INV_SALE, it->index, u->amount);
+
+    run_dispense_with_anim(u->amount);
+
+    beep_success();
+    overlay_show(IMG_THANKS, "Done!", "Thank you", OVERLAY_SUCCESS_MS, NULL, NULL);
+    io_sale_end();
+    return ST_MENU;
+}
+
+/* Gate confirms (any key) */
+static int ui_svc_gate_confirm(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    return ST_DOOR_OPENING;
+}
+
+static int ui_svc_gate_timeout(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    beep_error();
+    return ST_MENU;
+}
+
+static int ui_return_gate_confirm(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    return ST_DOOR_CLOSING;
+}
+
+static int ui_return_gate_timeout(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    beep_error();
+    return ST_SVC_MENU;
+}
+
+static int ui_door_opened(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    return ST_SVC_MENU;
+}
+
+static int ui_door_closed(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    return ST_MENU;
+}
+
+/* service: A always returns to service menu */
+static int ui_svc_back(Ui *u, int key)
+{
+    (void)u;
+    (void)key;
+    return ST_SVC_MENU;
+}
+
+static int ui_svc_menu_digit(Ui *u, int key)
+{
+    buf_push(u->selbuf, &u->sellen, 4, key);
+    service_menu_screen(u->selbuf);
+    return ST_STAY;
+}
+
+static int ui_svc_menu_enter(Ui *u, int key)
+{
+    static const int options[5] = {
+        ST_SVC_DISPENSE_IDX, ST_SVC_RESTOCK_IDX, ST_SVC_SOUND_SEL, ST_SVC_MOTOR_CYC, ST_SVC_IO_STATS
+    };
+    (void)key;
+
+    if (strcmp(u->selbuf, "1234") == 0) return ST_RETURN_GATE;
+    if (u->sellen == 1 && u->selbuf[0] >= '1' && u->selbuf[0] <= '5') return options[u->selbuf[0] - '1'];
+
+    ui_error("Invalid choice", "Use 1-5 or 1234", OVERLAY_ERR_SHORT_MS);
+    return ST_SVC_MENU;
+}
+
+static int ui_svc_digit(Ui *u, int key)
+{
+    char l1[17];
+    buf_push(u->svcbuf, &u->svclen, 4, key);
+
+    switch (u->st) {
+        case ST_SVC_DISPENSE_IDX:
+            show_image(IMG_MENU_SERVICE);
+            snprintf(l1, sizeof(l1), "Disp idx:%-4.4s", u->svcbuf);
+            lcd_print2(l1, "B=OK  A=Back");
+            prefetch_for_prefix(u->items, u->nitems, u->svcbuf);
+            break;
+        case ST_SVC_DISPENSE_AMT:
+            show_image(IMG_MENU_SERVICE);
+            snprintf(l1, sizeof(l1), "Amt:%-4.4s", u->svcbuf);
+            lcd_print2(l1, "B=Run A=Back");
+            break;
+        case ST_SVC_RESTOCK_IDX:
+            show_image(IMG_RESTOCK);
+            snprintf(l1, sizeof(l1), "Restock idx:%-4.4s", u->svcbuf);
+            lcd_print2(l1, "B=OK  A=Back");
+            prefetch_for_prefix(u->items, u->nitems, u->svcbuf);
+            break;
+        case ST_SVC_RESTOCK_QTY:
+            show_image(IMG_RESTOCK);
+            snprintf(l1, sizeof(l1), "New stock:%-4.4s", u->svcbuf);
+            lcd_print2(l1, "B=OK  A=Back");
+            break;
+        case ST_SVC_SOUND_SEL:
+            show_image(IMG_SOUND);
+            snprintf(l1, sizeof(l1), "Sound 1-8:%-2.2s", u->svcbuf);
+            lcd_print2(l1, "B=Play A=Back");
+            break;
+        case ST_SVC_MOTOR_CYC:
+            show_image(IMG_MOTOR);
+            snprintf(l1, sizeof(l1), "Motor cyc:%-2.2s", u->svcbuf);
+            lcd_print2(l1, "B=Run A=Back");
+            break;
+    }
+    return ST_STAY;
+}
+
+/* Parse the service input as 1..max; on error beeps and returns -1
+ * (empty input keeps the screen, out of range asks for a re-entry). */
+static int svc_number(Ui *u, int max, const char *empty1, const char *empty2,
+                      const char *range1, const char *range2, int *reenter)
+{
+    *reenter = 0;
+    if (u->svclen == 0) {
+        ui_error(empty1, empty2, OVERLAY_ERR_SHORT_MS);
+        return -1;
+    }
+    int v = atoi(u->svcbuf);
+    if (v < 1 || v > max) {
+        ui_error(range1, range2, OVERLAY_ERR_SHORT_MS);
+        *reenter = 1;
+        return -1;
+    }
+    return v;
+}
+
+static int ui_svc_disp_idx_enter(Ui *u, int key)
+{
+    (void)key;
+    if (u->svclen == 0) {
+        ui_error("No index", "Type digits", OVERLAY_ERR_SHORT_MS);
+        return ST_STAY;
+    }
+    u->svc_disp_slot = find_slot_by_index(&u->slots, atoi(u->svcbuf));
+    if (u->svc_disp_slot < 0) {
+        ui_error("Bad idx", "Try 3/8/11/22", OVERLAY_ERR_SHORT_MS);
+        return ST_SVC_DISPENSE_IDX;
+    }
+    return ST_SVC_DISPENSE_AMT;
+}
+
+static int ui_svc_disp_amt_enter(Ui *u, int key)
 {
-    static int phase = 0;
+    int reenter;
+    (void)key;
+    int a = svc_number(u, MAX_COUNT, "No amount", "Type digits", "Amount 1-15", "Try again", &reenter);
+    if (a < 0) return reenter ? ST_SVC_DISPENSE_AMT : ST_STAY;
 
-    for (int s = 0; s < MOTOR_STEPS_PER_CYCLE; s++) {
-        for (int i = 0; i < 4; i++) {
-            motor_write_phase(phase);
-            phase = (phase + 1) & 3;
-            usleep(MOTOR_PHASE_DELAY_US);
-        }
+    lcd_print2("Service Disp", "Dispensing...");
+    run_dispense_with_anim(a);
+
+    beep_success();
+    overlay_show(NULL, "Service Done", "A=Back", OVERLAY_SVC_DONE_MS, NULL, NULL);
+    return ST_SVC_MENU;
+}
+
+static int ui_restock_idx_enter(Ui *u, int key)
+{
+    (void)key;
+    if (u->svclen == 0) {
+        ui_error("No index", "Type digits", OVERLAY_ERR_SHORT_MS);
+        return ST_STAY;
     }
-    CM3_outport(gSmPort, 0x00);
+    u->restock_slot = find_slot_by_index(&u->slots, atoi(u->svcbuf));
+    if (u->restock_slot < 0) {
+        ui_error("Bad idx", "Try 3/8/11/22", OVERLAY_ERR_SHORT_MS);
+        return ST_SVC_RESTOCK_IDX;
+    }
+    return ST_SVC_RESTOCK_QTY;
 }
 
-static void run_motor_test_cycles(int cycles)
+static int ui_restock_qty_enter(Ui *u, int key)
 {
-    if (cycles < 1) cycles = 1;
-    if (cycles > 15) cycles = 15;
+    int reenter;
+    (void)key;
+    int newstock = svc_number(u, 15, "No stock", "Type 1-15", "Stock must", "be 1-15", &reenter);
+    if (newstock < 0) return reenter ? ST_SVC_RESTOCK_QTY : ST_STAY;
+
+    u->items[u->restock_slot].stock = newstock;
+    inv_log(INV_SET, u->items[u->restock_slot].index, newstock);
+
+    beep_success();
+    char l2[17];
+    snprintf(l2, sizeof(l2), "Stock=%d", newstock);
+    overlay_show(NULL, "Restocked", l2, OVERLAY_SVC_DONE_MS, NULL, NULL);
+    return ST_SVC_MENU;
+}
 
-    for (int c = 0; c < cycles; c++) {
-        motor_spin_one_cycle();
-        usleep(500000); /* 0.5s delay */
-    }
+static void sound_play(void *ctx)
+{
+    int s = (int)(intptr_t)ctx;
+
+    /* Correct mapping per your image */
+    if (s == 1) beep_keypress();
+    else if (s == 2) beep_error();
+    else if (s == 3) beep_success();
+    else if (s == 4) beep_payment_ok();
+    else if (s == 5) beep_dispensing_slot(1);
+    else if (s == 6) beep_dispensing_slot(2);
+    else if (s == 7) beep_dispensing_slot(3);
+    else if (s == 8) beep_dispensing_slot(4);
 }
 
-/* ===== MAIN ===== */
-int main(void)
+/* sound selection confirm (stay in sound select, play when the wait ends) */
+static int ui_sound_enter(Ui *u, int key)
 {
-    atexit(cleanup);
-    signal(SIGINT, on_sig);
-    signal(SIGTERM, on_sig);
+    int reenter;
+    (void)key;
+    int s = svc_number(u, 8, "Pick 1-8", "Type digit", "Sound must", "be 1-8", &reenter);
+    if (s < 0) return reenter ? ST_SVC_SOUND_SEL : ST_STAY;
 
-    CM3DeviceInit();
-    CM3DeviceSpiInit(0);
+    overlay_show(NULL, "Playing...", "Please wait", OVERLAY_SOUND_WAIT_MS, sound_play, (void *)(intptr_t)s);
+    return ST_SVC_SOUND_SEL;
+}
 
-    CM3PortInit(4);
-    CM3PortInit(1);
-    CM3PortInit(0);
-    CM3PortInit(3);
-    CM3PortInit(5);
+/* I/O screen: a digit jumps to that page, B steps through them all */
+static int ui_io_stats_page(Ui *u, int key)
+{
+    if (key - '0' < IO_PAGES) u->io_page = key - '0';
+    io_stats_screen(u);
+    return ST_STAY;
+}
 
-    Item items[] = {
-        {  3, "Cheetos", 1.50f, IMG_ZOOM_1, IMG_ZOOM_1_OOS, 1 },
-        {  8, "Lays",    1.50f, IMG_ZOOM_2, IMG_ZOOM_2_OOS, 2 },
-        { 11, "Doritos", 1.50f, IMG_ZOOM_3, IMG_ZOOM_3_OOS, 3 },
-        { 22, "Pocky",   1.75f, IMG_ZOOM_4, IMG_ZOOM_4_OOS, 4 },
-    };
-    const int N = (int)(sizeof(items) / sizeof(items[0]));
+static int ui_io_stats_next(Ui *u, int key)
+{
+    (void)key;
+    u->io_page = (u->io_page + 1) % IO_PAGES;
+    io_stats_screen(u);
+    return ST_STAY;
+}
 
-    enum {
-        ST_MENU = 0,
-        ST_AMOUNT,
-        ST_PAY,
+/* motor cycles confirm (stay in motor screen) */
+static int ui_motor_enter(Ui *u, int key)
+{
+    int reenter;
+    (void)key;
+    int cycles = svc_number(u, 15, "No cycles", "Type 1-15", "Cycles must", "be 1-15", &reenter);
+    if (cycles < 0) return reenter ? ST_SVC_MOTOR_CYC : ST_STAY;
+
+    lcd_print2("Motor test", "Running...");
+    run_motor_test_cycles(cycles);
+    beep_success();
+    return ST_SVC_MOTOR_CYC;
+}
 
-        ST_SVC_GATE,
-        ST_RETURN_GATE,
+/* ----- Tables and dispatch ----- */
+typedef struct {
+    UiHook entry;
+    UiHook exit;
+    const char *name;
+} UiState;
 
-        ST_DOOR_OPENING,
-        ST_DOOR_CLOSING,
+typedef struct {
+    UiAction act;          /* NULL = no transition */
+    unsigned targets;      /* STB() set the action may return */
+} UiTransition;
+
+static const UiState ui_states[ST_COUNT] = {
+#define UI_STATE_ROW(s, entry, exit, expected) [s] = { ui_##entry, ui_##exit, #s },
+    UI_STATES(UI_STATE_ROW)
+#undef UI_STATE_ROW
+};
 
-        ST_SVC_MENU,
+static const UiTransition ui_table[ST_COUNT][EV_COUNT] = {
+#define UI_TRANSITION_ROW(s, e, act, targets) [s][e] = { ui_##act, (targets) },
+    UI_TRANSITIONS(UI_TRANSITION_ROW)
+#undef UI_TRANSITION_ROW
+};
 
-        /* Service substates */
-        ST_SVC_DISPENSE_IDX,
-        ST_SVC_DISPENSE_AMT,
-        ST_SVC_RESTOCK_IDX,
-        ST_SVC_RESTOCK_QTY,
-        ST_SVC_SOUND_SEL,
-        ST_SVC_MOTOR_CYC,
+static void ui_enter(Ui *u, int to)
+{
+    ui_states[u->st].exit(u);
+    u->st = to;
+    atomic_store(&wd_hb.state, to);
+    ui_stats.transitions++;
+    ui_states[to].entry(u);
+}
 
-        ST_DISPENSING
-    } st = ST_MENU;
+static void ui_dispatch(Ui *u, int ev, int key)
+{
+    WD_MARK();
+    const UiTransition *tr = &ui_table[u->st][ev];
+    ui_stats.events++;
 
-    /* normal buffers */
-    char selbuf[8] = {0};
-    int sellen = 0;
+    if (!tr->act) {
+        ui_stats.unhandled++;
+        if (EVB(ev) & EV_KEYS) beep_error();
+        return;
+    }
 
-    char amtbuf[8] = {0};
-    int amtlen = 0;
+    int to = tr->act(u, key);
+    if (to == ST_STAY) return;
+    if (to < 0 || to >= ST_COUNT || !(tr->targets & STB(to))) {
+        fprintf(stderr, "ui: %s cannot go to state %d\n", ui_states[u->st].name, to);
+        ui_stats.rejected++;
+        return;
+    }
+    ui_enter(u, to);
+}
 
-    /* service input buffer */
-    char svcbuf[8] = {0};
-    int svclen = 0;
+static void ui_key(Ui *u, unsigned char k)
+{
+    if (isdigit((int)k)) ui_dispatch(u, EV_DIGIT, k);
+    else if (k == KEY_BACK) ui_dispatch(u, EV_BACK, k);
+    else if (k == KEY_ENTER) ui_dispatch(u, EV_ENTER, k);
+    else beep_error();
+}
 
-    int chosen_slot = -1;
-    int amount = 0;
-    float total = 0.0f;
+/* Feed posted events (timers, entry actions) to the machine. */
+static void ui_run_posted(Ui *u)
+{
+    int ev;
+    while ((ev = ui_take()) >= 0) ui_dispatch(u, ev, 0);
+}
 
-    int pay_zero_count = 0;
-    int index_timer_active = 0;
-    int service_mode = 0;
+static void ui_start(Ui *u, Item *items, int n)
+{
+    SlotIndex slots = u->slots;
+    PriceRow *prices = u->prices;
+    memset(u, 0, sizeof(*u));
+    u->items = items;
+    u->nitems = n;
+    u->slots = slots;
+    u->prices = prices;
+    u->chosen_slot = -1;
+    u->svc_disp_slot = -1;
+    u->restock_slot = -1;
+    u->st = ST_MENU;
+    ui_states[ST_MENU].entry(u);
+}
 
-    long long svc_gate_deadline = 0;
-    long long return_gate_deadline = 0;
+/* ===== Persistent inventory (SNACK_INV) =====
+ * SNACK_INV=<dir> keeps the stock of every machine across restarts.
+ * Each change is appended to <dir>/inventory.wal before it takes effect
+ * (a sale before its motor turns) and <dir>/inventory.snap holds the
+ * compacted stock. Startup loads the snapshot, replays the log up to
+ * the first torn or corrupt record, and writes a fresh snapshot. A
+ * damaged snapshot (and its log) is renamed to *.bad first, or, if that
+ * fails, inventory stays off and both files are left alone.
+ *
+ * A record is one write(2), so a crashed process loses nothing. The
+ * fdatasync is batched: SNACK_INV_SYNC=<n> (default 1) syncs every n
+ * records, so a power cut loses at most n-1 sales; restocks, sleep and
+ * exit always sync. After SNACK_INV_COMPACT records (default 1024) the
+ * snapshot is rewritten (tmp, fsync, rename) under the next generation
+ * and the log restarts with it; a log of an older generation is
+ * already in the snapshot and is ignored.
+ *
+ * Log:      "SNKW" u16 version, u16 0, u64 generation, then 20-byte
+ *           records: u8 kind, u8 0, u16 0, u32 machine, i32 index,
+ *           i32 value, u32 CRC-32 of the first 16 bytes
+ * Snapshot: "SNKS" u16 version, u16 0, u64 generation, u32 count, then
+ *           count x (u32 machine, i32 index, i32 stock), u32 CRC-32 of
+ *           everything before it
+ * Version 1 kept the machine in 16 bits, too few for SIM_MAX_MACHINES.
+ * All little-endian. */
+#define INV_VERSION     2
+#define INV_HDR_SIZE    16
+#define INV_REC_SIZE    20
+#define INV_SNAP_HDR    20
+#define INV_SNAP_ENTRY  12
+#define INV_PATH_MAX    256
+
+static struct {
+    int on;
+    int fd;                        /* the log, O_APPEND */
+    char wal[INV_PATH_MAX];
+    char snap[INV_PATH_MAX];
+    char dir[INV_PATH_MAX];
+    unsigned long long gen;
+    int sync_every;
+    int compact_at;
+    int unsynced;                  /* records since the last fdatasync */
+    int logged;                    /* records since the last snapshot */
+
+    long long recover_ns;
+    unsigned long snap_entries, replayed, skipped;
+    long torn_bytes;
+    unsigned long records, syncs, compactions, errors;
+    unsigned long sales;
+    long long sale_ns_sum, sale_ns_max;
+    long long sync_ns_max, compact_ns_max;
+} inv = { .fd = -1 };
+
+static void inv_put32(unsigned char *p, unsigned v)
+{
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
 
-    int svc_disp_slot = -1;
-    int restock_slot = -1;
+static unsigned inv_get32(const unsigned char *p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
 
-    show_image(IMG_MENU);
-    lcd_print2("Enter Index:", "B to enter");
-    timer_stop_and_blank();
+static void inv_put_hdr(unsigned char *p, const char *magic, unsigned long long gen)
+{
+    memcpy(p, magic, 4);
+    p[4] = INV_VERSION;
+    p[5] = p[6] = p[7] = 0;
+    inv_put32(p + 8, (unsigned)gen);
+    inv_put32(p + 12, (unsigned)(gen >> 32));
+}
 
-    while (1) {
-        long long t = now_ms();
+/* Returns the generation, or -1 if the header is not ours. */
+static long long inv_get_hdr(const unsigned char *p, const char *magic)
+{
+    if (memcmp(p, magic, 4) != 0 || p[4] != INV_VERSION || p[5]) return -1;
+    return (long long)(inv_get32(p + 8) | ((unsigned long long)inv_get32(p + 12) << 32));
+}
 
-        /* tick animations globally */
-        anim_tick(&gDoorAnim);
-        anim_tick(&gDispAnim);
+static unsigned inv_crc32(const unsigned char *p, size_t n)
+{
+    unsigned c = 0xFFFFFFFFu;
+    while (n--) {
+        c ^= *p++;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+    }
+    return ~c;
+}
 
-        /* door transitions */
-        if (st == ST_DOOR_OPENING && gDoorAnim.oneshot_done) {
-            st = ST_SVC_MENU;
-            sellen = 0; selbuf[0] = '\0';
-            service_menu_screen(selbuf);
-        }
-        if (st == ST_DOOR_CLOSING && gDoorAnim.oneshot_done) {
-            service_mode = 0;
-            set_port_mapping(0);
-            st = ST_MENU;
-
-            sellen = 0; selbuf[0] = '\0';
-            amtlen = 0; amtbuf[0] = '\0';
-            chosen_slot = -1;
-            index_timer_active = 0;
-
-            show_image(IMG_MENU);
-            lcd_print2("Enter Index:", "B to enter");
-            timer_stop_and_blank();
-        }
+static int inv_write_all(int fd, const unsigned char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
 
-        /* Gate timeouts */
-        if (st == ST_SVC_GATE && svc_gate_deadline > 0 && t >= svc_gate_deadline) {
-            beep_error();
-            svc_gate_deadline = 0;
-            set_port_mapping(0);
-            service_mode = 0;
-            st = ST_MENU;
-            show_image(IMG_MENU);
-            lcd_print2("Enter Index:", "B to enter");
-            continue;
+static Item *inv_item(int machine, int index)
+{
+    if (machine < 0 || machine >= bank_n) return NULL;
+    Ui *u = bank[machine]->ui;
+    int slot = slot_index_find(&u->slots, index);
+    return slot < 0 ? NULL : &u->items[slot];
+}
+
+static void inv_apply(int kind, int machine, int index, int value)
+{
+    Item *it = inv_item(machine, index);
+    if (!it || (kind != INV_SALE && kind != INV_SET)) { inv.skipped++; return; }
+    if (kind == INV_SET) it->stock = value;
+    else it->stock = it->stock > value ? it->stock - value : 0;
+}
+
+static void inv_sync(void)
+{
+    if (!inv.on || inv.unsynced == 0) return;
+    long long t0 = mono_ns();
+    if (fdatasync(inv.fd) < 0) inv.errors++;
+    long long d = mono_ns() - t0;
+    if (d > inv.sync_ns_max) inv.sync_ns_max = d;
+    inv.syncs++;
+    inv.unsynced = 0;
+}
+
+/* Write every machine's stock as generation gen + 1, then restart the
+ * log under it. Returns -1 (old snapshot and log kept) on failure. */
+static int inv_snapshot(void)
+{
+    long long t0 = mono_ns();
+    int n = 0;
+    for (int i = 0; i < bank_n; i++) n += bank[i]->ui->nitems;
+
+    size_t len = INV_SNAP_HDR + (size_t)n * INV_SNAP_ENTRY + 4;
+    unsigned char *buf = calloc(1, len), *p = buf + INV_SNAP_HDR;
+    if (!buf) return -1;
+    inv_put_hdr(buf, "SNKS", inv.gen + 1);
+    inv_put32(buf + 16, (unsigned)n);
+    for (int i = 0; i < bank_n; i++) {
+        const Ui *u = bank[i]->ui;
+        for (int k = 0; k < u->nitems; k++, p += INV_SNAP_ENTRY) {
+            inv_put32(p, (unsigned)i);
+            inv_put32(p + 4, (unsigned)u->items[k].index);
+            inv_put32(p + 8, (unsigned)u->items[k].stock);
         }
-        if (st == ST_RETURN_GATE && return_gate_deadline > 0 && t >= return_gate_deadline) {
-            beep_error();
-            return_gate_deadline = 0;
-            service_mode = 1;
-            set_port_mapping(1);
-            st = ST_SVC_MENU;
-            service_menu_screen(selbuf);
-            continue;
+    }
+    inv_put32(p, inv_crc32(buf, len - 4));
+
+    char tmp[INV_PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", inv.snap);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && inv_write_all(fd, buf, len) == 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    free(buf);
+    if (!ok || rename(tmp, inv.snap) < 0) {
+        unlink(tmp);
+        inv.errors++;
+        return -1;
+    }
+    int dfd = open(inv.dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+    inv.gen++;
+
+    /* the new snapshot holds everything logged so far */
+    unsigned char h[INV_HDR_SIZE];
+    inv_put_hdr(h, "SNKW", inv.gen);
+    if (inv.fd >= 0) close(inv.fd);
+    inv.fd = open(inv.wal, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (inv.fd < 0 || inv_write_all(inv.fd, h, sizeof(h)) < 0 || fdatasync(inv.fd) < 0) inv.errors++;
+    inv.unsynced = 0;
+    inv.logged = 0;
+    inv.compactions++;
+
+    long long d = mono_ns() - t0;
+    if (d > inv.compact_ns_max) inv.compact_ns_max = d;
+    return 0;
+}
+
+static void inv_log(int kind, int index, int value)
+{
+    if (!inv.on) return;
+    long long t0 = mono_ns();
+
+    unsigned char r[INV_REC_SIZE] = { (unsigned char)kind };
+    inv_put32(r + 4, (unsigned)M->id);
+    inv_put32(r + 8, (unsigned)index);
+    inv_put32(r + 12, (unsigned)value);
+    inv_put32(r + 16, inv_crc32(r, 16));
+    if (inv.fd < 0 || inv_write_all(inv.fd, r, sizeof(r)) < 0) inv.errors++;
+    inv.records++;
+    inv.unsynced++;
+    inv.logged++;
+    if (kind != INV_SALE || inv.unsynced >= inv.sync_every) inv_sync();
+
+    if (kind == INV_SALE) {
+        long long d = mono_ns() - t0;
+        inv.sales++;
+        inv.sale_ns_sum += d;
+        if (d > inv.sale_ns_max) inv.sale_ns_max = d;
+    }
+    /* a failed compaction waits another compact_at records before retrying,
+     * so a full disk does not cost every sale a snapshot attempt */
+    if (inv.logged >= inv.compact_at && inv_snapshot() < 0) inv.logged = 0;
+}
+
+static int inv_load_snapshot(void)
+{
+    FILE *fp = fopen(inv.snap, "rb");
+    if (!fp) return 0;                 /* first run */
+
+    unsigned char *buf = NULL;
+    long len = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) len = ftell(fp);
+    rewind(fp);
+    if (len >= INV_SNAP_HDR + 4) buf = malloc((size_t)len);
+    int ok = buf && fread(buf, 1, (size_t)len, fp) == (size_t)len;
+    fclose(fp);
+
+    long long gen = ok ? inv_get_hdr(buf, "SNKS") : -1;
+    unsigned n = gen >= 0 ? inv_get32(buf + 16) : 0;
+    if (gen < 0 || (long)(INV_SNAP_HDR + (size_t)n * INV_SNAP_ENTRY + 4) != len ||
+        inv_crc32(buf, (size_t)len - 4) != inv_get32(buf + len - 4)) {
+        fprintf(stderr, "inventory: %s is damaged\n", inv.snap);
+        free(buf);
+        return -1;
+    }
+
+    inv.gen = (unsigned long long)gen;
+    const unsigned char *p = buf + INV_SNAP_HDR;
+    for (unsigned i = 0; i < n; i++, p += INV_SNAP_ENTRY)
+        inv_apply(INV_SET, (int)inv_get32(p), (int)inv_get32(p + 4), (int)inv_get32(p + 8));
+    inv.snap_entries = n;
+    free(buf);
+    return 0;
+}
+
+static void inv_replay_log(void)
+{
+    FILE *fp = fopen(inv.wal, "rb");
+    if (!fp) return;
+
+    unsigned char h[INV_HDR_SIZE], r[INV_REC_SIZE];
+    long good = 0, size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+    rewind(fp);
+    if (fread(h, 1, sizeof(h), fp) == sizeof(h) && inv_get_hdr(h, "SNKW") == (long long)inv.gen) {
+        good = INV_HDR_SIZE;
+        while (fread(r, 1, sizeof(r), fp) == sizeof(r) && inv_crc32(r, 16) == inv_get32(r + 16)) {
+            inv_apply(r[0], (int)inv_get32(r + 4), (int)inv_get32(r + 8), (int)inv_get32(r + 12));
+            inv.replayed++;
+            good += INV_REC_SIZE;
         }
+        inv.torn_bytes = size - good;
+    }
+    fclose(fp);
+}
 
-        /* 7-seg behavior */
-        if (service_mode) service_blink_tick(t);
-        else {
-            int timer_active = (st == ST_AMOUNT) || (st == ST_PAY) || (st == ST_MENU && index_timer_active);
-            if (timer_active) {
-                timer_update_display(t);
-                if (timer_seconds_left(t) == 0) {
-                    beep_error();
-                    st = ST_MENU;
-                    sellen = 0; selbuf[0] = '\0';
-                    amtlen = 0; amtbuf[0] = '\0';
-                    chosen_slot = -1;
-                    index_timer_active = 0;
-                    timer_stop_and_blank();
-                    show_image(IMG_MENU);
-                    lcd_print2("Enter Index:", "B to enter");
-                    continue;
-                }
-            }
+/* Move a damaged generation to <file>.bad so the fresh one written next
+ * cannot destroy what might still recover it by hand. */
+static int inv_set_aside(void)
+{
+    const char *files[2] = { inv.snap, inv.wal };
+    for (int i = 0; i < 2; i++) {
+        char bad[INV_PATH_MAX + 4];
+        snprintf(bad, sizeof(bad), "%s.bad", files[i]);
+        if (rename(files[i], bad) < 0 && errno != ENOENT) {
+            fprintf(stderr, "inventory: cannot move %s aside: %s\n", files[i], strerror(errno));
+            return -1;
         }
+    }
+    fprintf(stderr, "inventory: damaged files kept as *.bad, starting from the catalogue\n");
+    return 0;
+}
 
-        /* Dispensing state */
-        if (st == ST_DISPENSING) {
-            if (!gDispAnim.active && !gDispAnim.oneshot_done) {
-                anim_start(&gDispAnim, disp_frames, DISP_N, +1, DISP_FRAME_MS);
-            }
+/* Recover the stock of every machine; inventory stays off on failure. */
+static int inv_open(void)
+{
+    const char *dir = getenv("SNACK_INV");
+    const char *sync_every = getenv("SNACK_INV_SYNC");
+    const char *compact_at = getenv("SNACK_INV_COMPACT");
+    if (!dir || !*dir) return 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "inventory: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    snprintf(inv.dir, sizeof(inv.dir), "%s", dir);
+    snprintf(inv.wal, sizeof(inv.wal), "%s/inventory.wal", dir);
+    snprintf(inv.snap, sizeof(inv.snap), "%s/inventory.snap", dir);
+    inv.sync_every = sync_every && atoi(sync_every) > 0 ? atoi(sync_every) : 1;
+    inv.compact_at = compact_at && atoi(compact_at) > 0 ? atoi(compact_at) : 1024;
+
+    long long t0 = mono_ns();
+    if (inv_load_snapshot() == 0) inv_replay_log();
+    else if (inv_set_aside() < 0) return -1;
+    inv.recover_ns = mono_ns() - t0;
+
+    if (inv_snapshot() < 0) {
+        fprintf(stderr, "inventory: cannot write %s, stock is not persisted\n", inv.snap);
+        return -1;
+    }
+    inv.on = 1;
+    fprintf(stderr, "inventory: %lu snapshot entries + %lu log records (%ld torn bytes dropped) in %.2f ms\n",
+            inv.snap_entries, inv.replayed, inv.torn_bytes, inv.recover_ns / 1e6);
+    return 0;
+}
 
-            for (int i = 0; i < amount; i++) {
-                run_one_dispense_cycle_with_anim();
-                if (i != amount - 1) usleep(150000);
-            }
+static void inv_close(void)
+{
+    if (!inv.on) return;
+    inv_sync();
+    close(inv.fd);
+    inv.fd = -1;
+    inv.on = 0;
+}
 
-            while (!gDispAnim.oneshot_done) {
-                anim_tick(&gDispAnim);
-                usleep(20000);
-            }
+static void inv_stats_dump(FILE *fp)
+{
+    if (!inv.dir[0]) return;
+    fprintf(fp, "\n[inventory]\n");
+    fprintf(fp, "generation=%llu\nrecover_ms=%.3f\nsnapshot_entries=%lu\nreplayed=%lu\nskipped=%lu\ntorn_bytes=%ld\n",
+            inv.gen, inv.recover_ns / 1e6, inv.snap_entries, inv.replayed, inv.skipped, inv.torn_bytes);
+    fprintf(fp, "sync_every=%d\ncompact_at=%d\nrecords=%lu\nsyncs=%lu\ncompactions=%lu\nerrors=%lu\n",
+            inv.sync_every, inv.compact_at, inv.records, inv.syncs, inv.compactions, inv.errors);
+    fprintf(fp, "sale_write_avg_us=%.1f\nsale_write_max_us=%.1f\nsync_max_us=%.1f\ncompact_max_us=%.1f\n",
+            inv.sales ? inv.sale_ns_sum / 1000.0 / inv.sales : 0.0, inv.sale_ns_max / 1000.0,
+            inv.sync_ns_max / 1000.0, inv.compact_ns_max / 1000.0);
+}
 
-            show_image(IMG_THANKS);
-            lcd_print2("Done!", "Thank you");
-            beep_success();
-            usleep(USLEEP_SUCCESS_SCREEN_US);
+/* ===== Low-power idle (SNACK_SLEEP) =====
+ * SNACK_SLEEP=<ms> puts the machine to sleep once it has sat on an empty
+ * menu that long: the 7-seg and the motor coils are switched off, the
+ * LCD is switched off (text kept), the display is dimmed (frame backends) or shows
+ * IMG_SLEEP when it exists (pqiv), and nothing is left on the timer
+ * wheel. The keypad has no interrupt line, so the cheapest wake source
+ * is a slow probe: every SNACK_SLEEP_SCAN ms (default PM_SCAN_MS) all
+ * columns are driven low and one port read tells whether any key is
+ * down; only then is the matrix scanned. The waking key is consumed.
+ * Wake latency (key seen -> screen restored) and the process CPU share
+ * asleep and awake go to the [power] stats section. Off under SNACK_SIM. */
+#define PM_SCAN_MS 100
+#define PM_DIM     64              /* sleeping brightness, out of 256 */
+
+static struct {
+    int after_ms;                  /* 0 = off */
+    int scan_ms;
+    int asleep;
+    Timer timer;
+    long long key_ns;              /* first key seen while asleep, 0 = none */
+    long long enter_ns, enter_cpu_us;
+    long long t0_ns, t0_cpu_us;
+
+    unsigned long sleeps;
+    unsigned long wakes;
+    long long asleep_ns;
+    long long asleep_cpu_us;
+    long long lat_sum_ns;
+    long long lat_max_ns;
+} pm;
+
+static long long pm_cpu_us(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+    return (long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
 
-            items[chosen_slot].stock -= amount;
-            if (items[chosen_slot].stock < 0) items[chosen_slot].stock = 0;
+static void pm_note_key(void)
+{
+    if (pm.asleep && !pm.key_ns) pm.key_ns = rt_now_ns();
+}
 
-            st = ST_MENU;
-            chosen_slot = -1;
-            amount = 0;
-            total = 0.0f;
-            pay_zero_count = 0;
+static int pm_idle(void)
+{
+    const Ui *u = M->ui;
+    return u->st == ST_MENU && !u->sellen && !overlay_active() && !ui_has_posted() &&
+           !M->keyq_len && !M->door_anim->active && !M->disp_anim->active;
+}
 
-            sellen = 0; selbuf[0] = '\0';
-            amtlen = 0; amtbuf[0] = '\0';
-            index_timer_active = 0;
-            timer_stop_and_blank();
+static void pm_on_timer(Timer *tm, void *ctx);
 
-            gDispAnim.oneshot_done = 0;
-            show_image(IMG_MENU);
-            lcd_print2("Enter Index:", "B to enter");
-            continue;
-        }
+/* Restart the idle countdown (every key counts as activity). */
+static void pm_arm(void)
+{
+    if (pm.after_ms > 0 && !pm.asleep)
+        timer_arm(&pm.timer, now_ms() + pm.after_ms, pm_on_timer, NULL);
+}
 
-        unsigned char k = ScanKey();
-        if (k == 0xFF) { usleep(20000); continue; }
+static void pm_dim_screen(void)
+{
+    if (!gDisplay->wants_frames) {
+        if (file_exists(IMG_SLEEP)) display_image(IMG_SLEEP);
+        return;
+    }
 
-        beep_keypress();
-        wait_key_release();
+    const Frame *f = M->screen.img ? img_cache_get(M->screen.img) : NULL;
+    if (!f) return;
+    Frame *black = frame_alloc(f->width, f->height, f->format);
+    Frame *dim = frame_alloc(f->width, f->height, f->format);
+    if (black && dim) {
+        Rect r = { 0, 0, f->width, f->height };
+        frame_blend_rect(dim, black, f, &r, PM_DIM);
+        gDisplay->present(M->screen.img, dim, NULL, 0);
+    }
+    frame_free(black);
+    frame_free(dim);
+}
 
-        /* Gate confirms (any key) */
-        if (st == ST_SVC_GATE) {
-            svc_gate_deadline = 0;
-            service_mode = 1;
-            service_blink_reset();
-            st = ST_DOOR_OPENING;
+static void pm_enter(void)
+{
+    pm.asleep = 1;
+    pm.sleeps++;
+    pm.key_ns = 0;
+    pm.enter_ns = rt_now_ns();
+    pm.enter_cpu_us = pm_cpu_us();
 
-            gDoorAnim.oneshot_done = 0;
-            anim_start(&gDoorAnim, door_frames, DOOR_N, +1, DOOR_FRAME_MS);
-            continue;
-        }
-        if (st == ST_RETURN_GATE) {
-            return_gate_deadline = 0;
-            st = ST_DOOR_CLOSING;
+    inv_sync();
+    seg_blank();
+    if (!rt_active()) motor_release();   /* the RT loop already idles it */
+    lcd_power(0);
+    pm_dim_screen();
+    loop_set_scan(pm.scan_ms, 1);
+}
 
-            gDoorAnim.oneshot_done = 0;
-            anim_start(&gDoorAnim, door_frames, DOOR_N, -1, DOOR_FRAME_MS);
-            continue;
-        }
+static void pm_wake(void)
+{
+    loop_set_scan(KEY_SCAN_MS, 0);
+    lcd_power(1);
+    if (M->screen.img && (gDisplay->wants_frames || file_exists(IMG_SLEEP)))
+        display_image(M->screen.img);
+
+    long long t = rt_now_ns();
+    long long lat = pm.key_ns ? t - pm.key_ns : 0;
+    pm.lat_sum_ns += lat;
+    if (lat > pm.lat_max_ns) pm.lat_max_ns = lat;
+    pm.asleep_ns += t - pm.enter_ns;
+    pm.asleep_cpu_us += pm_cpu_us() - pm.enter_cpu_us;
+    pm.wakes++;
+    pm.asleep = 0;
+    pm_arm();
+}
 
-        /* BACK (A) */
-        if (k == KEY_BACK) {
-            if (!service_mode) {
-                if (st == ST_MENU) {
-                    if (sellen > 0) { sellen--; selbuf[sellen] = '\0'; }
-                    show_image(IMG_MENU);
-                    char l1[17];
-                    snprintf(l1, sizeof(l1), "Enter Index:%-4.4s", selbuf);
-                    lcd_print2(l1, "B to enter");
-                    if (sellen == 0) { index_timer_active = 0; timer_stop_and_blank(); }
-                } else {
-                    st = ST_MENU;
-                    chosen_slot = -1;
-                    amtlen = 0; amtbuf[0] = '\0';
-                    show_image(IMG_MENU);
-                    lcd_print2("Enter Index:", "B to enter");
-                    timer_stop_and_blank();
-                    index_timer_active = 0;
-                }
-            } else {
-                /* service: A always returns to service menu */
-                st = ST_SVC_MENU;
-                sellen = 0; selbuf[0] = '\0';
-                svclen = 0; svcbuf[0] = '\0';
-                svc_disp_slot = -1;
-                restock_slot = -1;
-                service_menu_screen(selbuf);
-            }
-            continue;
-        }
+static void pm_on_timer(Timer *tm, void *ctx)
+{
+    (void)tm;
+    (void)ctx;
+    if (pm_idle()) pm_enter();
+    else pm_arm();
+}
+
+static void pm_start(void)
+{
+    const char *ms = getenv("SNACK_SLEEP");
+    if (!ms || atoi(ms) <= 0 || gClock->simulated) return;
+
+    const char *scan = getenv("SNACK_SLEEP_SCAN");
+    pm.after_ms = atoi(ms);
+    pm.scan_ms = (scan && atoi(scan) > 0) ? atoi(scan) : PM_SCAN_MS;
+    pm.t0_ns = rt_now_ns();
+    pm.t0_cpu_us = pm_cpu_us();
+    pm_arm();
+}
+
+static void pm_stats_dump(FILE *fp)
+{
+    if (pm.after_ms <= 0) return;
+
+    long long now = rt_now_ns(), cpu = pm_cpu_us();
+    long long asleep_ns = pm.asleep_ns, asleep_cpu = pm.asleep_cpu_us;
+    if (pm.asleep) {
+        asleep_ns += now - pm.enter_ns;
+        asleep_cpu += cpu - pm.enter_cpu_us;
+    }
+    long long awake_ns = now - pm.t0_ns - asleep_ns;
+    long long awake_cpu = cpu - pm.t0_cpu_us - asleep_cpu;
+
+    fprintf(fp, "\n[power]\n");
+    fprintf(fp, "sleep_after_ms=%d\nscan_ms=%d\nasleep=%d\nsleeps=%lu\nwakes=%lu\n",
+            pm.after_ms, pm.scan_ms, pm.asleep, pm.sleeps, pm.wakes);
+    fprintf(fp, "asleep_s=%.1f\nasleep_cpu_pct=%.3f\nawake_cpu_pct=%.3f\n",
+            asleep_ns / 1e9,
+            asleep_ns > 0 ? 100.0 * asleep_cpu * 1000.0 / asleep_ns : 0.0,
+            awake_ns > 0 ? 100.0 * awake_cpu * 1000.0 / awake_ns : 0.0);
+    fprintf(fp, "wake_latency_avg_us=%.1f\nwake_latency_max_us=%.1f\nwake_detect_max_ms=%d\n",
+            pm.wakes ? pm.lat_sum_ns / 1000.0 / pm.wakes : 0.0, pm.lat_max_ns / 1000.0, pm.scan_ms);
+}
+
+/* ===== Machines ===== */
+static void machine_free(Machine *m)
+{
+    if (!m) return;
+    if (m->ui) {
+        free(m->ui->items);
+        slot_index_free(&m->ui->slots);
+        free(m->ui->prices);
+    }
+    free(m->ui);
+    free(m->door_anim);
+    free(m->disp_anim);
+    free(m);
+}
+
+/* A machine with its own copy of the catalogue, idle until machine_start(). */
+static Machine *machine_new(int id, const PortIo *io)
+{
+    Machine *m = calloc(1, sizeof(*m));
+    if (!m) return NULL;
+    m->ui = calloc(1, sizeof(Ui));
+    m->door_anim = calloc(1, sizeof(Anim));
+    m->disp_anim = calloc(1, sizeof(Anim));
+    Item *items = malloc(sizeof(default_items));
+    if (!m->ui || !m->door_anim || !m->disp_anim || !items) {
+        free(items);
+        machine_free(m);
+        return NULL;
+    }
+    memcpy(items, default_items, sizeof(default_items));
+    m->ui->items = items;
+    m->ui->nitems = N_DEFAULT_ITEMS;
+    m->ui->prices = price_table_build(items, N_DEFAULT_ITEMS);
+    if (!m->ui->prices ||
+        slot_index_build(&m->ui->slots, &items[0].index, N_DEFAULT_ITEMS, sizeof(Item)) < 0) {
+        machine_free(m);
+        return NULL;
+    }
+
+    m->id = id;
+    m->io = io;
+    m->sim_us = sim_epoch_us;
+    m->pm = pm_normal;
+    m->lcd_io_port = pm_normal->lcd;
+    m->last_shown = -1;
+    m->blink_on = 1;
+
+    m->door_anim->delta_path = IMG_DOOR_ANIM;
+    m->disp_anim->delta_path = IMG_DISP_ANIM;
+    anim_set_tween(m->door_anim, TWEEN_FPS);
+    anim_set_tween(m->disp_anim, TWEEN_FPS);
+    return m;
+}
+
+/* Create n machines (bank[0] becomes M). Returns -1 on allocation failure. */
+static int bank_create(int n, const PortIo *io)
+{
+    bank = calloc((size_t)n, sizeof(*bank));
+    if (!bank) return -1;
+    for (int i = 0; i < n; i++) {
+        bank[i] = machine_new(i, io);
+        if (!bank[i]) return -1;
+        bank_n++;
+    }
+    machine_use(bank[0]);
+    return 0;
+}
+
+static void machine_start(Machine *m)
+{
+    machine_use(m);
+    ui_start(m->ui, m->ui->items, m->ui->nitems);
+}
+
+/* Work for one machine after a wakeup: expired timers, posted events, one key. */
+static void machine_pass(Machine *m)
+{
+    machine_use(m);
+
+    /* expiry callbacks (animations, countdown, blink, gates, overlays) */
+    tw_run(now_ms());
+    ui_run_posted(m->ui);
+
+    int from_pad = 0;
+    unsigned char k = keyq_pop(&from_pad);
+    if (k == 0xFF) return;
+
+    /* a key while asleep only wakes the machine */
+    if (pm.asleep) {
+        if (from_pad) wait_key_release();
+        pm_wake();
+        return;
+    }
+    pm_arm();
+
+    beep_keypress();
+    if (from_pad) wait_key_release();
+
+    /* a key on a timed message only dismisses it */
+    if (overlay_active()) { overlay_dismiss(); return; }
+
+    ui_key(m->ui, k);
+    ui_run_posted(m->ui);
+}
+
+/* ===== Session simulator (SNACK_SIM) =====
+ * SNACK_SIM=<sessions> swaps in the simulated clock and drives the UI
+ * with scripted customers instead of the keypad: every delay, animation
+ * and timeout still runs through the same timers and state machine, it
+ * just takes no wall time. A seeded mix of purchases, bad indexes,
+ * walk-aways (idle timeout) and back-outs; an empty slot triggers a
+ * service restock first. SNACK_SIM_SEED picks the mix.
+ * SNACK_MACHINES=<n> simulates a bank of n machines in this process,
+ * each with its own simulated ports, sharing the session count; the
+ * bank loop jumps the clock to the earliest deadline of any machine. */
+#define SIM_KEY_MS   250    /* between keys of one entry */
+#define SIM_THINK_MS 1500   /* before a customer starts typing */
+#define SIM_DOOR_MS  (DOOR_N * DOOR_FRAME_MS + 500)
+
+#define SIM_MAX_MACHINES 100000
+
+static struct {
+    int machines;
+    long sessions;         /* target, over the whole bank */
+    long started;
+    long purchases;
+    long items;
+    long restocks;
+    long long t0_us;       /* simulated */
+    long long wall0_us;
+    unsigned rng;
+} sim;
+
+static unsigned sim_rand(void)
+{
+    sim.rng = sim.rng * 1103515245u + 12345u;
+    return (sim.rng >> 16) & 0x7FFF;
+}
+
+static int sim_init(void)
+{
+    const char *n = getenv("SNACK_SIM");
+    if (!n || atol(n) <= 0) return 0;
+
+    const char *seed = getenv("SNACK_SIM_SEED");
+    gClock = &clock_sim;
+    const char *bank_sz = getenv("SNACK_MACHINES");
+    sim.machines = bank_sz ? atoi(bank_sz) : 1;
+    if (sim.machines < 1) sim.machines = 1;
+    if (sim.machines > SIM_MAX_MACHINES) sim.machines = SIM_MAX_MACHINES;
+    sim.sessions = atol(n);
+    sim.rng = seed ? (unsigned)strtoul(seed, NULL, 0) : 1u;
+    sim.t0_us = clock_sim.now_us();
+    sim.wall0_us = clock_real.now_us();
+    return 1;
+}
+
+/* Service: gate, open the door, set the slot to 15, close the door. */
+static void sim_restock(const Item *it)
+{
+    char idx[8];
+    snprintf(idx, sizeof(idx), "%dB", it->index);
+    script_keys("1234B", SIM_THINK_MS, SIM_KEY_MS);
+    script_keys("B", 500, SIM_KEY_MS);
+    script_keys("2B", SIM_DOOR_MS, SIM_KEY_MS);
+    script_keys(idx, SIM_KEY_MS, SIM_KEY_MS);
+    script_keys("15B", SIM_KEY_MS, SIM_KEY_MS);
+    script_keys("1234B", OVERLAY_SVC_DONE_MS + 300, SIM_KEY_MS);
+    script_keys("B", 500, SIM_KEY_MS);
+    sim.restocks++;
+}
 
-        /* DIGITS */
-        if (isdigit((int)k)) {
-            if (!service_mode) {
-                if (st == ST_MENU) {
-                    if (sellen < 4) { selbuf[sellen++] = (char)k; selbuf[sellen] = '\0'; }
-                    show_image(IMG_MENU);
-                    char l1[17];
-                    snprintf(l1, sizeof(l1), "Enter Index:%-4.4s", selbuf);
-                    lcd_print2(l1, "B to enter");
-
-                    if (!index_timer_active && sellen > 0) {
-                        index_timer_active = 1;
-                        timer_start_or_reset();
-                        timer_update_display(now_ms());
-                    }
-                } else if (st == ST_AMOUNT) {
-                    if (amtlen < 3) { amtbuf[amtlen++] = (char)k; amtbuf[amtlen] = '\0'; }
-                    char l1[17], l2[17];
-                    snprintf(l1, sizeof(l1), "Enter amount:%-3.3s", amtbuf);
-                    snprintf(l2, sizeof(l2), "Stock: %d", items[chosen_slot].stock);
-                    lcd_print2(l1, l2);
-                } else if (st == ST_PAY) {
-                    if (k == '0') pay_zero_count++; else pay_zero_count = 0;
-
-                    if (pay_zero_count >= 2) {
-                        beep_payment_ok();
-                        lcd_print2("Payment OK", "Dispensing...");
-
-                        gDispAnim.oneshot_done = 0;
-                        gDispAnim.active = 0;
-                        st = ST_DISPENSING;
-                        continue;
-                    } else {
-                        lcd_print2("Pay: enter 00", "Press 0 twice");
-                    }
-                }
-            } else {
-                /* ===== SERVICE MODE digits ===== */
-                if (st == ST_SVC_MENU) {
-                    if (sellen < 4) { selbuf[sellen++] = (char)k; selbuf[sellen] = '\0'; }
-                    service_menu_screen(selbuf);
-                } else {
-                    if (svclen < 4) { svcbuf[svclen++] = (char)k; svcbuf[svclen] = '\0'; }
-
-                    if (st == ST_SVC_DISPENSE_IDX) {
-                        show_image(IMG_MENU_SERVICE);
-                        char l1[17]; snprintf(l1, sizeof(l1), "Disp idx:%-4.4s", svcbuf);
-                        lcd_print2(l1, "B=OK  A=Back");
-                    } else if (st == ST_SVC_DISPENSE_AMT) {
-                        show_image(IMG_MENU_SERVICE);
-                        char l1[17]; snprintf(l1, sizeof(l1), "Amt:%-4.4s", svcbuf);
-                        lcd_print2(l1, "B=Run A=Back");
-                    } else if (st == ST_SVC_RESTOCK_IDX) {
-                        show_image(IMG_RESTOCK);
-                        char l1[17]; snprintf(l1, sizeof(l1), "Restock idx:%-4.4s", svcbuf);
-                        lcd_print2(l1, "B=OK  A=Back");
-                    } else if (st == ST_SVC_RESTOCK_QTY) {
-                        show_image(IMG_RESTOCK);
-                        char l1[17]; snprintf(l1, sizeof(l1), "New stock:%-4.4s", svcbuf);
-                        lcd_print2(l1, "B=OK  A=Back");
-                    } else if (st == ST_SVC_SOUND_SEL) {
-                        show_image(IMG_SOUND);
-                        char l1[17]; snprintf(l1, sizeof(l1), "Sound 1-8:%-2.2s", svcbuf);
-                        lcd_print2(l1, "B=Play A=Back");
-                    } else if (st == ST_SVC_MOTOR_CYC) {
-                        show_image(IMG_MOTOR);
-                        char l1[17]; snprintf(l1, sizeof(l1), "Motor cyc:%-2.2s", svcbuf);
-                        lcd_print2(l1, "B=Run A=Back");
-                    }
-                }
+static void sim_report(void)
+{
+    double virt_s = 0, machine_s = 0;
+    double wall_s = (double)(clock_real.now_us() - sim.wall0_us) / 1e6;
+    if (wall_s <= 0) wall_s = 1e-6;
+
+    unsigned long writes = 0;
+    for (int i = 0; i < bank_n; i++) {
+        double s = (double)(bank[i]->sim_us - sim.t0_us) / 1e6;
+        if (s > virt_s) virt_s = s;
+        machine_s += s;
+        writes += bank[i]->port_writes;
+    }
+
+    printf("sim: %d machine(s), %ld sessions, %ld purchases (%ld items), %ld restocks, %lu port writes\n",
+           bank_n, sim.started, sim.purchases, sim.items, sim.restocks, writes);
+    printf("sim: %.0f s simulated (%.0f machine-s) in %.3f s wall (%.0fx)\n",
+           virt_s, machine_s, wall_s, machine_s / wall_s);
+    printf("sim: %.0f sessions/s, %.0f ui events/s, %.0f transitions/s\n",
+           sim.started / wall_s, ui_stats.events / wall_s, ui_stats.transitions / wall_s);
+}
+
+/* Script the next customer once the UI is back at an empty menu.
+ * Returns 1 when this machine is idle and the bank has run its sessions. */
+static int sim_step(Ui *u)
+{
+    if (M->script_len || M->keyq_len || ui_has_posted() || overlay_active()) return 0;
+    if (u->st != ST_MENU || u->sellen) return 0;
+
+    if (sim.started >= sim.sessions) return 1;
+    sim.started++;
+
+    int slot = (int)(sim_rand() % (unsigned)u->nitems);
+    const Item *it = &u->items[slot];
+    unsigned mix = sim_rand() % 10;
+    char keys[32];
+
+    if (mix == 0) {
+        script_keys("99B", SIM_THINK_MS, SIM_KEY_MS);          /* bad index */
+    } else if (mix == 1) {
+        snprintf(keys, sizeof(keys), "%dB", it->index);        /* walks away */
+        script_keys(keys, SIM_THINK_MS, SIM_KEY_MS);
+    } else if (mix == 2) {
+        snprintf(keys, sizeof(keys), "%dB1A", it->index);      /* backs out */
+        script_keys(keys, SIM_THINK_MS, SIM_KEY_MS);
+    } else {
+        if (it->stock <= 0) { sim_restock(it); return 0; }
+        int n = 1 + (int)(sim_rand() % (unsigned)(it->stock < 3 ? it->stock : 3));
+        snprintf(keys, sizeof(keys), "%dB%dB00", it->index, n);
+        script_keys(keys, SIM_THINK_MS, SIM_KEY_MS);
+        sim.purchases++;
+        sim.items += n;
+    }
+    return 0;
+}
+
+/* The bank run loop. Machines take turns; an idle one jumps its own
+ * clock to its next deadline (a timer or the next scripted key). */
+static void sim_run(void)
+{
+    for (;;) {
+        int finished = 0;
+
+        for (int i = 0; i < bank_n; i++) {
+            machine_use(bank[i]);
+            if (sim_step(M->ui)) { finished++; continue; }
+
+            if (!ui_has_posted() && !M->keyq_len) {
+                long long wake = tw_next();
+                long long k = script_next_ms();
+                if (k >= 0 && (wake < 0 || k < wake)) wake = k;
+                if (wake > 0) clock_advance_to_ms(wake);
             }
-            continue;
+            script_deliver(now_ms());
+            machine_pass(M);
         }
+        loop_stats.wakeups++;
 
-        /* ENTER (B) */
-        if (k == KEY_ENTER) {
-            if (!service_mode) {
-                if (st == ST_MENU) {
-                    if (sellen == 0) {
-                        beep_error();
-                        lcd_print2("No index", "Type digits");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        show_image(IMG_MENU);
-                        lcd_print2("Enter Index:", "B to enter");
-                        continue;
-                    }
-
-                    /* enter service: 1234 + B */
-                    if (strcmp(selbuf, "1234") == 0) {
-                        sellen = 0; selbuf[0] = '\0';
-                        index_timer_active = 0;
-                        timer_stop_and_blank();
-
-                        show_service_gate_prompt();
-                        usleep(120000);
-
-                        set_port_mapping(1);
-                        st = ST_SVC_GATE;
-                        svc_gate_deadline = now_ms() + SVC_GATE_TIMEOUT_MS;
-                        continue;
-                    }
-
-                    int idx = atoi(selbuf);
-                    chosen_slot = find_slot_by_index(items, N, idx);
-                    sellen = 0; selbuf[0] = '\0';
-                    index_timer_active = 0;
-                    timer_stop_and_blank();
-
-                    if (chosen_slot < 0) {
-                        beep_error();
-                        lcd_print2("Invalid index", "Try 3/8/11/22");
-                        usleep(USLEEP_ERR_LONG_US);
-                        show_image(IMG_MENU);
-                        lcd_print2("Enter Index:", "B to enter");
-                        continue;
-                    }
-
-                    show_image(items[chosen_slot].img);
-
-                    if (items[chosen_slot].stock <= 0) {
-                        show_image(items[chosen_slot].img_oos);
-                        lcd_print2(items[chosen_slot].name, "OUT OF STOCK");
-                        usleep(USLEEP_OOS_SCREEN_US);
-                        chosen_slot = -1;
-                        show_image(IMG_MENU);
-                        lcd_print2("Enter Index:", "B to enter");
-                        continue;
-                    }
-
-                    st = ST_AMOUNT;
-                    amtlen = 0; amtbuf[0] = '\0';
-                    timer_start_or_reset();
-                    timer_update_display(now_ms());
-
-                    char l1[17], l2[17];
-                    snprintf(l1, sizeof(l1), "Enter amount:%-3.3s", "");
-                    snprintf(l2, sizeof(l2), "Stock: %d", items[chosen_slot].stock);
-                    lcd_print2(l1, l2);
-                    continue;
-                }
-
-                if (st == ST_AMOUNT) {
-                    if (amtlen == 0) {
-                        beep_error();
-                        lcd_print2("No amount", "Type digits");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-
-                    amount = atoi(amtbuf);
-                    if (amount < 1 || amount > MAX_COUNT) {
-                        beep_error();
-                        lcd_print2("Amount must", "be 1-15");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        amtlen = 0; amtbuf[0] = '\0';
-                        continue;
-                    }
-                    if (amount > items[chosen_slot].stock) {
-                        beep_error();
-                        lcd_print2("Insufficient", "stock");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        amtlen = 0; amtbuf[0] = '\0';
-                        continue;
-                    }
-
-                    total = items[chosen_slot].price * (float)amount;
-                    char total_s[12];
-                    format_money(total_s, total);
-
-                    char l1[17], l2[17];
-                    snprintf(l1, sizeof(l1), "Total %s", total_s);
-                    snprintf(l2, sizeof(l2), "Pay: enter 00");
-                    lcd_print2(l1, l2);
-
-                    st = ST_PAY;
-                    pay_zero_count = 0;
-                    timer_start_or_reset();
-                    timer_update_display(now_ms());
-                    continue;
-                }
-
-            } else {
-                /* ===== SERVICE MODE ENTER ===== */
-
-                /* From service menu -> enter an option / exit */
-                if (st == ST_SVC_MENU) {
-                    if (strcmp(selbuf, "1234") == 0) {
-                        sellen = 0; selbuf[0] = '\0';
-
-                        show_return_gate_prompt();
-                        usleep(120000);
-
-                        set_port_mapping(0);
-                        st = ST_RETURN_GATE;
-                        return_gate_deadline = now_ms() + RETURN_GATE_TIMEOUT_MS;
-                        continue;
-                    }
-
-                    if (strcmp(selbuf, "1") == 0) {
-                        svclen = 0; svcbuf[0] = '\0';
-                        st = ST_SVC_DISPENSE_IDX;
-                        show_image(IMG_MENU_SERVICE);
-                        lcd_print2("Disp idx:", "B=OK  A=Back");
-                    } else if (strcmp(selbuf, "2") == 0) {
-                        svclen = 0; svcbuf[0] = '\0';
-                        st = ST_SVC_RESTOCK_IDX;
-                        show_image(IMG_RESTOCK);
-                        lcd_print2("Restock idx:", "B=OK  A=Back");
-                    } else if (strcmp(selbuf, "3") == 0) {
-                        svclen = 0; svcbuf[0] = '\0';
-                        st = ST_SVC_SOUND_SEL;
-                        show_image(IMG_SOUND);
-                        lcd_print2("Sound 1-8:", "B=Play A=Back");
-                    } else if (strcmp(selbuf, "4") == 0) {
-                        svclen = 0; svcbuf[0] = '\0';
-                        st = ST_SVC_MOTOR_CYC;
-                        show_image(IMG_MOTOR);
-                        lcd_print2("Motor cyc 1-15", "B=Run A=Back");
-                    } else {
-                        beep_error();
-                        lcd_print2("Invalid choice", "Use 1-4 or 1234");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        service_menu_screen(selbuf);
-                    }
-
-                    sellen = 0; selbuf[0] = '\0';
-                    continue;
-                }
-
-                /* ---- service dispense idx confirm ---- */
-                if (st == ST_SVC_DISPENSE_IDX) {
-                    if (svclen == 0) {
-                        beep_error();
-                        lcd_print2("No index", "Type digits");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-                    int idx = atoi(svcbuf);
-                    svc_disp_slot = find_slot_by_index(items, N, idx);
-                    if (svc_disp_slot < 0) {
-                        beep_error();
-                        lcd_print2("Bad idx", "Try 3/8/11/22");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        svclen = 0; svcbuf[0] = '\0';
-                        show_image(IMG_MENU_SERVICE);
-                        lcd_print2("Disp idx:", "B=OK  A=Back");
-                        continue;
-                    }
-
-                    show_image(items[svc_disp_slot].img);
-                    svclen = 0; svcbuf[0] = '\0';
-                    st = ST_SVC_DISPENSE_AMT;
-                    lcd_print2("Amount 1-15:", "B=Run A=Back");
-                    continue;
-                }
-
-                /* ---- service dispense amount confirm ---- */
-                if (st == ST_SVC_DISPENSE_AMT) {
-                    if (svclen == 0) {
-                        beep_error();
-                        lcd_print2("No amount", "Type digits");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-                    int a = atoi(svcbuf);
-                    if (a < 1 || a > 15) {
-                        beep_error();
-                        lcd_print2("Amount 1-15", "Try again");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        svclen = 0; svcbuf[0] = '\0';
-                        show_image(IMG_MENU_SERVICE);
-                        lcd_print2("Amount 1-15:", "B=Run A=Back");
-                        continue;
-                    }
-
-                    lcd_print2("Service Disp", "Dispensing...");
-
-                    gDispAnim.oneshot_done = 0;
-                    gDispAnim.active = 0;
-                    anim_start(&gDispAnim, disp_frames, DISP_N, +1, DISP_FRAME_MS);
-
-                    for (int i = 0; i < a; i++) {
-                        run_one_dispense_cycle_with_anim();
-                        if (i != a - 1) usleep(150000);
-                    }
-                    while (!gDispAnim.oneshot_done) { anim_tick(&gDispAnim); usleep(20000); }
-
-                    beep_success();
-                    lcd_print2("Service Done", "A=Back");
-                    usleep(USLEEP_SVC_DONE_US);
-
-                    st = ST_SVC_MENU;
-                    svclen = 0; svcbuf[0] = '\0';
-                    svc_disp_slot = -1;
-                    service_menu_screen(selbuf);
-                    continue;
-                }
-
-                /* ---- restock index confirm ---- */
-                if (st == ST_SVC_RESTOCK_IDX) {
-                    if (svclen == 0) {
-                        beep_error();
-                        lcd_print2("No index", "Type digits");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-                    int idx = atoi(svcbuf);
-                    restock_slot = find_slot_by_index(items, N, idx);
-                    if (restock_slot < 0) {
-                        beep_error();
-                        lcd_print2("Bad idx", "Try 3/8/11/22");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        svclen = 0; svcbuf[0] = '\0';
-                        show_image(IMG_RESTOCK);
-                        lcd_print2("Restock idx:", "B=OK  A=Back");
-                        continue;
-                    }
-
-                    /* prompt for NEW stock (1..15) */
-                    show_image(items[restock_slot].img);
-                    svclen = 0; svcbuf[0] = '\0';
-                    st = ST_SVC_RESTOCK_QTY;
-                    lcd_print2("New stock 1-15", "B=OK  A=Back");
-                    continue;
-                }
-
-                /* ---- restock qty confirm ---- */
-                if (st == ST_SVC_RESTOCK_QTY) {
-                    if (svclen == 0) {
-                        beep_error();
-                        lcd_print2("No stock", "Type 1-15");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-                    int newstock = atoi(svcbuf);
-                    if (newstock < 1 || newstock > 15) {
-                        beep_error();
-                        lcd_print2("Stock must", "be 1-15");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        svclen = 0; svcbuf[0] = '\0';
-                        show_image(IMG_RESTOCK);
-                        lcd_print2("New stock 1-15", "B=OK  A=Back");
-                        continue;
-                    }
-
-                    items[restock_slot].stock = newstock;
-
-                    beep_success();
-                    char l2[17];
-                    snprintf(l2, sizeof(l2), "Stock=%d", newstock);
-                    lcd_print2("Restocked", l2);
-                    usleep(USLEEP_SVC_DONE_US);
-
-                    st = ST_SVC_MENU;
-                    restock_slot = -1;
-                    svclen = 0; svcbuf[0] = '\0';
-                    service_menu_screen(selbuf);
-                    continue;
-                }
-
-                /* ---- sound selection confirm (stay in sound select) ---- */
-                if (st == ST_SVC_SOUND_SEL) {
-                    if (svclen == 0) {
-                        beep_error();
-                        lcd_print2("Pick 1-8", "Type digit");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-                    int s = atoi(svcbuf);
-                    if (s < 1 || s > 8) {
-                        beep_error();
-                        lcd_print2("Sound must", "be 1-8");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        svclen = 0; svcbuf[0] = '\0';
-                        show_image(IMG_SOUND);
-                        lcd_print2("Sound 1-8:", "B=Play A=Back");
-                        continue;
-                    }
-
-                    lcd_print2("Playing...", "Please wait");
-                    usleep(1000000);
-
-                    /* Correct mapping per your image */
-                    if (s == 1) beep_keypress();
-                    else if (s == 2) beep_error();
-                    else if (s == 3) beep_success();
-                    else if (s == 4) beep_payment_ok();
-                    else if (s == 5) beep_dispensing_slot(1);
-                    else if (s == 6) beep_dispensing_slot(2);
-                    else if (s == 7) beep_dispensing_slot(3);
-                    else if (s == 8) beep_dispensing_slot(4);
-
-                    /* stay in sound selection */
-                    svclen = 0; svcbuf[0] = '\0';
-                    show_image(IMG_SOUND);
-                    lcd_print2("Sound 1-8:", "B=Play A=Back");
-                    continue;
-                }
-
-                /* ---- motor cycles confirm (stay in motor screen) ---- */
-                if (st == ST_SVC_MOTOR_CYC) {
-                    if (svclen == 0) {
-                        beep_error();
-                        lcd_print2("No cycles", "Type 1-15");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        continue;
-                    }
-                    int cycles = atoi(svcbuf);
-                    if (cycles < 1 || cycles > 15) {
-                        beep_error();
-                        lcd_print2("Cycles must", "be 1-15");
-                        usleep(USLEEP_ERR_SHORT_US);
-                        svclen = 0; svcbuf[0] = '\0';
-                        show_image(IMG_MOTOR);
-                        lcd_print2("Motor cyc 1-15", "B=Run A=Back");
-                        continue;
-                    }
-
-                    lcd_print2("Motor test", "Running...");
-                    run_motor_test_cycles(cycles);
-                    beep_success();
-
-                    /* stay here for more tests */
-                    svclen = 0; svcbuf[0] = '\0';
-                    show_image(IMG_MOTOR);
-                    lcd_print2("Motor cyc 1-15", "B=Run A=Back");
-                    continue;
-                }
-            }
+        if (finished == bank_n) {
+            sim_report();
+            return;
         }
+        if (quit_requested) return;
+        if (stats_dump_requested) { stats_dump_requested = 0; stats_dump(); }
+    }
+}
+
+/* ===== Stall watchdog (SNACK_WD) =====
+ * SNACK_WD=<ms> starts a thread that checks the heartbeat every
+ * WD_POLL_MS. When the main loop has been busy without a beat for longer
+ * than the threshold it appends a report to WD_LOG_PATH: how long, the
+ * UI state, the function last marked with WD_MARK() and a backtrace of
+ * the main thread (taken by the main thread itself in a SIGUSR2 handler;
+ * link with -rdynamic for symbol names; the handler does nothing else).
+ * With SNACK_WD_RECOVER=1 the watchdog then sets wd_abort: the waits and
+ * port sequences the main thread may be stuck in return early, and once
+ * the pass has unwound the main loop cancels the device threads' work,
+ * stops the motor and DAC, re-initialises the LCD and 7-seg and resets
+ * the UI to ST_MENU. A stall outside those loops (a blocked syscall) is
+ * only reported. Each stall is reported once; off under SNACK_SIM. */
+#define WD_POLL_MS  250
+#define WD_LOG_PATH "/tmp/snack_stall.txt"
+
+static struct {
+    int threshold_ms;
+    int recover;
+    pthread_t th;
+    atomic_int running;
+    int log_fd;
+    atomic_int bt_done;
+    unsigned long stalls;
+    unsigned long recoveries;
+    long long worst_ms;
+} wd;
+
+static void wd_on_sigusr2(int sig)
+{
+    void *bt[32];
+    (void)sig;
+    int n = backtrace(bt, 32);
+    if (wd.log_fd >= 0) backtrace_symbols_fd(bt, n, wd.log_fd);
+    atomic_store(&wd.bt_done, 1);
+}
 
-        /* anything else */
-        beep_error();
+static void wd_report(long long stalled_ms)
+{
+    int st = atomic_load(&wd_hb.state);
+    const char *where = atomic_load(&wd_hb.where);
+    char head[160];
+
+    wd.log_fd = open(WD_LOG_PATH, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    int n = snprintf(head, sizeof(head), "stall: %lld ms in %s, state %s%s\n",
+                     stalled_ms, where ? where : "?", (st >= 0 && st < ST_COUNT) ? ui_states[st].name : "?",
+                     wd.recover ? ", recovering" : "");
+    fputs(head, stderr);
+    if (wd.log_fd >= 0 && write(wd.log_fd, head, (size_t)n) < 0) { }
+
+    atomic_store(&wd.bt_done, 0);
+    pthread_kill(wd_hb.main_th, SIGUSR2);
+    for (int i = 0; i < 100 && !atomic_load(&wd.bt_done); i++) usleep(10000);
+
+    if (wd.log_fd >= 0) {
+        if (write(wd.log_fd, "\n", 1) < 0) { }
+        close(wd.log_fd);
+        wd.log_fd = -1;
     }
+    if (wd.recover) atomic_store(&wd_abort, 1);
 }
 
-/* ===== LCD low-level ===== */
-static void initlcd(void)
+static void *wd_main(void *arg)
+{
+    long long reported = -1;   /* beat time of the stall already reported */
+    (void)arg;
+
+    while (atomic_load(&wd.running)) {
+        usleep(WD_POLL_MS * 1000);
+        long long beat = atomic_load(&wd_hb.beat_ms);
+        if (!atomic_load(&wd_hb.busy) || beat == reported) continue;
+
+        long long stalled = now_ms() - beat;
+        if (stalled < wd.threshold_ms) continue;
+
+        reported = beat;
+        wd.stalls++;
+        if (stalled > wd.worst_ms) wd.worst_ms = stalled;
+        wd_report(stalled);
+    }
+    return NULL;
+}
+
+static void wd_start(void)
 {
-    usleep(20000);
-    lcd_writecmd(0x30);
-    usleep(20000);
-    lcd_writecmd(0x30);
-    usleep(20000);
-    lcd_writecmd(0x30);
+    const char *ms = getenv("SNACK_WD");
+    const char *rec = getenv("SNACK_WD_RECOVER");
+    if (!ms || atoi(ms) <= 0 || gClock->simulated) return;
+
+    void *warm[1];
+    backtrace(warm, 1);        /* loads libgcc now, not inside the handler */
+
+    wd.threshold_ms = atoi(ms);
+    wd.recover = rec && atoi(rec) > 0;
+    wd.log_fd = -1;
+    wd_hb.main_th = pthread_self();
+    wd_hb.on = 1;
+    wd_beat();
+    signal(SIGUSR2, wd_on_sigusr2);
+
+    atomic_store(&wd.running, 1);
+    if (pthread_create(&wd.th, NULL, wd_main, NULL) != 0) {
+        atomic_store(&wd.running, 0);
+        fprintf(stderr, "watchdog: cannot start\n");
+    }
+}
 
-    lcd_writecmd(0x02);
-    lcd_writecmd(0x28);
-    lcd_writecmd(0x01);
-    lcd_writecmd(0x0c);
-    lcd_writecmd(0x06);
-    lcd_writecmd(0x80);
+static void wd_stop(void)
+{
+    if (!atomic_exchange(&wd.running, 0)) return;
+    pthread_join(wd.th, NULL);
 }
 
-static void lcd_writecmd(char cmd)
+static void wd_stats_dump(FILE *fp)
 {
-    char data;
-    data = (cmd & 0xf0);
-    CM3_outport(gLcdPort, data | 0x04);
-    usleep(10);
-    CM3_outport(gLcdPort, data);
-    usleep(200);
+    if (wd.threshold_ms <= 0) return;
+    fprintf(fp, "\n[watchdog]\n");
+    fprintf(fp, "threshold_ms=%d\nrecover=%d\nstalls=%lu\nrecoveries=%lu\nworst_ms=%lld\n",
+            wd.threshold_ms, wd.recover, wd.stalls, wd.recoveries, wd.worst_ms);
+}
+
+/* The aborted pass has unwound: cancel what the device threads still
+ * hold and put the peripherals and the UI in a known state. */
+static void wd_recover(Ui *u)
+{
+    wd.recoveries++;
+
+    /* device threads drop queued commands and abandon the current one;
+     * progress and key events already sent are stale */
+    atomic_fetch_add(&dev_epoch, 1);
+    atomic_store(&wd_abort, 0);
+    if (dev_on) {
+        DevMsg ev;
+        while (dev_recv(&dev_motor_ev, &ev) == 0) { }
+        while (dev_recv(&dev_input_ev, &ev) == 0) { }
+    }
+    io_op_cur = IOP_OTHER;
+
+    port_map_use(pm_normal);
+    if (rt_active()) {
+        atomic_store(&rt_motor.phases, 0);
+        atomic_store(&rt_dac.ticks, 0);
+    } else if (!dev_on) {                 /* the motor and audio threads stop their own */
+        motor_release();
+        dac_write(0);
+    }
+    anim_stop(M->door_anim);
+    anim_stop(M->disp_anim);
+    gate_cancel();
+    overlay_dismiss();
+
+    int from_pad;
+    while (keyq_pop(&from_pad) != 0xFF) { }
+    while (ui_take() >= 0) { }
+    M->key_latched = 1;           /* a stuck key must be released first */
+
+    u->st = ST_MENU;
+    atomic_store(&wd_hb.state, ST_MENU);
+    ui_states[ST_MENU].entry(u);   /* re-inits LCD, blanks the 7-seg */
+}
+
+/* ===== MAIN ===== */
+int main(void)
+{
+    atexit(cleanup);
+    signal(SIGINT, on_sig);
+    signal(SIGTERM, on_sig);
+    signal(SIGUSR1, on_usr1);
+
+    int simulated = sim_init();
+    io_acct.timed = !simulated;
+    port_maps_load();
+    if (bank_create(simulated ? sim.machines : 1, simulated ? &port_io_sim : &port_io_vendor) < 0) {
+        fprintf(stderr, "machines: out of memory\n");
+        return 1;
+    }
+    inv_open();
+
+    if (!simulated) {
+        trace_start(M);
+        vendor_init();
+    }
 
-    data = (cmd & 0x0f) << 4;
-    CM3_outport(gLcdPort, data | 0x04);
-    usleep(10);
-    CM3_outport(gLcdPort, data);
-    usleep(2000);
+    rt_start();
+    display_init();
+    dev_start();
+
+    for (int i = 0; i < bank_n; i++) machine_start(bank[i]);
+    machine_use(bank[0]);
+
+    if (simulated) {
+        sim_run();
+        return 0;
+    }
+
+    loop_init();
+    pm_start();
+
+    wd_start();
+
+    while (!quit_requested) {
+        loop_arm();
+        wd_idle();
+        loop_wait(ui_has_posted());
+        wd_beat();
+        WD_MARK();
+
+        if (stats_dump_requested) { stats_dump_requested = 0; stats_dump(); }
+
+        machine_pass(M);
+        if (atomic_load(&wd_abort)) wd_recover(M->ui);
+    }
+    return 0;
+}
+
+/* ===== LCD low-level =====
+ * 4-bit bus: each byte is two E pulses (10 us high, 200 us between the
+ * nibbles) and a settle after it, queued into a PortBatch so a whole
+ * screen reaches the port layer in one call. */
+static void lcd_put(PortBatch *pb, unsigned char byte, int rs, int settle_us)
+{
+    unsigned char port = M->lcd_io_port, r = rs ? 0x01 : 0x00;
+    unsigned char hi = byte & 0xF0, lo = (unsigned char)((byte & 0x0F) << 4);
+    pb_out(pb, port, hi | 0x04 | r, 10);
+    pb_out(pb, port, hi, 200);
+    pb_out(pb, port, lo | 0x04 | r, 10);
+    pb_out(pb, port, lo, settle_us);
 }
 
-static void LCDprint(char *sptr)
+static void initlcd(void)
 {
-    while (*sptr) lcddata(*sptr++);
+    IoScope io = io_op_begin(IOP_LCD_INIT);
+    PortBatch pb = { .n = 0 };
+    clock_sleep_us(20000);
+    lcd_put(&pb, 0x30, 0, 2000 + 20000);
+    lcd_put(&pb, 0x30, 0, 2000 + 20000);
+    lcd_put(&pb, 0x30, 0, 2000);
+
+    lcd_put(&pb, 0x02, 0, 2000);
+    lcd_put(&pb, 0x28, 0, 2000);
+    lcd_put(&pb, 0x01, 0, 2000);
+    lcd_put(&pb, 0x0c, 0, 2000);
+    lcd_put(&pb, 0x06, 0, 2000);
+    lcd_put(&pb, 0x80, 0, 2000);
+    pb_run(&pb);
+    io_op_end(&io);
 }
 
-static void lcddata(unsigned char cmd)
+static void lcd_writecmd(char cmd)
 {
-    char data;
-    data = (cmd & 0xf0);
-    CM3_outport(gLcdPort, data | 0x05);
-    usleep(10);
-    CM3_outport(gLcdPort, data);
-    usleep(200);
+    PortBatch pb = { .n = 0 };
+    lcd_put(&pb, (unsigned char)cmd, 0, 2000);
+    pb_run(&pb);
+}
 
-    data = (cmd & 0x0f) << 4;
-    CM3_outport(gLcdPort, data | 0x05);
-    usleep(10);
-    CM3_outport(gLcdPort, data);
-    usleep(2000);
+static void LCDprint(PortBatch *pb, const char *sptr)
+{
+    while (*sptr) lcd_put(pb, (unsigned char)*sptr++, 1, 2000);
 }
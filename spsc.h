@@ -0,0 +1,117 @@
+/*********************************************************************
+ * SNACK DISPENSER - SPSC RING BUFFER
+ * * DESCRIPTION:
+ * Bounded lock-free single-producer / single-consumer queue of fixed
+ * size elements, used between the UI coordinator and the device
+ * threads. Exactly one thread may push and exactly one may pop; the
+ * indices are C11 atomics on separate cache lines, so neither side
+ * ever takes a lock or a syscall. Waking a sleeping consumer is left
+ * to the caller (the dispenser pairs each ring with an eventfd).
+ * * STATS:
+ * Producer-side (pushed, full, depth_max) and consumer-side (popped,
+ * latency) counters are each written by one thread only. A failed push
+ * is not counted: the producer counts one "full" per send it had to
+ * drop or wait on, however often it retries. Latency is
+ * push-to-pop time, using the timestamps the caller passes in.
+ *********************************************************************/
+
+#ifndef SNACK_SPSC_H
+#define SNACK_SPSC_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPSC_CACHELINE 64
+
+typedef struct {
+    const char *name;
+    unsigned char *buf;
+    long long *stamp;          /* push time per slot */
+    size_t esz;
+    unsigned mask;             /* capacity - 1, capacity is a power of two */
+
+    _Alignas(SPSC_CACHELINE) atomic_uint head;   /* next slot to pop */
+    unsigned long popped;
+    unsigned long long lat_sum;
+    unsigned long long lat_max;
+
+    _Alignas(SPSC_CACHELINE) atomic_uint tail;   /* next slot to push */
+    unsigned long pushed;
+    unsigned long full;        /* sends that found the ring full (counted by the caller) */
+    unsigned depth_max;
+} Spsc;
+
+/* cap is rounded up to a power of two. Returns -1 on allocation failure. */
+static inline int spsc_init(Spsc *q, const char *name, size_t esz, unsigned cap)
+{
+    unsigned n = 2;
+    while (n < cap) n <<= 1;
+
+    memset(q, 0, sizeof(*q));
+    q->name = name;
+    q->esz = esz;
+    q->mask = n - 1;
+    q->buf = calloc(n, esz);
+    q->stamp = calloc(n, sizeof(long long));
+    if (!q->buf || !q->stamp) {
+        free(q->buf);
+        free(q->stamp);
+        q->buf = NULL;
+        q->stamp = NULL;
+        return -1;
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+static inline void spsc_free(Spsc *q)
+{
+    free(q->buf);
+    free(q->stamp);
+    q->buf = NULL;
+    q->stamp = NULL;
+}
+
+static inline unsigned spsc_depth(Spsc *q)
+{
+    return atomic_load_explicit(&q->tail, memory_order_acquire) -
+           atomic_load_explicit(&q->head, memory_order_acquire);
+}
+
+/* Producer only. Returns 0, or -1 when full. */
+static inline int spsc_push(Spsc *q, const void *e, long long now)
+{
+    unsigned t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned h = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (t - h > q->mask) return -1;
+    memcpy(q->buf + (size_t)(t & q->mask) * q->esz, e, q->esz);
+    q->stamp[t & q->mask] = now;
+    atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+
+    q->pushed++;
+    if (t + 1 - h > q->depth_max) q->depth_max = t + 1 - h;
+    return 0;
+}
+
+/* Consumer only. Returns 0, or -1 when empty. */
+static inline int spsc_pop(Spsc *q, void *e, long long now)
+{
+    unsigned h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned t = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (h == t) return -1;
+
+    memcpy(e, q->buf + (size_t)(h & q->mask) * q->esz, q->esz);
+    long long lat = now - q->stamp[h & q->mask];
+    atomic_store_explicit(&q->head, h + 1, memory_order_release);
+
+    q->popped++;
+    if (lat > 0) {
+        q->lat_sum += (unsigned long long)lat;
+        if ((unsigned long long)lat > q->lat_max) q->lat_max = (unsigned long long)lat;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,324 @@
+/*********************************************************************
+ * SNACK DISPENSER - OFFLINE ASSET COMPILER
+ * * DESCRIPTION:
+ * Converts the UI JPEGs into display-native .snkf frames (assets.h):
+ * scaled to the panel resolution (aspect kept, letterboxed like
+ * pqiv -f), stored as RGB565 or BGRA32, raw or RLE-packed.
+ * * REPORT:
+ * One line per asset with source size, JPEG decode time, compiled
+ * size and compiled load time. Assets over the -k / -t limits are
+ * flagged HEAVY and make the tool exit with status 2.
+ * * ANIMATIONS (-a out.snka):
+ * All inputs become the frames of one .snka: keyframe plus
+ * dirty-rectangle deltas. The report lists the dirty area of every
+ * transition, full-frame vs delta size and the per-step apply time.
+ * -d sets the per-channel tolerance below which a tile counts as
+ * unchanged (default SNKA_TOLERANCE, 0 = lossless).
+ * * USAGE:
+ * asset_compiler [-s WxH] [-f rgb565|bgra32] [-z] [-o outdir]
+ *                [-r report.csv] [-k warn_kb] [-t warn_ms] file.jpg...
+ * asset_compiler -a out.snka [-d tol] [-s WxH] [-f fmt] frame1.jpg...
+ *********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <jpeglib.h>
+
+#include "../assets.h"
+
+#define DEF_WIDTH  800
+#define DEF_HEIGHT 480
+
+typedef struct {
+    int width, height;          /* source */
+    unsigned char *rgb;         /* width * height * 3 */
+} Rgb;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long file_size(const char *p)
+{
+    struct stat st;
+    return (stat(p, &st) == 0) ? (long)st.st_size : -1;
+}
+
+/* ===== JPEG decode (libjpeg) ===== */
+static int jpeg_read_rgb(const char *path, Rgb *out)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    out->width = (int)cinfo.output_width;
+    out->height = (int)cinfo.output_height;
+    size_t row = (size_t)out->width * 3;
+    out->rgb = malloc(row * (size_t)out->height);
+    if (!out->rgb) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return -1;
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW r = out->rgb + row * cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, &r, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return 0;
+}
+
+/* ===== Scale-to-fit (area average), letterboxed black ===== */
+static Frame *rgb_to_frame(const Rgb *src, int dw, int dh, int fmt)
+{
+    Frame *f = frame_alloc(dw, dh, fmt);
+    if (!f) return NULL;
+
+    for (size_t i = 0; i < (size_t)dw * dh; i++) pixel_pack(f->pixels + i * f->bpp, fmt, 0, 0, 0);
+
+    /* fit: scale = min(dw/sw, dh/sh) */
+    int fw, fh;
+    if ((long)dw * src->height <= (long)dh * src->width) {
+        fw = dw;
+        fh = (int)((long)src->height * dw / src->width);
+    } else {
+        fh = dh;
+        fw = (int)((long)src->width * dh / src->height);
+    }
+    if (fw < 1) fw = 1;
+    if (fh < 1) fh = 1;
+    int ox = (dw - fw) / 2;
+    int oy = (dh - fh) / 2;
+
+    for (int y = 0; y < fh; y++) {
+        int sy0 = (int)((long)y * src->height / fh);
+        int sy1 = (int)((long)(y + 1) * src->height / fh);
+        if (sy1 <= sy0) sy1 = sy0 + 1;
+
+        for (int x = 0; x < fw; x++) {
+            int sx0 = (int)((long)x * src->width / fw);
+            int sx1 = (int)((long)(x + 1) * src->width / fw);
+            if (sx1 <= sx0) sx1 = sx0 + 1;
+
+            unsigned long r = 0, g = 0, b = 0, n = 0;
+            for (int sy = sy0; sy < sy1; sy++) {
+                const unsigned char *p = src->rgb + ((size_t)sy * src->width + sx0) * 3;
+                for (int sx = sx0; sx < sx1; sx++, p += 3) { r += p[0]; g += p[1]; b += p[2]; n++; }
+            }
+            unsigned char *d = f->pixels + ((size_t)(oy + y) * dw + (ox + x)) * f->bpp;
+            pixel_pack(d, fmt, (unsigned char)(r / n), (unsigned char)(g / n), (unsigned char)(b / n));
+        }
+    }
+    return f;
+}
+
+static Frame *compile_jpeg(const char *in, int dw, int dh, int fmt, double *jpeg_ms)
+{
+    Rgb src = {0};
+    double t0 = now_sec();
+    if (jpeg_read_rgb(in, &src) != 0) return NULL;
+    if (jpeg_ms) *jpeg_ms = (now_sec() - t0) * 1000.0;
+
+    Frame *f = rgb_to_frame(&src, dw, dh, fmt);
+    free(src.rgb);
+    return f;
+}
+
+/* ===== Animation mode ===== */
+static int compile_anim(const char *out, char **inputs, int n, int dw, int dh, int fmt, int tol)
+{
+    Frame **frames = calloc((size_t)n, sizeof(Frame *));
+    if (!frames) return 1;
+
+    int rc = 1;
+    AnimAsset *a = NULL, *back = NULL;
+    AnimCursor *c = NULL;
+    double jpeg_ms = 0.0;
+
+    for (int i = 0; i < n; i++) {
+        double ms = 0.0;
+        frames[i] = compile_jpeg(inputs[i], dw, dh, fmt, &ms);
+        if (!frames[i]) { fprintf(stderr, "%s: cannot decode\n", inputs[i]); goto done; }
+        jpeg_ms += ms;
+    }
+
+    a = animasset_build(frames, n, SNKA_TILE, tol);
+    long written = a ? animasset_save(a, out) : -1;
+    if (written < 0) { fprintf(stderr, "%s: cannot write\n", out); goto done; }
+
+    back = animasset_load(out);
+    c = back ? animcursor_new(back) : NULL;
+    if (!c) { fprintf(stderr, "%s: compiled animation does not load back\n", out); goto done; }
+
+    /* a forward loop must land exactly on frame 0, stepping back must
+     * retrace the forward canvases; time the delta steps meanwhile */
+    unsigned char *seen = malloc(c->canvas->size * (size_t)n);
+    if (!seen) goto done;
+    double t0 = now_sec();
+    int steps = 0, bad = 0;
+    for (int i = 1; i <= n; i++, steps++) {
+        animcursor_step(c, +1);
+        memcpy(seen + c->canvas->size * (size_t)(i % n), c->canvas->pixels, c->canvas->size);
+    }
+    if (memcmp(c->canvas->pixels, frames[0]->pixels, c->canvas->size) != 0) bad++;
+    for (int i = n - 1; i >= 0; i--, steps++) {
+        animcursor_step(c, -1);
+        if (memcmp(c->canvas->pixels, seen + c->canvas->size * (size_t)i, c->canvas->size) != 0) bad++;
+    }
+    double step_ms = (now_sec() - t0) * 1000.0 / steps;
+    free(seen);
+    if (bad) { fprintf(stderr, "%s: %d frame(s) do not round-trip\n", out, bad); goto done; }
+
+    size_t full = frames[0]->size * (size_t)n;
+    printf("anim %s: %d frames %dx%d %s\n", out, n, dw, dh, pixfmt_name(fmt));
+    for (int t = 0; t < n; t++)
+        printf("  %d -> %d: %3d rects, %5.1f%% dirty\n", t + 1, (t + 1) % n + 1,
+               a->deltas[t].nrects, animasset_dirty_ratio(a, t) * 100.0);
+    printf("  jpeg decode %.2f ms total, full frames %zu KB, delta anim %ld KB (%.1fx), step %.3f ms\n",
+           jpeg_ms, (full + 1023) / 1024, (written + 1023) / 1024,
+           (double)full / (double)(written ? written : 1), step_ms);
+    rc = 0;
+
+done:
+    animcursor_free(c);
+    animasset_free(back);
+    animasset_free(a);
+    for (int i = 0; i < n; i++) frame_free(frames[i]);
+    free(frames);
+    return rc;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-s WxH] [-f rgb565|bgra32] [-z] [-o outdir] [-r report.csv]\n"
+            "          [-k warn_kb] [-t warn_ms] file.jpg...\n"
+            "       %s -a out.snka [-d tolerance] [-s WxH] [-f rgb565|bgra32] frame.jpg...\n", argv0, argv0);
+}
+
+int main(int argc, char **argv)
+{
+    int dw = DEF_WIDTH, dh = DEF_HEIGHT;
+    int fmt = PIXFMT_BGRA32;
+    int comp = SNKF_RAW;
+    const char *outdir = NULL;
+    const char *csv_path = NULL;
+    long warn_kb = 0;
+    double warn_ms = 0.0;
+    const char *anim_out = NULL;
+    int tol = SNKA_TOLERANCE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:zo:r:k:t:a:d:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (sscanf(optarg, "%dx%d", &dw, &dh) != 2 || dw <= 0 || dh <= 0) { usage(argv[0]); return 1; }
+                break;
+            case 'f':
+                fmt = pixfmt_parse(optarg);
+                if (fmt < 0) { usage(argv[0]); return 1; }
+                break;
+            case 'z': comp = SNKF_RLE; break;
+            case 'o': outdir = optarg; break;
+            case 'r': csv_path = optarg; break;
+            case 'k': warn_kb = atol(optarg); break;
+            case 't': warn_ms = atof(optarg); break;
+            case 'a': anim_out = optarg; break;
+            case 'd': tol = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) { usage(argv[0]); return 1; }
+    if (anim_out) return compile_anim(anim_out, argv + optind, argc - optind, dw, dh, fmt, tol);
+
+    FILE *csv = NULL;
+    if (csv_path) {
+        csv = fopen(csv_path, "w");
+        if (!csv) { perror(csv_path); return 1; }
+        fprintf(csv, "asset,src_kb,jpeg_ms,out_kb,raw_kb,load_ms,heavy\n");
+    }
+
+    printf("target %dx%d %s %s\n", dw, dh, pixfmt_name(fmt), comp == SNKF_RLE ? "rle" : "raw");
+    printf("%-20s %8s %8s %8s %8s %8s\n", "asset", "src_kb", "jpeg_ms", "out_kb", "raw_kb", "load_ms");
+
+    int failures = 0, heavy_count = 0;
+
+    for (int i = optind; i < argc; i++) {
+        const char *in = argv[i];
+        const char *base = strrchr(in, '/');
+        base = base ? base + 1 : in;
+
+        char out[512];
+        if (outdir) {
+            char stem[256];
+            asset_path_for(base, SNKF_EXT, stem, sizeof(stem));
+            snprintf(out, sizeof(out), "%s/%s", outdir, stem);
+        } else {
+            asset_path_for(in, SNKF_EXT, out, sizeof(out));
+        }
+
+        double jpeg_ms = 0.0;
+        Frame *f = compile_jpeg(in, dw, dh, fmt, &jpeg_ms);
+        if (!f) {
+            fprintf(stderr, "%s: cannot decode\n", in);
+            failures++;
+            continue;
+        }
+        long written = f ? frame_save(f, out, comp) : -1;
+        size_t raw = f ? f->size : 0;
+        frame_free(f);
+        if (written < 0) {
+            fprintf(stderr, "%s: cannot write %s\n", in, out);
+            failures++;
+            continue;
+        }
+
+        double t0 = now_sec();
+        Frame *back = frame_load(out);
+        double load_ms = (now_sec() - t0) * 1000.0;
+        if (!back) {
+            fprintf(stderr, "%s: compiled frame does not load back\n", out);
+            failures++;
+            continue;
+        }
+        frame_free(back);
+
+        long src_kb = (file_size(in) + 1023) / 1024;
+        long out_kb = (written + 1023) / 1024;
+        int heavy = (warn_kb > 0 && out_kb > warn_kb) || (warn_ms > 0.0 && load_ms > warn_ms);
+        if (heavy) heavy_count++;
+
+        printf("%-20s %8ld %8.2f %8ld %8zu %8.2f%s\n",
+               base, src_kb, jpeg_ms, out_kb, (raw + 1023) / 1024, load_ms, heavy ? "  HEAVY" : "");
+        if (csv)
+            fprintf(csv, "%s,%ld,%.3f,%ld,%zu,%.3f,%d\n",
+                    base, src_kb, jpeg_ms, out_kb, (raw + 1023) / 1024, load_ms, heavy);
+    }
+
+    if (csv) fclose(csv);
+    fflush(stdout);
+    if (heavy_count) fprintf(stderr, "%d heavy asset(s)\n", heavy_count);
+
+    if (failures) return 1;
+    return heavy_count ? 2 : 0;
+}
@@ -0,0 +1,139 @@
+/*********************************************************************
+ * SNACK DISPENSER - UI STATE MACHINE CHECKER
+ * * DESCRIPTION:
+ * Offline analysis of the transition table in ui_fsm.h. Needs no
+ * hardware and no vendor library, so it can run on any build host.
+ * * CHECKS (errors, exit status 1):
+ * - duplicate (state, event) rows
+ * - missing transitions: every state must handle the three key events
+ *   and the non-key events its state row declares as expected
+ * - unreachable states (from ST_MENU, following the target sets)
+ * - states that can never get back to ST_MENU
+ * * WARNINGS:
+ * - rows for non-key events a state does not declare as expected
+ * * USAGE:
+ * fsm_check [-g]      (-g also prints the graph in Graphviz dot format)
+ *********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../ui_fsm.h"
+
+typedef struct {
+    const char *name;
+    unsigned expected;
+} StateInfo;
+
+typedef struct {
+    int state;
+    int event;
+    const char *action;
+    unsigned targets;
+} Row;
+
+static const StateInfo states[ST_COUNT] = {
+#define STATE_INFO(s, entry, exit, expected) [s] = { #s, (expected) },
+    UI_STATES(STATE_INFO)
+#undef STATE_INFO
+};
+
+static const char *const events[EV_COUNT] = {
+#define EVENT_NAME(e) [e] = #e,
+    UI_EVENTS(EVENT_NAME)
+#undef EVENT_NAME
+};
+
+static const Row rows[] = {
+#define ROW(s, e, act, targets) { s, e, #act, (targets) },
+    UI_TRANSITIONS(ROW)
+#undef ROW
+};
+#define NROWS ((int)(sizeof(rows) / sizeof(rows[0])))
+
+/* BFS over the target sets; forward from `from`, or backwards when reverse. */
+static unsigned reach(int from, int reverse)
+{
+    unsigned seen = STB(from);
+    int queue[ST_COUNT], head = 0, tail = 0;
+    queue[tail++] = from;
+
+    while (head < tail) {
+        int s = queue[head++];
+        for (int i = 0; i < NROWS; i++) {
+            for (int t = 0; t < ST_COUNT; t++) {
+                if (!(rows[i].targets & STB(t))) continue;
+                int src = reverse ? t : rows[i].state;
+                int dst = reverse ? rows[i].state : t;
+                if (src != s || (seen & STB(dst))) continue;
+                seen |= STB(dst);
+                queue[tail++] = dst;
+            }
+        }
+    }
+    return seen;
+}
+
+static void print_dot(void)
+{
+    printf("digraph ui {\n    rankdir=LR;\n");
+    for (int i = 0; i < NROWS; i++) {
+        for (int t = 0; t < ST_COUNT; t++) {
+            if (!(rows[i].targets & STB(t))) continue;
+            printf("    %s -> %s [label=\"%s\"];\n",
+                   states[rows[i].state].name, states[t].name, events[rows[i].event]);
+        }
+    }
+    printf("}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int errors = 0, warnings = 0;
+    int cell[ST_COUNT][EV_COUNT];
+    memset(cell, 0, sizeof(cell));
+
+    for (int i = 0; i < NROWS; i++) {
+        const Row *r = &rows[i];
+        if (++cell[r->state][r->event] > 1) {
+            printf("error: duplicate row %s x %s (%s)\n", states[r->state].name, events[r->event], r->action);
+            errors++;
+        }
+        if (r->targets & ~((1u << ST_COUNT) - 1)) {
+            printf("error: %s x %s targets an unknown state\n", states[r->state].name, events[r->event]);
+            errors++;
+        }
+    }
+
+    for (int s = 0; s < ST_COUNT; s++) {
+        unsigned need = EV_KEYS | states[s].expected;
+        for (int e = 0; e < EV_COUNT; e++) {
+            if ((need & EVB(e)) && !cell[s][e]) {
+                printf("error: missing transition %s x %s\n", states[s].name, events[e]);
+                errors++;
+            } else if (!(need & EVB(e)) && cell[s][e]) {
+                printf("warning: %s handles %s but does not expect it\n", states[s].name, events[e]);
+                warnings++;
+            }
+        }
+    }
+
+    unsigned fwd = reach(ST_MENU, 0);
+    unsigned back = reach(ST_MENU, 1);
+    for (int s = 0; s < ST_COUNT; s++) {
+        if (!(fwd & STB(s))) {
+            printf("error: %s is unreachable from ST_MENU\n", states[s].name);
+            errors++;
+        }
+        if (!(back & STB(s))) {
+            printf("error: %s can never return to ST_MENU\n", states[s].name);
+            errors++;
+        }
+    }
+
+    printf("%d states, %d events, %d transitions: %d error(s), %d warning(s)\n",
+           ST_COUNT, EV_COUNT, NROWS, errors, warnings);
+
+    if (argc > 1 && strcmp(argv[1], "-g") == 0) print_dot();
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,132 @@
+/*********************************************************************
+ * SNACK DISPENSER - SLOT LOOKUP BENCHMARK
+ * * DESCRIPTION:
+ * Times selection-number lookups (what ENTER does in the normal and
+ * service screens) with the linear item scan the dispenser used to do
+ * and with slot_index.h, for catalogues of 4 to 10000 items. Needs no
+ * hardware and no vendor library.
+ * * LAYOUTS:
+ * - seq:    1..n
+ * - tray:   cabinet numbering, tray * 100 + 1..SLOTS_PER_TRAY
+ * - random: scattered numbers up to 9999999 (the 7-digit input limit),
+ *           which takes the hash path
+ * Every third lookup is for a number that is not in the catalogue.
+ * * USAGE:
+ * slot_bench [-n lookups]     (default 2000000 per size and layout)
+ *********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../slot_index.h"
+
+#define SLOTS_PER_TRAY 12
+#define N_QUERIES      4096     /* power of two */
+
+typedef struct {
+    int index;
+    const char *name;
+    int price;             /* cents */
+    int stock;
+} Item;
+
+static unsigned rng = 12345;
+
+static unsigned rnd(void)
+{
+    rng = rng * 1103515245u + 12345u;
+    return rng >> 8;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int linear_find(const Item *items, int n, int idx)
+{
+    for (int i = 0; i < n; i++) if (items[i].index == idx) return i;
+    return -1;
+}
+
+static int in_catalogue(const Item *items, int n, int idx)
+{
+    return linear_find(items, n, idx) >= 0;
+}
+
+static void fill(Item *items, int n, const char *layout)
+{
+    for (int i = 0; i < n; i++) {
+        int k;
+        if (!strcmp(layout, "seq")) {
+            k = i + 1;
+        } else if (!strcmp(layout, "tray")) {
+            k = (i / SLOTS_PER_TRAY + 1) * 100 + i % SLOTS_PER_TRAY + 1;
+        } else {
+            do k = (int)(rnd() % 9999999u) + 1; while (in_catalogue(items, i, k));
+        }
+        items[i] = (Item){ k, "item", 150, 5 };
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 4, 16, 64, 200, 1000, 10000 };
+    static const char *layouts[] = { "seq", "tray", "random" };
+    long lookups = 2000000;
+
+    if (argc == 3 && !strcmp(argv[1], "-n")) lookups = atol(argv[2]);
+    else if (argc != 1) {
+        fprintf(stderr, "usage: slot_bench [-n lookups]\n");
+        return 2;
+    }
+
+    printf("%-7s %6s %6s %10s %10s %9s\n", "layout", "items", "kind", "scan ns", "index ns", "speedup");
+    for (int l = 0; l < 3; l++) {
+        for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+            int n = sizes[s];
+            Item *items = malloc((size_t)n * sizeof(*items));
+            int *q = malloc(N_QUERIES * sizeof(*q));
+            SlotIndex ix;
+            if (!items || !q) return 1;
+
+            fill(items, n, layouts[l]);
+            if (slot_index_build(&ix, &items[0].index, n, sizeof(Item)) < 0) return 1;
+            for (int i = 0; i < N_QUERIES; i++) {
+                if (i % 3 == 2) {
+                    do q[i] = (int)(rnd() % 9999999u) + 1; while (in_catalogue(items, n, q[i]));
+                } else {
+                    q[i] = items[rnd() % (unsigned)n].index;
+                }
+                if (slot_index_find(&ix, q[i]) != linear_find(items, n, q[i])) {
+                    fprintf(stderr, "%s/%d: index disagrees on %d\n", layouts[l], n, q[i]);
+                    return 1;
+                }
+            }
+
+            long reps = lookups;
+            if (n >= 1000) reps = lookups / (n / 100);   /* the scan gets slow */
+            volatile int sink = 0;
+
+            double t0 = now_ns();
+            for (long i = 0; i < reps; i++) sink += linear_find(items, n, q[i & (N_QUERIES - 1)]);
+            double scan = (now_ns() - t0) / (double)reps;
+
+            t0 = now_ns();
+            for (long i = 0; i < lookups; i++) sink += slot_index_find(&ix, q[i & (N_QUERIES - 1)]);
+            double idx = (now_ns() - t0) / (double)lookups;
+            (void)sink;
+
+            printf("%-7s %6d %6s %10.1f %10.1f %8.0fx\n", layouts[l], n, ix.dense ? "dense" : "hash",
+                   scan, idx, idx > 0 ? scan / idx : 0.0);
+            slot_index_free(&ix);
+            free(items);
+            free(q);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,373 @@
+/*********************************************************************
+ * SNACK DISPENSER - PORT TRACE TOOL
+ * * DESCRIPTION:
+ * Offline reader for the .snkt port traces written with SNACK_TRACE
+ * (trace.h), and the driver for record/replay regression runs: the
+ * keypad input of a baseline trace is fed back into a new build
+ * (SNACK_REPLAY) and the output timelines of both runs are compared.
+ * * STREAMS (compared by diff):
+ * - lcd:   HD44780 bytes (instructions and data) on the LCD ports
+ * - motor: stepper phase changes on the SM ports
+ * - 7seg:  LED port changes
+ * - dac:   DAC level changes (the buzzer/audio waveform)
+ * lcd, motor and 7seg must carry the same values in the same order; the
+ * DAC must play the same tones (levels, half-period, edge count and
+ * length). Timing is compared per burst (events less than -g ms apart)
+ * of at least MIN_TIMED intervals: a burst regresses when its median
+ * interval (a tone's half-period) is off by more than -t us AND by more
+ * than -p percent. The median keeps single scheduling hiccups of the
+ * host out, which shorter bursts have too few intervals to do. A tone
+ * also regresses when both its edge count (by more than EDGE_SLACK) and
+ * its length (by more than -t us) are off by more than TONE_PCT percent,
+ * as a stall costs a tone edges or length but not both. Gaps between
+ * bursts follow the user's key timing and the scan period, so they are
+ * not timed.
+ * * USAGE:
+ * trace_tool info  t.snkt
+ * trace_tool keys  t.snkt
+ * trace_tool dump  t.snkt
+ * trace_tool diff  [-t us] [-p pct] [-g ms] base.snkt new.snkt
+ * trace_tool replay [-t us] [-p pct] [-g ms] [-m ms] base.snkt new.snkt -- ./snack_dispenser
+ * diff and replay exit with status 1 on a regression.
+ *********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../trace.h"
+
+/* Port map of snack_dispenser.c (normal and admin boards). */
+static const unsigned char lcd_ports[] = { 0x3B, 0x1B };
+static const unsigned char sm_ports[]  = { 0x39, 0x19 };
+static const unsigned char led_ports[] = { 0x3A, 0x1A };
+static const unsigned char kbd_ports[] = { 0x3C, 0x1C };
+
+static const char *key_names = "0123456789AB";
+
+typedef struct {
+    long long tol_ns;
+    double pct;
+    long long gap_ns;
+} DiffOpts;
+
+enum { S_LCD, S_MOTOR, S_SEG, S_DAC, S_COUNT };
+static const char *stream_names[S_COUNT] = { "lcd", "motor", "7seg", "dac" };
+
+static int stream_events(const Trace *t, int s, TraceEvent **ev)
+{
+    switch (s) {
+    case S_LCD:   return trace_lcd_bytes(t, lcd_ports, 2, ev);
+    case S_MOTOR: return trace_port_events(t, TRACE_OUT, sm_ports, 2, 1, ev);
+    case S_SEG:   return trace_port_events(t, TRACE_OUT, led_ports, 2, 1, ev);
+    default:      break;
+    }
+
+    /* the channels are written together: keep the level changes of the pair */
+    int n = trace_port_events(t, TRACE_DAC, NULL, 0, 1, ev), k = 0;
+    for (int i = 0; i < n; i++)
+        if (k == 0 || (*ev)[i].value != (*ev)[k - 1].value) (*ev)[k++] = (*ev)[i];
+    return n < 0 ? n : k;
+}
+
+/* Keypad scan code -> key label (ScanTable in snack_dispenser.c). */
+static char key_label(unsigned char code)
+{
+    static const unsigned char codes[12] = { 0xB7, 0x7E, 0xBE, 0xDE, 0x7D, 0xBD,
+                                             0xDD, 0x7B, 0xBB, 0xDB, 0x77, 0xD7 };
+    for (int i = 0; i < 12; i++)
+        if (codes[i] == code) return key_names[i];
+    return '?';
+}
+
+static Trace *load_or_die(const char *path)
+{
+    Trace *t = trace_load(path);
+    if (!t) {
+        fprintf(stderr, "trace_tool: cannot read %s\n", path);
+        exit(2);
+    }
+    return t;
+}
+
+/* ===== info / keys / dump ===== */
+static int cmd_info(const char *path)
+{
+    Trace *t = load_or_die(path);
+    unsigned long ops[4] = { 0 };
+    for (int i = 0; i < t->n; i++)
+        if (t->recs[i].op < 4) ops[t->recs[i].op]++;
+
+    FILE *fp = fopen(path, "rb");
+    long size = 0;
+    if (fp) { fseek(fp, 0, SEEK_END); size = ftell(fp); fclose(fp); }
+
+    printf("%s: %d records, %ld bytes (%.1f B/record), %.3f s\n", path, t->n, size,
+           t->n ? (double)(size - SNKT_HEADER_SIZE) / t->n : 0.0, trace_duration(t) / 1e9);
+    printf("  out %lu  in %lu  dac %lu\n", ops[TRACE_OUT], ops[TRACE_IN], ops[TRACE_DAC]);
+    for (int s = 0; s < S_COUNT; s++) {
+        TraceEvent *ev;
+        int n = stream_events(t, s, &ev);
+        printf("  %-5s %d events\n", stream_names[s], n);
+        free(ev);
+    }
+    trace_free(t);
+    return 0;
+}
+
+static int cmd_keys(const char *path)
+{
+    Trace *t = load_or_die(path);
+    TraceKey *k;
+    int n = trace_keys(t, kbd_ports, 2, &k);
+    for (int i = 0; i < n; i++)
+        printf("%10.3f ms  %c  (0x%02X)  held %.1f ms\n", k[i].from_ns / 1e6, key_label(k[i].code),
+               k[i].code, (k[i].to_ns - k[i].from_ns) / 1e6);
+    free(k);
+    trace_free(t);
+    return n < 0;
+}
+
+static int cmd_dump(const char *path)
+{
+    static const char *ops[4] = { "?", "out", "in", "dac" };
+    Trace *t = load_or_die(path);
+    for (int i = 0; i < t->n; i++) {
+        const TraceRec *r = &t->recs[i];
+        printf("%14.3f us  %-3s 0x%02X 0x%02X\n", r->t_ns / 1e3, ops[r->op < 4 ? r->op : 0], r->port, r->value);
+    }
+    trace_free(t);
+    return 0;
+}
+
+/* ===== diff ===== */
+#define MIN_TIMED  4                   /* intervals a burst needs to be timed */
+#define EDGE_SLACK 4                   /* edges a tone may gain or lose ... */
+#define TONE_PCT   25                  /* ... and percent of its edges or length */
+
+typedef struct {
+    int from, to;                      /* event indices, inclusive */
+    long long median_ns;               /* median interval inside the burst */
+    long long span_ns;
+    int lo, hi;                        /* value range */
+} Burst;
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void burst_stats(const TraceEvent *ev, Burst *b)
+{
+    int n = b->to - b->from;
+    long long iv[n > 0 ? n : 1];
+    b->lo = b->hi = ev[b->from].value;
+    for (int i = b->from + 1; i <= b->to; i++) {
+        iv[i - b->from - 1] = ev[i].t_ns - ev[i - 1].t_ns;
+        if (ev[i].value < b->lo) b->lo = ev[i].value;
+        if (ev[i].value > b->hi) b->hi = ev[i].value;
+    }
+    qsort(iv, (size_t)n, sizeof(iv[0]), cmp_ll);
+    b->median_ns = n ? iv[n / 2] : 0;
+    b->span_ns = ev[b->to].t_ns - ev[b->from].t_ns;
+}
+
+/* Split at gaps of gap_ns or more; with `like`, at the same indices as that burst list. */
+static int bursts(const TraceEvent *ev, int n, long long gap_ns, const Burst *like, int nlike, Burst **out)
+{
+    Burst *b = malloc((size_t)(n > 0 ? n : 1) * sizeof(*b));
+    int nb = 0;
+    if (!b) return -1;
+    if (like) {
+        for (int i = 0; i < nlike && like[i].from < n; i++) {
+            b[nb] = (Burst){ like[i].from, like[i].to < n ? like[i].to : n - 1, 0, 0, 0, 0 };
+            burst_stats(ev, &b[nb++]);
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            if (i == 0 || ev[i].t_ns - ev[i - 1].t_ns >= gap_ns) b[nb++] = (Burst){ i, i, 0, 0, 0, 0 };
+            else b[nb - 1].to = i;
+        }
+        for (int i = 0; i < nb; i++) burst_stats(ev, &b[i]);
+    }
+    *out = b;
+    return nb;
+}
+
+static int off(long long a, long long b, const DiffOpts *o)
+{
+    long long d = b > a ? b - a : a - b;
+    return d > o->tol_ns && d * 100.0 > o->pct * (double)a;
+}
+
+/* A tone plays until its duration is up: a host stall inside it costs
+ * edges but not length, one at its end adds length but not edges. Only
+ * both together mean a different tone. */
+static int tone_off(const Burst *x, const Burst *y, const DiffOpts *o)
+{
+    int ex = x->to - x->from + 1, ey = y->to - y->from + 1;
+    int de = ey > ex ? ey - ex : ex - ey;
+    long long dl = y->span_ns > x->span_ns ? y->span_ns - x->span_ns : x->span_ns - y->span_ns;
+    return de > EDGE_SLACK && de * 100 > TONE_PCT * ex &&
+           dl > o->tol_ns && dl * 100.0 > TONE_PCT * (double)x->span_ns;
+}
+
+/* lcd, motor, 7seg: identical values in order; DAC: the same tones (levels,
+ * half-period, edge count). */
+static int diff_stream(int s, const TraceEvent *a, int na, const TraceEvent *b, int nb, const DiffOpts *o)
+{
+    int wave = s == S_DAC;
+    int first_bad = -1, regressions = 0, timed = 0;
+    Burst *ba, *bb;
+    int nba = bursts(a, na, o->gap_ns, NULL, 0, &ba);
+    int nbb = wave ? bursts(b, nb, o->gap_ns, NULL, 0, &bb) : bursts(b, nb, 0, ba, nba, &bb);
+    if (nba < 0 || nbb < 0) {
+        fprintf(stderr, "trace_tool: out of memory\n");
+        exit(2);
+    }
+
+    if (!wave) {
+        int m = na < nb ? na : nb;
+        for (int i = 0; i < m && first_bad < 0; i++)
+            if (a[i].value != b[i].value || a[i].kind != b[i].kind) first_bad = i;
+    }
+    int content = wave ? nba == nbb : first_bad < 0 && na == nb;
+    long long worst = 0;
+
+    for (int i = 0; i < nba && i < nbb; i++) {
+        const Burst *x = &ba[i], *y = &bb[i];
+        if (!wave && first_bad >= 0 && y->to >= first_bad) break;
+        if (wave && (x->lo != y->lo || x->hi != y->hi)) {
+            if (content)
+                printf("  %-5s tone %d at %.3f ms: levels %d..%d -> %d..%d\n", stream_names[s], i,
+                       a[x->from].t_ns / 1e6, x->lo, x->hi, y->lo, y->hi);
+            content = 0;
+            continue;
+        }
+        if (wave && tone_off(x, y, o)) {
+            if (regressions < 5)
+                printf("  %-5s tone %d at %.3f ms: %d -> %d edges, length %.3f -> %.3f ms\n", stream_names[s], i,
+                       a[x->from].t_ns / 1e6, x->to - x->from + 1, y->to - y->from + 1, x->span_ns / 1e6,
+                       y->span_ns / 1e6);
+            regressions++;
+        }
+        if (x->to - x->from < MIN_TIMED || y->to - y->from < MIN_TIMED) continue;
+        timed++;
+        long long d = y->median_ns - x->median_ns;
+        if ((d < 0 ? -d : d) > (worst < 0 ? -worst : worst)) worst = d;
+        if (off(x->median_ns, y->median_ns, o)) {
+            if (regressions < 5)
+                printf("  %-5s burst %d at %.3f ms (%d events): interval %.1f -> %.1f us, length %.3f -> %.3f ms\n",
+                       stream_names[s], i, a[x->from].t_ns / 1e6, x->to - x->from + 1, x->median_ns / 1e3,
+                       y->median_ns / 1e3, x->span_ns / 1e6, y->span_ns / 1e6);
+            regressions++;
+        }
+    }
+
+    printf("%-5s %6d / %-6d %s  %4d bursts timed, worst median %+8.1f us, %d off\n", stream_names[s], na, nb,
+           content ? "same" : "DIFF", timed, worst / 1e3, regressions);
+    if (first_bad >= 0)
+        printf("  %-5s first difference at #%d (%.3f ms): 0x%02X -> 0x%02X\n", stream_names[s], first_bad,
+               a[first_bad].t_ns / 1e6, a[first_bad].value, b[first_bad].value);
+    else if (!content && !wave)
+        printf("  %-5s %d events %s after #%d\n", stream_names[s], na > nb ? na - nb : nb - na,
+               na > nb ? "missing" : "extra", na < nb ? na : nb);
+    else if (nba != nbb)
+        printf("  %-5s %d tones -> %d\n", stream_names[s], nba, nbb);
+
+    free(ba);
+    free(bb);
+    return !content || regressions > 0;
+}
+
+static int cmd_diff(const char *base, const char *cur, const DiffOpts *o)
+{
+    Trace *ta = load_or_die(base), *tb = load_or_die(cur);
+    int bad = 0;
+
+    printf("stream  base / new    content\n");
+    for (int s = 0; s < S_COUNT; s++) {
+        TraceEvent *a, *b;
+        int na = stream_events(ta, s, &a), nb = stream_events(tb, s, &b);
+        if (na < 0 || nb < 0) {
+            fprintf(stderr, "trace_tool: out of memory\n");
+            exit(2);
+        }
+        bad |= diff_stream(s, a, na, b, nb, o);
+        free(a);
+        free(b);
+    }
+    printf("%s\n", bad ? "REGRESSION" : "ok");
+    trace_free(ta);
+    trace_free(tb);
+    return bad;
+}
+
+/* ===== replay ===== */
+static int cmd_replay(const char *base, const char *cur, char **argv, long margin_ms, const DiffOpts *o)
+{
+    Trace *t = load_or_die(base);
+    long long run_ns = trace_duration(t) + margin_ms * 1000000LL;
+    trace_free(t);
+
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return 2; }
+    if (pid == 0) {
+        setenv("SNACK_REPLAY", base, 1);
+        setenv("SNACK_TRACE", cur, 1);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    struct timespec ts = { (time_t)(run_ns / 1000000000LL), (long)(run_ns % 1000000000LL) };
+    while (nanosleep(&ts, &ts) != 0) {}
+    kill(pid, SIGTERM);
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) return 2;
+
+    return cmd_diff(base, cur, o);
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "usage: trace_tool info|keys|dump t.snkt\n"
+                    "       trace_tool diff [-t us] [-p pct] [-g ms] base.snkt new.snkt\n"
+                    "       trace_tool replay [-t us] [-p pct] [-g ms] [-m ms] base.snkt new.snkt -- cmd...\n");
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    DiffOpts o = { 200000, 10.0, 20000000 };
+    long margin_ms = 2000;
+
+    if (argc < 3) return usage();
+    const char *cmd = argv[1];
+    if (!strcmp(cmd, "info")) return cmd_info(argv[2]);
+    if (!strcmp(cmd, "keys")) return cmd_keys(argv[2]);
+    if (!strcmp(cmd, "dump")) return cmd_dump(argv[2]);
+    if (strcmp(cmd, "diff") != 0 && strcmp(cmd, "replay") != 0) return usage();
+
+    int i = 2;
+    for (; i + 1 < argc && argv[i][0] == '-' && argv[i][1] && !argv[i][2]; i += 2) {
+        switch (argv[i][1]) {
+        case 't': o.tol_ns = atoll(argv[i + 1]) * 1000; break;
+        case 'p': o.pct = atof(argv[i + 1]); break;
+        case 'g': o.gap_ns = atoll(argv[i + 1]) * 1000000; break;
+        case 'm': margin_ms = atol(argv[i + 1]); break;
+        default:  return usage();
+        }
+    }
+    if (argc - i < 2) return usage();
+    if (!strcmp(cmd, "diff")) return cmd_diff(argv[i], argv[i + 1], &o);
+
+    if (argc - i < 4 || strcmp(argv[i + 2], "--") != 0) return usage();
+    return cmd_replay(argv[i], argv[i + 1], argv + i + 3, margin_ms, &o);
+}
@@ -0,0 +1,276 @@
+/*********************************************************************
+ * SNACK DISPENSER - PORT I/O TRACES
+ * * Writer, loader and output-timeline decoders for the .snkt port
+ * trace format (see trace.h).
+ *********************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void put_u16(unsigned char *p, unsigned v)
+{
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static unsigned get_u16(const unsigned char *p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8);
+}
+
+/* ===== Writer ===== */
+TraceWriter *trace_create(const char *path, long long start_ns)
+{
+    TraceWriter *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    w->fp = fopen(path, "wb");
+    if (!w->fp) { free(w); return NULL; }
+    setvbuf(w->fp, NULL, _IOFBF, 1 << 16);
+
+    unsigned char h[SNKT_HEADER_SIZE];
+    memset(h, 0, sizeof(h));
+    memcpy(h, SNKT_MAGIC, 4);
+    put_u16(h + 4, SNKT_VERSION);
+    for (int i = 0; i < 8; i++) h[8 + i] = (unsigned char)((uint64_t)start_ns >> (8 * i));
+    fwrite(h, 1, sizeof(h), w->fp);
+
+    w->start_ns = start_ns;
+    w->last_ns = start_ns;
+    w->bytes = SNKT_HEADER_SIZE;
+    return w;
+}
+
+void trace_put(TraceWriter *w, int op, unsigned char port, unsigned char value, long long t_ns)
+{
+    unsigned char rec[3 + 10];
+    int n = 0;
+    uint64_t dt = t_ns > w->last_ns ? (uint64_t)(t_ns - w->last_ns) : 0;
+    if (t_ns > w->last_ns) w->last_ns = t_ns;
+
+    rec[n++] = (unsigned char)op;
+    rec[n++] = port;
+    rec[n++] = value;
+    do {
+        unsigned char b = dt & 0x7F;
+        dt >>= 7;
+        rec[n++] = dt ? (unsigned char)(b | 0x80) : b;
+    } while (dt);
+
+    fwrite(rec, 1, (size_t)n, w->fp);
+    w->records++;
+    w->bytes += (unsigned long)n;
+}
+
+int trace_close(TraceWriter *w)
+{
+    if (!w) return 0;
+    int rc = fclose(w->fp) == 0 ? 0 : -1;
+    free(w);
+    return rc;
+}
+
+/* ===== Loader ===== */
+Trace *trace_load(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    unsigned char h[SNKT_HEADER_SIZE];
+    if (fread(h, 1, sizeof(h), fp) != sizeof(h) || memcmp(h, SNKT_MAGIC, 4) != 0 ||
+        get_u16(h + 4) != SNKT_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+
+    Trace *t = calloc(1, sizeof(*t));
+    if (!t) { fclose(fp); return NULL; }
+    for (int i = 0; i < 8; i++) t->start_ns |= (long long)((uint64_t)h[8 + i] << (8 * i));
+
+    int cap = 0;
+    long long now = 0;
+    unsigned char rec[3];
+    while (fread(rec, 1, 3, fp) == 3) {
+        uint64_t dt = 0;
+        int shift = 0, c;
+        while ((c = fgetc(fp)) != EOF) {
+            dt |= (uint64_t)(c & 0x7F) << shift;
+            shift += 7;
+            if (!(c & 0x80) || shift > 63) break;
+        }
+        if (c == EOF) break;           /* truncated last record */
+
+        if (t->n == cap) {
+            cap = cap ? cap * 2 : 4096;
+            TraceRec *r = realloc(t->recs, (size_t)cap * sizeof(*r));
+            if (!r) { fclose(fp); trace_free(t); return NULL; }
+            t->recs = r;
+        }
+        now += (long long)dt;
+        t->recs[t->n++] = (TraceRec){ now, rec[0], rec[1], rec[2] };
+    }
+    fclose(fp);
+    return t;
+}
+
+void trace_free(Trace *t)
+{
+    if (!t) return;
+    free(t->recs);
+    free(t);
+}
+
+long long trace_duration(const Trace *t)
+{
+    return t->n ? t->recs[t->n - 1].t_ns : 0;
+}
+
+/* ===== Decoders ===== */
+static int on_port(unsigned char port, const unsigned char *ports, int nports)
+{
+    if (nports == 0) return 1;
+    for (int i = 0; i < nports; i++)
+        if (ports[i] == port) return 1;
+    return 0;
+}
+
+/* Growable event list; returns -1 when out of memory. */
+static int ev_push(TraceEvent **ev, int *n, int *cap, long long t, int value, int kind)
+{
+    if (*n == *cap) {
+        int c = *cap ? *cap * 2 : 256;
+        TraceEvent *e = realloc(*ev, (size_t)c * sizeof(*e));
+        if (!e) return -1;
+        *ev = e;
+        *cap = c;
+    }
+    (*ev)[(*n)++] = (TraceEvent){ t, value, kind };
+    return 0;
+}
+
+int trace_keys(const Trace *t, const unsigned char *ports, int nports, TraceKey **out)
+{
+    static const unsigned char row_lo[4] = { 0x70, 0xB0, 0xD0, 0xE0 };
+    long long since[256];
+    unsigned char drive = 0xFF;
+    TraceKey *keys = NULL;
+    int n = 0, cap = 0;
+
+    for (int i = 0; i < 256; i++) since[i] = -1;
+
+    for (int r = 0; r <= t->n; r++) {
+        const TraceRec *rec = r < t->n ? &t->recs[r] : NULL;
+        long long now = rec ? rec->t_ns : trace_duration(t);
+        int col = -1, all = 0;
+        unsigned char rows = 0xF0;
+
+        if (rec) {
+            if (!on_port(rec->port, ports, nports)) continue;
+            if (rec->op == TRACE_OUT) { drive = rec->value; continue; }
+            if (rec->op != TRACE_IN) continue;
+            unsigned char c = drive & 0x0F;
+            if (c == 0x07 || c == 0x0B || c == 0x0D || c == 0x0E) col = c;
+            else if (c == 0x00) all = 1;
+            rows = rec->value & 0xF0;
+            if (col < 0 && !all) continue;
+        } else {
+            all = 1;                   /* end of trace: release everything */
+        }
+
+        for (int code = 0; code < 256; code++) {
+            if (since[code] < 0) continue;
+            int released;
+            if (all) released = (rows == 0xF0);
+            else if ((code & 0x0F) != col) continue;
+            else released = (rows & ~code & 0xF0) != 0;
+            if (!released) continue;
+
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                TraceKey *k = realloc(keys, (size_t)cap * sizeof(*k));
+                if (!k) { free(keys); return -1; }
+                keys = k;
+            }
+            keys[n++] = (TraceKey){ (unsigned char)code, since[code], now };
+            since[code] = -1;
+        }
+
+        /* a press starts when its row reads low while its column is driven */
+        for (int i = 0; col >= 0 && i < 4; i++) {
+            int code = row_lo[i] | col;
+            if (since[code] < 0 && !(rows & ~row_lo[i] & 0xF0)) since[code] = now;
+        }
+    }
+
+    /* presses in start order */
+    for (int i = 1; i < n; i++) {
+        TraceKey k = keys[i];
+        int j = i - 1;
+        while (j >= 0 && keys[j].from_ns > k.from_ns) { keys[j + 1] = keys[j]; j--; }
+        keys[j + 1] = k;
+    }
+    *out = keys;
+    return n;
+}
+
+int trace_lcd_bytes(const Trace *t, const unsigned char *ports, int nports, TraceEvent **out)
+{
+    TraceEvent *ev = NULL;
+    int n = 0, cap = 0;
+    int bus8 = 1, have_hi = 0;
+    unsigned char last = 0, hi = 0;
+
+    for (int r = 0; r < t->n; r++) {
+        const TraceRec *rec = &t->recs[r];
+        if (rec->op != TRACE_OUT || !on_port(rec->port, ports, nports)) continue;
+
+        int falling = (last & 0x04) && !(rec->value & 0x04);
+        unsigned char bus = last;
+        last = rec->value;
+        if (!falling) continue;
+
+        unsigned char nib = bus & 0xF0;
+        int rs = bus & 0x01;
+        unsigned char v;
+        if (bus8) {
+            v = nib;
+        } else if (!have_hi) {
+            hi = nib;
+            have_hi = 1;
+            continue;
+        } else {
+            v = (unsigned char)(hi | (nib >> 4));
+            have_hi = 0;
+        }
+        if (!rs && (v & 0xE0) == 0x20) {
+            bus8 = (v & 0x10) != 0;
+            have_hi = 0;
+        }
+        if (ev_push(&ev, &n, &cap, rec->t_ns, v, rs) < 0) { free(ev); return -1; }
+    }
+    *out = ev;
+    return n;
+}
+
+int trace_port_events(const Trace *t, int op, const unsigned char *ports, int nports,
+                      int changes_only, TraceEvent **out)
+{
+    TraceEvent *ev = NULL;
+    int n = 0, cap = 0;
+    int last[256];
+
+    for (int i = 0; i < 256; i++) last[i] = -1;
+
+    for (int r = 0; r < t->n; r++) {
+        const TraceRec *rec = &t->recs[r];
+        if (rec->op != op || !on_port(rec->port, ports, nports)) continue;
+        if (changes_only && last[rec->port] == rec->value) continue;
+        last[rec->port] = rec->value;
+        if (ev_push(&ev, &n, &cap, rec->t_ns, rec->value, rec->port) < 0) { free(ev); return -1; }
+    }
+    *out = ev;
+    return n;
+}
@@ -0,0 +1,90 @@
+/*********************************************************************
+ * SNACK DISPENSER - PORT I/O TRACES
+ * * DESCRIPTION:
+ * Compact binary log of every port access (CM3_outport, CM3_inport,
+ * CM3PortWrite) with nanosecond timing, shared by the dispenser's
+ * recording/replay port layer (SNACK_TRACE, SNACK_REPLAY) and the
+ * offline tools/trace_tool.c.
+ * * FILE LAYOUT (.snkt, little-endian):
+ * - 0  magic "SNKT"
+ * - 4  u16 version, u16 reserved
+ * - 8  u64 start time (CLOCK_MONOTONIC ns, informational)
+ * - 16 records: u8 op, u8 port (DAC: channel), u8 value,
+ *      then the time since the previous record in ns as a LEB128
+ *      varint (first record: since start)
+ * A record is 4-6 bytes at typical port rates.
+ *********************************************************************/
+
+#ifndef SNACK_TRACE_H
+#define SNACK_TRACE_H
+
+#include <stdio.h>
+
+#define SNKT_MAGIC       "SNKT"
+#define SNKT_VERSION     1
+#define SNKT_HEADER_SIZE 16
+#define SNKT_EXT         ".snkt"
+
+enum {
+    TRACE_OUT = 1,         /* CM3_outport(port, value) */
+    TRACE_IN  = 2,         /* value = CM3_inport(port) */
+    TRACE_DAC = 3          /* CM3PortWrite(port, value) */
+};
+
+typedef struct {
+    FILE *fp;
+    long long start_ns;
+    long long last_ns;
+    unsigned long records;
+    unsigned long bytes;
+} TraceWriter;
+
+typedef struct {
+    long long t_ns;        /* since start */
+    unsigned char op;
+    unsigned char port;
+    unsigned char value;
+} TraceRec;
+
+typedef struct {
+    long long start_ns;
+    int n;
+    TraceRec *recs;
+} Trace;
+
+/* A decoded output event: an LCD byte, a motor phase, a DAC level, ... */
+typedef struct {
+    long long t_ns;
+    int value;
+    int kind;              /* LCD: 1 = data (RS), 0 = instruction; else the port */
+} TraceEvent;
+
+/* One key press recovered from the keypad scans, by matrix scan code. */
+typedef struct {
+    unsigned char code;    /* row bits | column nibble, as read while scanned */
+    long long from_ns, to_ns;
+} TraceKey;
+
+/* Returns NULL when the file cannot be created. */
+TraceWriter *trace_create(const char *path, long long start_ns);
+void trace_put(TraceWriter *w, int op, unsigned char port, unsigned char value, long long t_ns);
+int trace_close(TraceWriter *w);
+
+Trace *trace_load(const char *path);
+void trace_free(Trace *t);
+long long trace_duration(const Trace *t);
+
+/* The decoders below return the number of events (caller frees *out), -1 on error. */
+
+/* Keys seen by single-column scans on the given keypad ports. */
+int trace_keys(const Trace *t, const unsigned char *ports, int nports, TraceKey **out);
+
+/* HD44780 transfers (E = 0x04, RS = 0x01, D7..D4 = high nibble), 8/4-bit mode tracked. */
+int trace_lcd_bytes(const Trace *t, const unsigned char *ports, int nports, TraceEvent **out);
+
+/* Records of one op on the given ports (all ports when nports is 0);
+ * with changes_only, only values that differ from that port's last one. */
+int trace_port_events(const Trace *t, int op, const unsigned char *ports, int nports,
+                      int changes_only, TraceEvent **out);
+
+#endif
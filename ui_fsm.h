@@ -0,0 +1,147 @@
+/*********************************************************************
+ * SNACK DISPENSER - UI STATE MACHINE TABLE
+ * * DESCRIPTION:
+ * The dispenser UI as an explicit state x event table. The lists are
+ * X-macros so the same table is bound to real actions by the app
+ * (snack_dispenser.c) and analysed offline by tools/fsm_check.c.
+ * * STATES:
+ * X(state, entry, exit, expected) - entry/exit run on every state
+ * change (including an explicit self re-entry); expected lists the
+ * non-key events the state must handle (keys are always expected).
+ * * TRANSITIONS:
+ * X(state, event, action, targets) - the action returns the next state
+ * or ST_STAY; targets is the set it may return besides ST_STAY, which
+ * the app enforces at runtime and the checker uses for reachability.
+ * A missing (state, event) cell beeps for keys and ignores the rest.
+ *********************************************************************/
+
+#ifndef SNACK_UI_FSM_H
+#define SNACK_UI_FSM_H
+
+#define STB(s) (1u << (s))
+#define EVB(e) (1u << (e))
+
+/* ===== Events ===== */
+#define UI_EVENTS(X) \
+    X(EV_DIGIT)        \
+    X(EV_BACK)         \
+    X(EV_ENTER)        \
+    X(EV_IDLE_TIMEOUT) \
+    X(EV_GATE_TIMEOUT) \
+    X(EV_ANIM_DONE)    \
+    X(EV_RUN)
+
+enum {
+#define UI_EVENT_ENUM(e) e,
+    UI_EVENTS(UI_EVENT_ENUM)
+#undef UI_EVENT_ENUM
+    EV_COUNT
+};
+
+#define EV_KEYS (EVB(EV_DIGIT) | EVB(EV_BACK) | EVB(EV_ENTER))
+
+/* ===== States ===== */
+#define UI_STATES(X) \
+    X(ST_MENU,             menu_entry,        menu_exit, EVB(EV_IDLE_TIMEOUT)) \
+    X(ST_AMOUNT,           amount_entry,      idle_exit, EVB(EV_IDLE_TIMEOUT)) \
+    X(ST_PAY,              pay_entry,         idle_exit, EVB(EV_IDLE_TIMEOUT)) \
+    X(ST_SVC_GATE,         svc_gate_entry,    gate_exit, EVB(EV_GATE_TIMEOUT)) \
+    X(ST_RETURN_GATE,      return_gate_entry, gate_exit, EVB(EV_GATE_TIMEOUT)) \
+    X(ST_DOOR_OPENING,     door_open_entry,   nop,       EVB(EV_ANIM_DONE))    \
+    X(ST_DOOR_CLOSING,     door_close_entry,  nop,       EVB(EV_ANIM_DONE))    \
+    X(ST_SVC_MENU,         svc_menu_entry,    nop,       0)                    \
+    X(ST_SVC_DISPENSE_IDX, svc_disp_idx_entry, nop,      0)                    \
+    X(ST_SVC_DISPENSE_AMT, svc_disp_amt_entry, nop,      0)                    \
+    X(ST_SVC_RESTOCK_IDX,  restock_idx_entry, nop,       0)                    \
+    X(ST_SVC_RESTOCK_QTY,  restock_qty_entry, nop,       0)                    \
+    X(ST_SVC_SOUND_SEL,    sound_entry,       nop,       0)                    \
+    X(ST_SVC_MOTOR_CYC,    motor_entry,       nop,       0)                    \
+    X(ST_SVC_IO_STATS,     io_stats_entry,    nop,       0)                    \
+    X(ST_DISPENSING,       dispensing_entry,  nop,       EVB(EV_RUN))
+
+enum {
+#define UI_STATE_ENUM(s, entry, exit, expected) s,
+    UI_STATES(UI_STATE_ENUM)
+#undef UI_STATE_ENUM
+    ST_COUNT,
+    ST_STAY = -1
+};
+
+#define ST_SVC_TASKS (STB(ST_SVC_DISPENSE_IDX) | STB(ST_SVC_RESTOCK_IDX) | \
+                      STB(ST_SVC_SOUND_SEL) | STB(ST_SVC_MOTOR_CYC) | STB(ST_SVC_IO_STATS))
+
+/* ===== Transitions ===== */
+#define UI_TRANSITIONS(X) \
+    X(ST_MENU,             EV_DIGIT,        menu_digit,        0)                                             \
+    X(ST_MENU,             EV_BACK,         menu_back,         0)                                             \
+    X(ST_MENU,             EV_ENTER,        menu_enter,        STB(ST_MENU) | STB(ST_AMOUNT) | STB(ST_SVC_GATE)) \
+    X(ST_MENU,             EV_IDLE_TIMEOUT, idle_timeout,      STB(ST_MENU))                                  \
+                                                                                                              \
+    X(ST_AMOUNT,           EV_DIGIT,        amount_digit,      0)                                             \
+    X(ST_AMOUNT,           EV_BACK,         to_menu,           STB(ST_MENU))                                  \
+    X(ST_AMOUNT,           EV_ENTER,        amount_enter,      STB(ST_PAY))                                   \
+    X(ST_AMOUNT,           EV_IDLE_TIMEOUT, idle_timeout,      STB(ST_MENU))                                  \
+                                                                                                              \
+    X(ST_PAY,              EV_DIGIT,        pay_digit,         STB(ST_DISPENSING))                            \
+    X(ST_PAY,              EV_BACK,         to_menu,           STB(ST_MENU))                                  \
+    X(ST_PAY,              EV_ENTER,        key_reject,        0)                                             \
+    X(ST_PAY,              EV_IDLE_TIMEOUT, idle_timeout,      STB(ST_MENU))                                  \
+                                                                                                              \
+    X(ST_SVC_GATE,         EV_DIGIT,        svc_gate_confirm,  STB(ST_DOOR_OPENING))                          \
+    X(ST_SVC_GATE,         EV_BACK,         svc_gate_confirm,  STB(ST_DOOR_OPENING))                          \
+    X(ST_SVC_GATE,         EV_ENTER,        svc_gate_confirm,  STB(ST_DOOR_OPENING))                          \
+    X(ST_SVC_GATE,         EV_GATE_TIMEOUT, svc_gate_timeout,  STB(ST_MENU))                                  \
+                                                                                                              \
+    X(ST_RETURN_GATE,      EV_DIGIT,        return_gate_confirm, STB(ST_DOOR_CLOSING))                        \
+    X(ST_RETURN_GATE,      EV_BACK,         return_gate_confirm, STB(ST_DOOR_CLOSING))                        \
+    X(ST_RETURN_GATE,      EV_ENTER,        return_gate_confirm, STB(ST_DOOR_CLOSING))                        \
+    X(ST_RETURN_GATE,      EV_GATE_TIMEOUT, return_gate_timeout, STB(ST_SVC_MENU))                            \
+                                                                                                              \
+    X(ST_DOOR_OPENING,     EV_DIGIT,        key_reject,        0)                                             \
+    X(ST_DOOR_OPENING,     EV_BACK,         key_reject,        0)                                             \
+    X(ST_DOOR_OPENING,     EV_ENTER,        key_reject,        0)                                             \
+    X(ST_DOOR_OPENING,     EV_ANIM_DONE,    door_opened,       STB(ST_SVC_MENU))                              \
+                                                                                                              \
+    X(ST_DOOR_CLOSING,     EV_DIGIT,        key_reject,        0)                                             \
+    X(ST_DOOR_CLOSING,     EV_BACK,         key_reject,        0)                                             \
+    X(ST_DOOR_CLOSING,     EV_ENTER,        key_reject,        0)                                             \
+    X(ST_DOOR_CLOSING,     EV_ANIM_DONE,    door_closed,       STB(ST_MENU))                                  \
+                                                                                                              \
+    X(ST_SVC_MENU,         EV_DIGIT,        svc_menu_digit,    0)                                             \
+    X(ST_SVC_MENU,         EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_MENU,         EV_ENTER,        svc_menu_enter,    STB(ST_SVC_MENU) | STB(ST_RETURN_GATE) | ST_SVC_TASKS) \
+                                                                                                              \
+    X(ST_SVC_DISPENSE_IDX, EV_DIGIT,        svc_digit,         0)                                             \
+    X(ST_SVC_DISPENSE_IDX, EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_DISPENSE_IDX, EV_ENTER,        svc_disp_idx_enter, STB(ST_SVC_DISPENSE_IDX) | STB(ST_SVC_DISPENSE_AMT)) \
+                                                                                                              \
+    X(ST_SVC_DISPENSE_AMT, EV_DIGIT,        svc_digit,         0)                                             \
+    X(ST_SVC_DISPENSE_AMT, EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_DISPENSE_AMT, EV_ENTER,        svc_disp_amt_enter, STB(ST_SVC_DISPENSE_AMT) | STB(ST_SVC_MENU))  \
+                                                                                                              \
+    X(ST_SVC_RESTOCK_IDX,  EV_DIGIT,        svc_digit,         0)                                             \
+    X(ST_SVC_RESTOCK_IDX,  EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_RESTOCK_IDX,  EV_ENTER,        restock_idx_enter, STB(ST_SVC_RESTOCK_IDX) | STB(ST_SVC_RESTOCK_QTY)) \
+                                                                                                              \
+    X(ST_SVC_RESTOCK_QTY,  EV_DIGIT,        svc_digit,         0)                                             \
+    X(ST_SVC_RESTOCK_QTY,  EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_RESTOCK_QTY,  EV_ENTER,        restock_qty_enter, STB(ST_SVC_RESTOCK_QTY) | STB(ST_SVC_MENU))    \
+                                                                                                              \
+    X(ST_SVC_SOUND_SEL,    EV_DIGIT,        svc_digit,         0)                                             \
+    X(ST_SVC_SOUND_SEL,    EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_SOUND_SEL,    EV_ENTER,        sound_enter,       STB(ST_SVC_SOUND_SEL))                         \
+                                                                                                              \
+    X(ST_SVC_MOTOR_CYC,    EV_DIGIT,        svc_digit,         0)                                             \
+    X(ST_SVC_MOTOR_CYC,    EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_MOTOR_CYC,    EV_ENTER,        motor_enter,       STB(ST_SVC_MOTOR_CYC))                         \
+                                                                                                              \
+    X(ST_SVC_IO_STATS,     EV_DIGIT,        io_stats_page,     0)                                             \
+    X(ST_SVC_IO_STATS,     EV_BACK,         svc_back,          STB(ST_SVC_MENU))                              \
+    X(ST_SVC_IO_STATS,     EV_ENTER,        io_stats_next,     0)                                             \
+                                                                                                              \
+    X(ST_DISPENSING,       EV_DIGIT,        key_reject,        0)                                             \
+    X(ST_DISPENSING,       EV_BACK,         key_reject,        0)                                             \
+    X(ST_DISPENSING,       EV_ENTER,        key_reject,        0)                                             \
+    X(ST_DISPENSING,       EV_RUN,          dispense_run,      STB(ST_MENU))
+
+#endif